@@ -0,0 +1,831 @@
+#define _GNU_SOURCE // SEEK_DATA, SEEK_HOLE
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <block.h>
+#include <skinny.h>
+#include <sq.h>
+#include <stats.h>
+
+// Reproducible workloads against a scratch copy of an image.
+//
+// Every run starts from a fresh copy of the template image and draws its
+// random choices from a seeded generator, so two runs of the same binary
+// on the same template do the same work. Results go to stdout as JSON.
+
+#define CHUNK (64 * 1024)
+#define BATCH 64 // Paths per namei_batch() call
+
+static u64 seed = 42;
+static const char *template_path = "fs.img";
+static const char *work_path = "bench.img";
+static u32 max_dir = 100000;
+
+static int first_result = 1;
+
+// xorshift64*, good enough to pick offsets and names.
+static u64 rnd() {
+    seed ^= seed >> 12;
+    seed ^= seed << 25;
+    seed ^= seed >> 27;
+    return seed * 0x2545f4914f6cdd1dull;
+}
+
+static u64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+typedef struct result {
+    const char *name;
+    u64  ops;
+    u64  bytes;
+    u64  start;
+    u64 *lat; // Per-op latency in ns
+    u64  cap;
+} result;
+
+static void res_begin(result *r, const char *name) {
+    memset(r, 0, sizeof(result));
+    r->name = name;
+    stats_reset();
+    r->start = now_ns();
+}
+
+static void res_add(result *r, u64 t0, u64 bytes) {
+    if (r->ops == r->cap) {
+        r->cap = r->cap ? r->cap * 2 : 1024;
+        r->lat = realloc(r->lat, r->cap * sizeof(u64));
+        assert(r->lat);
+    }
+    r->lat[r->ops++] = now_ns() - t0;
+    r->bytes += bytes;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    u64 x = *(u64 *)a, y = *(u64 *)b;
+    return (x > y) - (x < y);
+}
+
+static double pct(result *r, double p) {
+    if (r->ops == 0)
+        return 0;
+    u64 i = (u64)(p * (r->ops - 1) + 0.5);
+    return r->lat[i] / 1000.0;
+}
+
+static void res_end(result *r) {
+    double secs = (now_ns() - r->start) / 1e9;
+    stats st;
+    stats_snapshot(&st);
+    qsort(r->lat, r->ops, sizeof(u64), cmp_u64);
+
+    printf("%s\n    {\"name\": \"%s\", \"ops\": %llu, \"bytes\": %llu, "
+           "\"secs\": %.6f, \"ops_per_sec\": %.1f, \"mb_per_sec\": %.2f, "
+           "\"p50_us\": %.2f, \"p99_us\": %.2f, \"bread\": %llu, "
+           "\"bwrite\": %llu, \"fat_read\": %llu, \"chain_step\": %llu, "
+           "\"balloc_scan\": %llu}",
+           first_result ? "" : ",", r->name, r->ops, r->bytes, secs,
+           r->ops / secs, r->bytes / secs / (1024.0 * 1024.0), pct(r, 0.50),
+           pct(r, 0.99), st.count[ST_BREAD], st.count[ST_BWRITE],
+           st.count[ST_FAT_READ], st.count[ST_CHAIN_STEP],
+           st.count[ST_BALLOC_SCAN]);
+    first_result = 0;
+    free(r->lat);
+}
+
+// Copies the data of `from` to `to`, leaving its holes as holes so that a
+// sparse template of any size is quick to copy.
+static void copy_image(const char *from, const char *to) {
+    int in = open(from, O_RDONLY);
+    int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    struct stat st;
+    if (in < 0 || out < 0 || fstat(in, &st) != 0 ||
+        ftruncate(out, st.st_size) != 0) {
+        fprintf(stderr, "bench: cannot copy %s to %s\n", from, to);
+        exit(1);
+    }
+
+    static char buf[1 << 20];
+    off_t data = 0;
+    while ((data = lseek(in, data, SEEK_DATA)) >= 0) {
+        off_t hole = lseek(in, data, SEEK_HOLE);
+        for (off_t pos = data; pos < hole;) {
+            size_t want = hole - pos < sizeof(buf) ? hole - pos : sizeof(buf);
+            ssize_t n = pread(in, buf, want, pos);
+            if (n <= 0 || pwrite(out, buf, n, pos) != n) {
+                fprintf(stderr, "bench: short copy to %s\n", to);
+                exit(1);
+            }
+            pos += n;
+        }
+        data = hole;
+    }
+
+    close(in);
+    close(out);
+}
+
+static inode *mkdir_at(char *parent, char *name) {
+    inode *dp = namei(parent);
+    assert(dp);
+    inode *ip = dirlink(dp, name, T_DIR);
+    assert(ip);
+    return ip;
+}
+
+// Sequential write and read back of `count` files of `size` bytes.
+static void bench_seq(u32 size, u32 count) {
+    static char buf[CHUNK];
+    char name[64];
+    result r;
+    inode **files = malloc(count * sizeof(inode *));
+    assert(files);
+
+    for (u32 i = 0; i < CHUNK; i++)
+        buf[i] = rnd();
+
+    snprintf(name, sizeof(name), "S%u", size / 1024);
+    inode *dp = mkdir_at("/", name);
+
+    snprintf(name, sizeof(name), "seq_write_%uk", size / 1024);
+    res_begin(&r, name);
+    for (u32 i = 0; i < count; i++) {
+        char fname[16];
+        snprintf(fname, sizeof(fname), "F%u", i);
+        files[i] = dirlink(dp, fname, T_FILE);
+        for (u32 off = 0; off < size; off += CHUNK) {
+            u32 n = size - off < CHUNK ? size - off : CHUNK;
+            u64 t0 = now_ns();
+            int got = writei(files[i], 0, buf, off, n);
+            res_add(&r, t0, n);
+            assert(got == n);
+        }
+    }
+    res_end(&r);
+
+    snprintf(name, sizeof(name), "seq_read_%uk", size / 1024);
+    res_begin(&r, name);
+    for (u32 i = 0; i < count; i++) {
+        for (u32 off = 0; off < size; off += CHUNK) {
+            u32 n = size - off < CHUNK ? size - off : CHUNK;
+            u64 t0 = now_ns();
+            int got = readi(files[i], 0, buf, off, n, NULL);
+            res_add(&r, t0, n);
+            assert(got == n);
+        }
+    }
+    res_end(&r);
+
+    // The same, summed in place instead of copied out.
+    snprintf(name, sizeof(name), "span_read_%uk", size / 1024);
+    res_begin(&r, name);
+    u64 sum = 0;
+    for (u32 i = 0; i < count; i++) {
+        for (u32 off = 0; off < size; off += CHUNK) {
+            u32 n = size - off < CHUNK ? size - off : CHUNK;
+            u64 t0 = now_ns();
+            span_iter it;
+            span sp;
+            span_begin(&it, files[i], off, n);
+            while (span_next(&it, &sp)) {
+                for (u32 k = 0; k < sp.len; k++)
+                    sum += ((u8 *)sp.data)[k];
+            }
+            span_end(&it);
+            res_add(&r, t0, n);
+        }
+    }
+    res_end(&r);
+    assert(sum != 0);
+
+    if (size >= 1024 * 1024) {
+        snprintf(name, sizeof(name), "rand_read_4k_%uk", size / 1024);
+        res_begin(&r, name);
+        for (u32 i = 0; i < 2000; i++) {
+            inode *ip = files[rnd() % count];
+            u32 off = (rnd() % (size / 4096)) * 4096;
+            u64 t0 = now_ns();
+            int got = readi(ip, 0, buf, off, 4096, NULL);
+            res_add(&r, t0, 4096);
+            assert(got == 4096);
+        }
+        res_end(&r);
+    }
+
+    free(files);
+}
+
+// Create, look up and list a directory of `n` entries, with 8.3 names or
+// long ones if `lfn` is set.
+static void bench_dir(u32 n, int lfn) {
+    const char *dir = lfn ? "N" : "D", *sfx = lfn ? "_lfn" : "";
+    char name[64], path[128];
+    result r;
+
+    snprintf(name, sizeof(name), "%s%u", dir, n);
+    inode *dp = mkdir_at("/", name);
+
+    snprintf(name, sizeof(name), "create%s_%u", sfx, n);
+    res_begin(&r, name);
+    for (u32 i = 0; i < n; i++) {
+        char fname[64];
+        snprintf(fname, sizeof(fname), lfn ? "Quarterly report %07u.pdf" : "F%07u", i);
+        u64 t0 = now_ns();
+        inode *ip = dirlink(dp, fname, T_FILE);
+        res_add(&r, t0, 0);
+        assert(ip);
+    }
+    res_end(&r);
+
+    u32 lookups = n < 1000 ? n : 1000;
+    snprintf(name, sizeof(name), "lookup%s_%u", sfx, n);
+    res_begin(&r, name);
+    for (u32 i = 0; i < lookups; i++) {
+        u32 k = rnd() % n;
+        if (lfn)
+            snprintf(path, sizeof(path), "/N%u/Quarterly report %07u.pdf", n, k);
+        else
+            snprintf(path, sizeof(path), "/D%u/F%07u", n, k);
+        u64 t0 = now_ns();
+        inode *ip = namei(path);
+        res_add(&r, t0, 0);
+        assert(ip);
+    }
+    res_end(&r);
+
+    // The same lookups BATCH paths to a namei_batch() call, an op each.
+    static char bpaths[BATCH][128];
+    char *bp[BATCH];
+    u32 inums[BATCH];
+    snprintf(name, sizeof(name), "lookup_batch%u%s_%u", BATCH, sfx, n);
+    res_begin(&r, name);
+    for (u32 i = 0; i < lookups; i += BATCH) {
+        for (u32 j = 0; j < BATCH; j++) {
+            u32 k = rnd() % n;
+            if (lfn)
+                snprintf(bpaths[j], 128, "/N%u/Quarterly report %07u.pdf", n, k);
+            else
+                snprintf(bpaths[j], 128, "/D%u/F%07u", n, k);
+            bp[j] = bpaths[j];
+        }
+        u64 t0 = now_ns();
+        namei_batch(bp, BATCH, inums);
+        res_add(&r, t0, 0);
+        for (u32 j = 0; j < BATCH; j++)
+            assert(inums[j] != NAMEI_NONE);
+    }
+    res_end(&r);
+
+    snprintf(name, sizeof(name), "list%s_%u", sfx, n);
+    snprintf(path, sizeof(path), "/%s%u", dir, n);
+    res_begin(&r, name);
+    for (u32 i = 0; i < 10; i++) {
+        u64 t0 = now_ns();
+        inode *ip = namei(path);
+        fat32_dirent dents[BSIZE / sizeof(fat32_dirent)];
+        u32 live = 0;
+        for (u32 off = 0; off < ip->size; off += BSIZE) {
+            readi(ip, 0, dents, off, BSIZE, NULL);
+            for (u32 j = 0; j < BSIZE / sizeof(fat32_dirent); j++) {
+                u8 c = dents[j].name[0];
+                if (c == 0x00)
+                    goto done;
+                live += (c != 0xe5);
+            }
+        }
+    done:
+        assert(live >= n);
+        res_add(&r, t0, 0);
+    }
+    res_end(&r);
+}
+
+// Resolve a path `depth` directories deep.
+static void bench_deep(u32 depth) {
+    char path[1024] = "", name[64];
+    result r;
+
+    for (u32 i = 0; i < depth; i++) {
+        char elem[16];
+        snprintf(elem, sizeof(elem), "L%u", i);
+        mkdir_at(i ? path : "/", elem);
+        strcat(path, "/");
+        strcat(path, elem);
+    }
+
+    snprintf(name, sizeof(name), "deep_path_%u", depth);
+    res_begin(&r, name);
+    for (u32 i = 0; i < 1000; i++) {
+        u64 t0 = now_ns();
+        inode *ip = namei(path);
+        res_add(&r, t0, 0);
+        assert(ip);
+    }
+    res_end(&r);
+}
+
+// Marks every other free cluster among the next 2 * `n` as used, so
+// that the next `n` allocations each land in a one-cluster hole.
+static void fragment(fat32 *fs, u32 n) {
+    u32 fat_start = fs->bpb.rsvd_sec_cnt, fat_sz = fs->bpb.fat_sz_32;
+    u32 seen = 0;
+
+    for (u32 sec = 0; sec < fat_sz && seen < 2 * n; sec++) {
+        u32 ents[BSIZE / 4];
+        int dirty = 0;
+        bread(ents, fat_start + sec, 1);
+        for (u32 i = 0; i < BSIZE / 4 && seen < 2 * n; i++) {
+            if (sec == 0 && i < 2)
+                continue;
+            if (ents[i] != FE_FREE)
+                continue;
+            if (seen++ % 2 == 0) {
+                ents[i] = 0x0fffffff;
+                fs->free_clus--;
+                dirty = 1;
+            }
+        }
+        if (dirty) {
+            for (u32 f = 0; f < fs->bpb.num_fats; f++)
+                bwrite(ents, fat_start + f * fat_sz + sec, 1);
+        }
+    }
+    fs->fsinfo_dirty = 1;
+}
+
+// Grow a file one cluster at a time on a fragmented free space.
+static void bench_frag(fat32 *fs, u32 n) {
+    static char buf[BSIZE];
+    char name[64];
+    result r;
+
+    fragment(fs, n);
+    inode *ip = dirlink(namei("/"), "FRAG", T_FILE);
+
+    snprintf(name, sizeof(name), "frag_alloc_%u", n);
+    res_begin(&r, name);
+    for (u32 i = 0; i < n; i++) {
+        u64 t0 = now_ns();
+        int got = writei(ip, 0, buf, i * BSIZE, BSIZE);
+        res_add(&r, t0, BSIZE);
+        assert(got == BSIZE);
+    }
+    res_end(&r);
+}
+
+// Copy `count` files of `size` bytes out to a host file, through a buffer
+// with readi() and write(), then straight from the image with iexport().
+static void bench_export(u32 size, u32 count) {
+    static char buf[CHUNK];
+    char name[64];
+    result r;
+    inode **files = malloc(count * sizeof(inode *));
+    FILE *out = tmpfile();
+    assert(files && out);
+    int fd = fileno(out);
+
+    for (u32 i = 0; i < CHUNK; i++)
+        buf[i] = rnd();
+    snprintf(name, sizeof(name), "X%u", size / 1024);
+    inode *dp = mkdir_at("/", name);
+    for (u32 i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "F%u", i);
+        files[i] = dirlink(dp, name, T_FILE);
+        for (u32 off = 0; off < size; off += CHUNK) {
+            u32 n = size - off < CHUNK ? size - off : CHUNK;
+            int got = writei(files[i], 0, buf, off, n);
+            assert(got == n);
+        }
+    }
+
+    snprintf(name, sizeof(name), "export_readi_%uk", size / 1024);
+    res_begin(&r, name);
+    for (u32 i = 0; i < count; i++) {
+        assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+        u64 t0 = now_ns();
+        for (u32 off = 0; off < size; off += CHUNK) {
+            u32 n = size - off < CHUNK ? size - off : CHUNK;
+            int got = readi(files[i], 0, buf, off, n, NULL);
+            assert(got == n && write(fd, buf, n) == n);
+        }
+        res_add(&r, t0, size);
+    }
+    res_end(&r);
+
+    snprintf(name, sizeof(name), "export_%uk", size / 1024);
+    res_begin(&r, name);
+    for (u32 i = 0; i < count; i++) {
+        assert(ftruncate(fd, 0) == 0 && lseek(fd, 0, SEEK_SET) == 0);
+        u64 t0 = now_ns();
+        long got = iexport(files[i], 0, size, fd);
+        res_add(&r, t0, size);
+        assert(got == size);
+    }
+    res_end(&r);
+
+    fclose(out);
+    free(files);
+}
+
+// Duplicate a template of `size` bytes `count` times, through a buffer
+// with readi() and writei(), then with icopy().
+static void bench_copy(u32 size, u32 count) {
+    static char buf[CHUNK];
+    char name[64];
+    result r;
+
+    for (u32 i = 0; i < CHUNK; i++)
+        buf[i] = rnd();
+    snprintf(name, sizeof(name), "C%u", size / 1024);
+    inode *dp = mkdir_at("/", name);
+    inode *src = dirlink(dp, "TEMPLATE", T_FILE);
+    for (u32 off = 0; off < size; off += CHUNK) {
+        u32 n = size - off < CHUNK ? size - off : CHUNK;
+        int got = writei(src, 0, buf, off, n);
+        assert(got == n);
+    }
+
+    snprintf(name, sizeof(name), "copy_readi_%uk", size / 1024);
+    res_begin(&r, name);
+    for (u32 i = 0; i < count; i++) {
+        char fname[16];
+        snprintf(fname, sizeof(fname), "R%u", i);
+        u64 t0 = now_ns();
+        inode *ip = dirlink(dp, fname, T_FILE);
+        for (u32 off = 0; off < size; off += CHUNK) {
+            u32 n = size - off < CHUNK ? size - off : CHUNK;
+            int got = readi(src, 0, buf, off, n, NULL);
+            assert(got == n && writei(ip, 0, buf, off, n) == n);
+        }
+        iput(ip);
+        res_add(&r, t0, size);
+    }
+    res_end(&r);
+
+    snprintf(name, sizeof(name), "copy_%uk", size / 1024);
+    res_begin(&r, name);
+    for (u32 i = 0; i < count; i++) {
+        char fname[16];
+        snprintf(fname, sizeof(fname), "C%u", i);
+        u64 t0 = now_ns();
+        inode *ip = icopy(src, dp, fname);
+        res_add(&r, t0, size);
+        assert(ip);
+        iput(ip);
+    }
+    res_end(&r);
+    iput(src);
+}
+
+// Read `count` files of `size` bytes, two halves each, `rounds` times:
+// with readi() one after the other, then as one batch per round through a
+// submission queue with 4 workers.
+static void bench_sq(u32 size, u32 count, u32 rounds) {
+    static char buf[CHUNK];
+    char name[64];
+    result r;
+    inode **files = malloc(count * sizeof(inode *));
+    char *dst = malloc((u64)count * size);
+    sq_op *ops = malloc(2 * count * sizeof(sq_op));
+    sq_cqe *cqes = malloc(2 * count * sizeof(sq_cqe));
+    struct iovec *iov = malloc(2 * count * sizeof(struct iovec));
+    assert(size <= CHUNK && files && dst && ops && cqes && iov);
+
+    for (u32 i = 0; i < size; i++)
+        buf[i] = rnd();
+    snprintf(name, sizeof(name), "Q%u", size / 1024);
+    inode *dp = mkdir_at("/", name);
+    for (u32 i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "F%u", i);
+        files[i] = dirlink(dp, name, T_FILE);
+        assert(writei(files[i], 0, buf, 0, size) == size);
+    }
+
+    snprintf(name, sizeof(name), "sq_readi_%uk_x%u", size / 1024, count);
+    res_begin(&r, name);
+    for (u32 k = 0; k < rounds; k++) {
+        u64 t0 = now_ns();
+        for (u32 i = 0; i < count; i++) {
+            char *d = dst + (u64)i * size;
+            assert(readi(files[i], 0, d, 0, size / 2, NULL) == size / 2);
+            assert(readi(files[i], 0, d + size / 2, size / 2, size - size / 2,
+                         NULL) == size - size / 2);
+        }
+        res_add(&r, t0, (u64)count * size);
+    }
+    res_end(&r);
+
+    for (u32 i = 0; i < count; i++) {
+        char *d = dst + (u64)i * size;
+        iov[2 * i] = (struct iovec){d, size / 2};
+        iov[2 * i + 1] = (struct iovec){d + size / 2, size - size / 2};
+        ops[2 * i] = (sq_op){.op = SQ_READ, .ip = files[i], .off = 0,
+                             .iov = &iov[2 * i], .niov = 1};
+        ops[2 * i + 1] = (sq_op){.op = SQ_READ, .ip = files[i],
+                                 .off = size / 2, .iov = &iov[2 * i + 1],
+                                 .niov = 1};
+    }
+    sq *q = sq_open(4);
+    snprintf(name, sizeof(name), "sq_%uk_x%u", size / 1024, count);
+    res_begin(&r, name);
+    for (u32 k = 0; k < rounds; k++) {
+        u64 t0 = now_ns();
+        sq_submit(q, ops, 2 * count);
+        u32 n = 0;
+        while (n < 2 * count)
+            n += sq_reap(q, cqes + n, 1, 2 * count - n);
+        res_add(&r, t0, (u64)count * size);
+        for (u32 i = 0; i < n; i++)
+            assert(cqes[i].res > 0);
+    }
+    res_end(&r);
+    sq_close(q);
+
+    for (u32 i = 0; i < count; i++)
+        iput(files[i]);
+    iput(dp);
+    free(files);
+    free(dst);
+    free(ops);
+    free(cqes);
+    free(iov);
+}
+
+// `count` random single-sector reads spread over `span` bytes of the data
+// area, or all of it if that's smaller. With 4k pages nearly each one
+// misses the TLB once the span is well past its reach; see -H.
+static void bench_rand(fat32 *fs, u32 count, u64 span) {
+    char name[64], buf[BSIZE];
+    result r;
+    u64 nsec = block_nsec() - fs->rootdir_base_sec;
+    if (nsec > span / BSIZE)
+        nsec = span / BSIZE;
+
+    // Fault it all in first, only the lookups are to be timed.
+    for (u64 s = 0; s < nsec; s += 4096 / BSIZE)
+        bread(buf, fs->rootdir_base_sec + s, 1);
+
+    snprintf(name, sizeof(name), "rand_bread_%lluM", nsec * BSIZE >> 20);
+    res_begin(&r, name);
+    for (u32 i = 0; i < count; i++) {
+        sector_t sec = fs->rootdir_base_sec + rnd() % nsec;
+        u64 t0 = now_ns();
+        bread(buf, sec, 1);
+        res_add(&r, t0, BSIZE);
+    }
+    res_end(&r);
+}
+
+// Delete `count` files of `size` bytes, the clusters are freed behind
+// our back so only the dir entry update should show.
+static void bench_unlink(u32 count, u32 size) {
+    char name[64], path[64];
+    result r;
+
+    for (u32 i = 0; i < count; i++) {
+        snprintf(name, sizeof(name), "U%u", i);
+        inode *ip = dirlink(namei("/"), name, T_FILE);
+        int got = itruncate(ip, size);
+        assert(got == 0);
+    }
+
+    snprintf(name, sizeof(name), "unlink_%uk", size / 1024);
+    res_begin(&r, name);
+    for (u32 i = 0; i < count; i++) {
+        snprintf(path, sizeof(path), "/U%u", i);
+        u64 t0 = now_ns();
+        int got = fat_unlink(path);
+        res_add(&r, t0, 0);
+        assert(got == 0);
+    }
+    res_end(&r);
+    fs_sync();
+}
+
+// The cluster math one piece at a time, on a file of `nclus` clusters
+// gone over `rounds` times: block lookups, sector sized reads and writes,
+// the whole file in one read and one write, and a span per cluster. Run
+// on images with different cluster sizes to compare them.
+static void bench_geom(fat32 *fs, u32 nclus, u32 rounds) {
+    static char buf[BSIZE];
+    u32 cbytes = fs->bpb.sec_per_clus * BSIZE, size = nclus * cbytes;
+    char name[64], *all = malloc(size);
+    result r;
+    assert(all);
+
+    inode *ip = dirlink(namei("/"), "GEOM.BIN", T_FILE);
+    for (u32 off = 0; off < size; off += BSIZE) {
+        int got = writei(ip, 0, buf, off, BSIZE);
+        assert(got == BSIZE);
+    }
+
+    snprintf(name, sizeof(name), "geom_bmap_spc%u", fs->bpb.sec_per_clus);
+    res_begin(&r, name);
+    for (u32 k = 0; k < rounds; k++) {
+        u64 t0 = now_ns();
+        for (u32 off = 0; off < size; off += BSIZE) {
+            int got = readi(ip, 0, buf, off, 1, NULL);
+            assert(got == 1);
+        }
+        res_add(&r, t0, 0);
+    }
+    res_end(&r);
+
+    snprintf(name, sizeof(name), "geom_readi_spc%u", fs->bpb.sec_per_clus);
+    res_begin(&r, name);
+    for (u32 k = 0; k < rounds; k++) {
+        u64 t0 = now_ns();
+        for (u32 off = 0; off < size; off += BSIZE) {
+            int got = readi(ip, 0, buf, off, BSIZE, NULL);
+            assert(got == BSIZE);
+        }
+        res_add(&r, t0, size);
+    }
+    res_end(&r);
+
+    snprintf(name, sizeof(name), "geom_writei_spc%u", fs->bpb.sec_per_clus);
+    res_begin(&r, name);
+    for (u32 k = 0; k < rounds; k++) {
+        u64 t0 = now_ns();
+        for (u32 off = 0; off < size; off += BSIZE) {
+            int got = writei(ip, 0, buf, off, BSIZE);
+            assert(got == BSIZE);
+        }
+        res_add(&r, t0, size);
+    }
+    res_end(&r);
+
+    snprintf(name, sizeof(name), "geom_readall_spc%u", fs->bpb.sec_per_clus);
+    res_begin(&r, name);
+    for (u32 k = 0; k < rounds; k++) {
+        u64 t0 = now_ns();
+        int got = readi(ip, 0, all, 0, size, NULL);
+        assert(got == size);
+        res_add(&r, t0, size);
+    }
+    res_end(&r);
+
+    snprintf(name, sizeof(name), "geom_writeall_spc%u", fs->bpb.sec_per_clus);
+    res_begin(&r, name);
+    for (u32 k = 0; k < rounds; k++) {
+        u64 t0 = now_ns();
+        int got = writei(ip, 0, all, 0, size);
+        assert(got == size);
+        res_add(&r, t0, size);
+    }
+    res_end(&r);
+
+    snprintf(name, sizeof(name), "geom_span_spc%u", fs->bpb.sec_per_clus);
+    res_begin(&r, name);
+    for (u32 k = 0; k < rounds; k++) {
+        u64 t0 = now_ns();
+        for (u32 off = 0; off < size; off += cbytes) {
+            span_iter it;
+            span sp;
+            span_begin(&it, ip, off, cbytes);
+            while (span_next(&it, &sp))
+                buf[0] ^= *(const char *)sp.data;
+            span_end(&it);
+        }
+        res_add(&r, t0, size);
+    }
+    res_end(&r);
+    iput(ip);
+    free(all);
+}
+
+// Remount `count` times and time init_fs() up to the first read of a
+// file, with FSInfo as written or with its free count dropped. Then how
+// long the free space index takes to cover the FAT after a mount.
+static void bench_mount(fat32 *fs, u32 count) {
+    char buf[4096], name[64];
+    result r;
+
+    inode *ip = dirlink(namei("/"), "MOUNT.BIN", T_FILE);
+    int got = writei(ip, 0, buf, 0, sizeof(buf));
+    assert(got == sizeof(buf));
+    iput(ip);
+
+    for (int lose = 0; lose < 2; lose++) {
+        snprintf(name, sizeof(name), lose ? "mount_no_fsinfo" : "mount");
+        res_begin(&r, name);
+        for (u32 i = 0; i < count; i++) {
+            fs_sync();
+            if (lose) {
+                bread(buf, fs->bpb.fs_info, 1);
+                *(u32 *)(buf + 488) = 0xffffffff;
+                bwrite(buf, fs->bpb.fs_info, 1);
+            }
+            u64 t0 = now_ns();
+            init_fs(fs);
+            ip = namei("/MOUNT.BIN");
+            got = readi(ip, 0, buf, 0, sizeof(buf), NULL);
+            res_add(&r, t0, 0);
+            assert(got == sizeof(buf));
+            iput(ip);
+        }
+        res_end(&r);
+    }
+
+    snprintf(name, sizeof(name), "fat_index_%uk", fs->bpb.fat_sz_32 / 2);
+    res_begin(&r, name);
+    for (u32 i = 0; i < count; i++) {
+        fs_sync();
+        u64 t0 = now_ns();
+        init_fs(fs);
+        fs_index_wait();
+        res_add(&r, t0, (u64)fs->bpb.fat_sz_32 * BSIZE);
+    }
+    res_end(&r);
+    fs_sync();
+}
+
+static void usage() {
+    fprintf(stderr,
+            "usage: bench [-i template] [-o scratch] [-m max_dir] [-s seed]\n"
+            "             [-t strict|relatime|lazy] [-H]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "i:o:m:s:t:H")) != -1) {
+        switch (opt) {
+        case 'i':
+            template_path = optarg;
+            break;
+        case 'o':
+            work_path = optarg;
+            break;
+        case 'm':
+            max_dir = atoi(optarg);
+            break;
+        case 's':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        case 't':
+            if (strcmp(optarg, "strict") == 0)
+                skinny_times = TIME_STRICT;
+            else if (strcmp(optarg, "relatime") == 0)
+                skinny_times = TIME_RELATIME;
+            else if (strcmp(optarg, "lazy") == 0)
+                skinny_times = TIME_LAZY;
+            else
+                usage();
+            break;
+        case 'H':
+            block_hugepages = 0;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    copy_image(template_path, work_path);
+    open_block_device(work_path);
+
+    skinny_debug = 0;
+    fat32 fs;
+    init_fs(&fs);
+
+    printf("{\"seed\": %llu, \"template\": \"%s\", \"hugepages\": %d, "
+           "\"results\": [",
+           seed, template_path, block_hugepages);
+
+    bench_seq(4 * 1024, 256);
+    bench_seq(64 * 1024, 32);
+    bench_seq(1024 * 1024, 4);
+    bench_seq(4 * 1024 * 1024, 1);
+
+    for (u32 n = 10; n <= max_dir; n *= 10)
+        bench_dir(n, 0);
+    for (u32 n = 10; n <= max_dir; n *= 10)
+        bench_dir(n, 1);
+
+    bench_deep(32);
+    bench_frag(&fs, 2048);
+    bench_unlink(8, 1024 * 1024);
+    bench_mount(&fs, 32);
+    bench_geom(&fs, 16, 2000);
+    bench_export(64 * 1024, 32);
+    bench_export(4 * 1024 * 1024, 4);
+    bench_copy(64 * 1024, 32);
+    bench_copy(1024 * 1024, 4);
+    bench_sq(4 * 1024, 256, 16);
+    bench_rand(&fs, 200000, 1ull << 30);
+
+    printf("\n]}\n");
+
+    fs_sync();
+    release_block();
+    return 0;
+}
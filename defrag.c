@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <block.h>
+#include <defrag.h>
+#include <skinny.h>
+
+static void usage() {
+    fprintf(stderr, "usage: defrag [-r] [-c] [-v] [-t ms] [-b MB] [image]\n");
+    exit(1);
+}
+
+// Prints a fragmentation report, then (unless -r) runs passes until the
+// tree is done or a budget from -t or -b runs out, and reports again.
+// -c compacts every directory first.
+int main(int argc, char **argv) {
+    int report_only = 0, compact = 0, verbose = 0, opt;
+    defrag_budget budget = {0};
+
+    while ((opt = getopt(argc, argv, "rcvt:b:")) != -1) {
+        switch (opt) {
+        case 'r':
+            report_only = 1;
+            break;
+        case 'c':
+            compact = 1;
+            break;
+        case 'v':
+            verbose = 1;
+            break;
+        case 't':
+            budget.max_ns = strtoull(optarg, NULL, 0) * 1000000ull;
+            break;
+        case 'b':
+            budget.max_bytes = strtoull(optarg, NULL, 0) << 20;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind < argc - 1)
+        usage();
+
+    open_block_device(optind < argc ? argv[optind] : "fs.img");
+    skinny_debug = 0;
+
+    fat32 fs;
+    init_fs(&fs);
+
+    frag_report rep;
+    frag_scan(&fs, &rep, verbose ? stdout : NULL);
+    frag_print_report(stdout, &rep);
+
+    if (!report_only && compact)
+        printf("\ncompacted directories, %u clusters released\n",
+               compact_dirs(&fs));
+
+    if (!report_only) {
+        defrag_result res;
+        int done = defrag(&fs, &budget, &res);
+        printf("\nmoved %u, skipped %u, %.1f MB in %.3fs%s\n\n", res.moved,
+               res.skipped, res.bytes / (1024.0 * 1024.0), res.ns / 1e9,
+               done ? "" : ", budget ran out");
+        frag_scan(&fs, &rep, verbose ? stdout : NULL);
+        frag_print_report(stdout, &rep);
+    }
+
+    fs_sync();
+    release_block();
+    return 0;
+}
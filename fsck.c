@@ -0,0 +1,52 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <block.h>
+#include <check.h>
+#include <skinny.h>
+
+static void usage() {
+    fprintf(stderr, "usage: fsck [-r] [-v] [-j threads] [image]\n");
+    exit(8);
+}
+
+// Exit codes follow fsck(8): 0 clean, 1 errors corrected, 4 errors left.
+int main(int argc, char **argv) {
+    int flags = 0, nthreads = 0, opt;
+
+    while ((opt = getopt(argc, argv, "rvj:")) != -1) {
+        switch (opt) {
+        case 'r':
+            flags |= FSCK_REPAIR;
+            break;
+        case 'v':
+            flags |= FSCK_VERBOSE;
+            break;
+        case 'j':
+            nthreads = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind < argc - 1)
+        usage();
+
+    open_block_device(optind < argc ? argv[optind] : "fs.img");
+
+    fat32 fs;
+    init_fs(&fs);
+
+    fsck_report rep;
+    u32 problems = fsck(&fs, flags, nthreads, &rep);
+    fsck_print_report(&rep);
+
+    // The indexer started by init_fs() still reads the image.
+    fs_index_wait();
+    release_block();
+
+    if (problems == 0)
+        return 0;
+    return (flags & FSCK_REPAIR) ? 1 : 4;
+}
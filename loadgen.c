@@ -0,0 +1,315 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <server.h>
+
+// Load generator for skinnyd.
+//
+// Sets up `-f` files of `-z` bytes under /LOADGEN, then runs `-c` clients
+// for `-t` seconds, each on its own connection with `-d` requests in
+// flight. Requests are reads of a whole file, `-w` percent writes of one
+// and a tenth stats. Results go to stdout as JSON, like bench.
+
+enum { L_READ, L_WRITE, L_STAT, L_NOPS };
+static const char *op_names[] = {"read", "write", "stat"};
+
+static const char *sock_path = "skinny.sock";
+static u32 nclients = 16, depth = 8, secs = 5, nfiles = 64, fsize = 4096;
+static u32 write_pct = 10;
+static u64 seed = 42;
+
+typedef struct lat {
+    u64 *ns;
+    u64 n, cap;
+    u64 bytes;
+} lat;
+
+typedef struct client {
+    pthread_t tid;
+    u32 id;
+    u64 rng;
+    lat lat[L_NOPS];
+    u64 errors;
+} client;
+
+static u64 now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static u64 rnd(client *c) {
+    c->rng ^= c->rng << 13;
+    c->rng ^= c->rng >> 7;
+    c->rng ^= c->rng << 17;
+    return c->rng;
+}
+
+static void lat_add(lat *l, u64 ns, u64 bytes) {
+    if (l->n == l->cap) {
+        l->cap = l->cap ? l->cap * 2 : 4096;
+        l->ns = realloc(l->ns, l->cap * sizeof(u64));
+        assert(l->ns);
+    }
+    l->ns[l->n++] = ns;
+    l->bytes += bytes;
+}
+
+static int call(int fd, p_req rq, const void *payload, u32 plen, void *buf,
+                u32 cap) {
+    p_reply rp;
+    int pfd;
+    if (srv_send(fd, &rq, payload, plen) != 0 ||
+        srv_recv(fd, &rp, buf, cap, &pfd) != 0) {
+        fprintf(stderr, "loadgen: connection lost\n");
+        exit(1);
+    }
+    if (pfd >= 0)
+        close(pfd);
+    return rp.res;
+}
+
+static int connect_or_die() {
+    int fd = srv_connect(sock_path);
+    if (fd < 0) {
+        fprintf(stderr, "loadgen: cannot connect to %s\n", sock_path);
+        exit(1);
+    }
+    return fd;
+}
+
+// Opens the files, making them first if they aren't there. Stores the
+// handles in `fh`.
+static void open_files(int fd, int *fh, int make) {
+    char path[64];
+    p_stat st;
+
+    if (make && call(fd, (p_req){.op = P_STAT}, "/LOADGEN", 8, &st,
+                     sizeof(st)) < 0) {
+        int root = call(fd, (p_req){.op = P_OPEN}, "/", 1, &st, sizeof(st));
+        assert(root >= 0);
+        assert(call(fd, (p_req){.op = P_CREATE, .fh = root, .n = T_DIR},
+                    "LOADGEN", 7, &st, sizeof(st)) >= 0);
+    }
+
+    char *buf = malloc(fsize);
+    assert(buf);
+    memset(buf, 'x', fsize);
+    for (u32 i = 0; i < nfiles; i++) {
+        snprintf(path, sizeof(path), "/LOADGEN/F%u", i);
+        fh[i] = call(fd, (p_req){.op = P_OPEN}, path, strlen(path), &st,
+                     sizeof(st));
+        if (fh[i] < 0 && make) {
+            int dir = call(fd, (p_req){.op = P_OPEN}, "/LOADGEN", 8, &st,
+                           sizeof(st));
+            fh[i] = call(fd, (p_req){.op = P_CREATE, .fh = dir, .n = T_FILE},
+                         path + 9, strlen(path + 9), &st, sizeof(st));
+            call(fd, (p_req){.op = P_CLOSE, .fh = dir}, NULL, 0, NULL, 0);
+        }
+        if (fh[i] < 0) {
+            fprintf(stderr, "loadgen: cannot open %s\n", path);
+            exit(1);
+        }
+        if (make && st.size != fsize &&
+            call(fd, (p_req){.op = P_WRITE, .fh = fh[i]}, buf, fsize, NULL,
+                 0) != fsize) {
+            fprintf(stderr, "loadgen: cannot write %s\n", path);
+            exit(1);
+        }
+    }
+    free(buf);
+}
+
+typedef struct slot {
+    u64 sent;
+    int op;
+} slot;
+
+static void send_one(client *c, int fd, int *fh, slot *s, u32 tag, char *buf,
+                     char *path) {
+    u32 f = rnd(c) % nfiles, dice = rnd(c) % 100;
+    p_req rq = {.tag = tag};
+
+    s->op = dice < write_pct ? L_WRITE : dice < write_pct + 10 ? L_STAT : L_READ;
+    s->sent = now_ns();
+    if (s->op == L_WRITE) {
+        rq.op = P_WRITE;
+        rq.fh = fh[f];
+        assert(srv_send(fd, &rq, buf, fsize) == 0);
+    } else if (s->op == L_STAT) {
+        rq.op = P_STAT;
+        int len = snprintf(path, 64, "/LOADGEN/F%u", f);
+        assert(srv_send(fd, &rq, path, len) == 0);
+    } else {
+        rq.op = P_READ;
+        rq.fh = fh[f];
+        rq.n = fsize;
+        rq.flags = P_FD;
+        assert(srv_send(fd, &rq, NULL, 0) == 0);
+    }
+}
+
+static void *run_client(void *arg) {
+    client *c = arg;
+    int fd = connect_or_die();
+    int *fh = malloc(nfiles * sizeof(int));
+    slot *slots = calloc(depth, sizeof(slot));
+    char *buf = malloc(fsize), path[64];
+    assert(fh && slots && buf);
+    memset(buf, 'a' + c->id % 26, fsize);
+    open_files(fd, fh, 0);
+
+    u64 end = now_ns() + secs * 1000000000ull;
+    u32 inflight = 0;
+    for (u32 t = 0; t < depth; t++, inflight++)
+        send_one(c, fd, fh, &slots[t], t, buf, path);
+
+    while (inflight > 0) {
+        p_reply rp;
+        int pfd;
+        if (srv_recv(fd, &rp, buf, fsize, &pfd) != 0) {
+            fprintf(stderr, "loadgen: connection lost\n");
+            exit(1);
+        }
+        assert(rp.tag < depth);
+        slot *s = &slots[rp.tag];
+        if (pfd >= 0) {
+            // A big read came as a file of its own.
+            if (pread(pfd, buf, rp.res, 0) != rp.res)
+                c->errors++;
+            close(pfd);
+        }
+        if (rp.res < 0)
+            c->errors++;
+        lat_add(&c->lat[s->op], now_ns() - s->sent,
+                s->op == L_STAT || rp.res < 0 ? 0 : rp.res);
+        inflight--;
+        if (now_ns() < end) {
+            send_one(c, fd, fh, s, rp.tag, buf, path);
+            inflight++;
+        }
+    }
+
+    close(fd);
+    free(fh);
+    free(slots);
+    free(buf);
+    return NULL;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    u64 x = *(u64 *)a, y = *(u64 *)b;
+    return (x > y) - (x < y);
+}
+
+static double pct(lat *l, double p) {
+    if (l->n == 0)
+        return 0;
+    return l->ns[(u64)(p * (l->n - 1) + 0.5)] / 1000.0;
+}
+
+static void print_lat(const char *name, lat *l, double wall, int last) {
+    qsort(l->ns, l->n, sizeof(u64), cmp_u64);
+    printf("    {\"name\": \"%s\", \"ops\": %llu, \"ops_per_sec\": %.1f, "
+           "\"mb_per_sec\": %.2f, \"p50_us\": %.2f, \"p99_us\": %.2f, "
+           "\"p999_us\": %.2f}%s\n",
+           name, l->n, l->n / wall, l->bytes / wall / (1024.0 * 1024.0),
+           pct(l, 0.50), pct(l, 0.99), pct(l, 0.999), last ? "" : ",");
+}
+
+static void usage() {
+    fprintf(stderr, "usage: loadgen [-s socket] [-c clients] [-d depth] "
+                    "[-t secs] [-f files] [-z size] [-w write%%] [-S seed]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:c:d:t:f:z:w:S:")) != -1) {
+        switch (opt) {
+        case 's':
+            sock_path = optarg;
+            break;
+        case 'c':
+            nclients = atoi(optarg);
+            break;
+        case 'd':
+            depth = atoi(optarg);
+            break;
+        case 't':
+            secs = atoi(optarg);
+            break;
+        case 'f':
+            nfiles = atoi(optarg);
+            break;
+        case 'z':
+            fsize = strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            write_pct = atoi(optarg);
+            break;
+        case 'S':
+            seed = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc || nclients == 0 || depth == 0 || nfiles == 0 ||
+        write_pct > 90 || fsize > P_MAX_PAYLOAD)
+        usage();
+
+    int fd = connect_or_die();
+    int *fh = malloc(nfiles * sizeof(int));
+    assert(fh);
+    open_files(fd, fh, 1);
+    close(fd);
+    free(fh);
+
+    client *cs = calloc(nclients, sizeof(client));
+    assert(cs);
+    u64 t0 = now_ns();
+    for (u32 i = 0; i < nclients; i++) {
+        cs[i].id = i;
+        cs[i].rng = seed * 2654435761u + i + 1;
+        assert(pthread_create(&cs[i].tid, NULL, run_client, &cs[i]) == 0);
+    }
+
+    lat all[L_NOPS + 1] = {0};
+    u64 errors = 0;
+    for (u32 i = 0; i < nclients; i++) {
+        pthread_join(cs[i].tid, NULL);
+        errors += cs[i].errors;
+        for (int op = 0; op < L_NOPS; op++) {
+            lat *l = &cs[i].lat[op];
+            for (u64 k = 0; k < l->n; k++) {
+                lat_add(&all[op], l->ns[k], 0);
+                lat_add(&all[L_NOPS], l->ns[k], 0);
+            }
+            all[op].bytes += l->bytes;
+            all[L_NOPS].bytes += l->bytes;
+            free(l->ns);
+        }
+    }
+    double wall = (now_ns() - t0) / 1e9;
+
+    printf("{\"clients\": %u, \"depth\": %u, \"files\": %u, \"size\": %u, "
+           "\"write_pct\": %u, \"secs\": %.3f, \"errors\": %llu, "
+           "\"results\": [\n",
+           nclients, depth, nfiles, fsize, write_pct, wall, errors);
+    for (int op = 0; op < L_NOPS; op++)
+        print_lat(op_names[op], &all[op], wall, 0);
+    print_lat("all", &all[L_NOPS], wall, 1);
+    printf("]}\n");
+
+    for (int op = 0; op <= L_NOPS; op++)
+        free(all[op].ns);
+    free(cs);
+    return errors != 0;
+}
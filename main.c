@@ -8,6 +8,7 @@
 #include <unistd.h>
 
 #include <block.h>
+#include <check.h>
 #include <skinny.h>
 
 void test_ls();
@@ -20,8 +21,26 @@ void test_encode_sfn();
 void test_dirlink();
 void test_new_dir();
 void test_truncate();
+void test_itruncate();
+void test_unlink();
+void test_fallocate();
+void test_compact();
+void test_lfn();
+void test_iflush();
+void test_times();
+void test_span();
+void test_export();
+void test_icopy();
+void test_namei_batch();
+void test_fat_index();
+void test_sq();
+void test_server();
 void test_for_each_clus();
 void test_for_each_dirent();
+void test_defrag(fat32 *fs);
+void test_fsck(fat32 *fs);
+void test_stats();
+void test_trace();
 
 int main() {
     init_block_device();
@@ -47,10 +66,47 @@ int main() {
     printf("-----------------\n");
     test_truncate();
     printf("-----------------\n");
+    test_itruncate();
+    printf("-----------------\n");
+    test_unlink();
+    printf("-----------------\n");
+    test_fallocate();
+    printf("-----------------\n");
+    test_compact();
+    printf("-----------------\n");
+    test_lfn();
+    printf("-----------------\n");
+    test_iflush();
+    printf("-----------------\n");
+    test_times();
+    printf("-----------------\n");
+    test_span();
+    printf("-----------------\n");
+    test_export();
+    printf("-----------------\n");
+    test_icopy();
+    printf("-----------------\n");
+    test_namei_batch();
+    printf("-----------------\n");
+    test_sq();
+    printf("-----------------\n");
+    test_server();
+    printf("-----------------\n");
+    test_fat_index();
+    printf("-----------------\n");
     test_for_each_clus();
     printf("-----------------\n");
     test_ls();
+    printf("-----------------\n");
+    test_defrag(&fs);
+    printf("-----------------\n");
+    test_fsck(&fs);
+    printf("-----------------\n");
+    test_stats();
+    printf("-----------------\n");
+    test_trace();
 
+    fs_sync();
     release_block();
     return 0;
 }
\ No newline at end of file
@@ -0,0 +1,597 @@
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// skinny.h has its own DT_* values for linux_dirent64.
+#undef DT_DIR
+#undef DT_REG
+
+#include <block.h>
+#include <skinny.h>
+
+// Writes a FAT32 image straight to a file, optionally populated from a
+// generated spec or a host directory.
+//
+// The whole tree is laid out in memory first. Clusters are then handed
+// out in one ascending sweep (root first, then breadth first), so every
+// chain is a contiguous run and the FAT, the directories and the file data
+// can all be written as sequential streams. Data nobody wrote stays a hole
+// in the image file.
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define RSVD_SECS   32
+#define NUM_FATS    2
+#define DENTSZ      sizeof(fat32_dirent)
+#define WBUF_SIZE   (4 << 20)
+#define WBUF_GAP    4096 // Zero-fill gaps smaller than this, keep larger holes
+
+typedef struct node {
+    char  sfn[11];
+    char *lname;  // Long name, NULL if the 8.3 one is all there is
+    u32   nlfn;   // Long name entries in front of the short one
+    u8    attr;
+    u32   size;   // File size in bytes, 0 for directories
+    u32   first;  // First cluster, 0 if none
+    u32   nclus;
+    u32   parent;
+    u32   child;  // Index of the first child, children are contiguous
+    u32   nchild;
+    u32   id;     // Generated file number
+    char *src;    // Host path to copy from, NULL for generated files
+} node;
+
+static node *nodes;
+static u32 nnodes, capnodes;
+
+static int img;
+static u32 spc = 1;
+// The engine only mounts clusters an inum has offset bits for.
+#define MAX_SPC ((1u << INUM_OFF_BITS) / BSIZE)
+static u32 cbytes;
+static u32 fat_sz;
+static u32 data_sec;
+static int full_data;
+static u16 now_date, now_time;
+
+static u32 add_node(u32 parent, const char *sfn, u8 attr) {
+    if (nnodes == capnodes) {
+        capnodes = capnodes ? capnodes * 2 : 1024;
+        nodes = realloc(nodes, capnodes * sizeof(node));
+        assert(nodes);
+    }
+    node *n = &nodes[nnodes];
+    memset(n, 0, sizeof(node));
+    memcpy(n->sfn, sfn, 11);
+    n->attr = attr;
+    n->parent = parent;
+    return nnodes++;
+}
+
+static u64 parse_size(const char *s) {
+    char *end;
+    u64 v = strtoull(s, &end, 0);
+    switch (*end) {
+    case 'g': case 'G': v <<= 10; // fall through
+    case 'm': case 'M': v <<= 10; // fall through
+    case 'k': case 'K': v <<= 10;
+    }
+    return v;
+}
+
+// Write-combining buffer: ascending writes close to each other are merged
+// into one pwrite(), larger gaps are left as holes. Every flush is repeated
+// `copies` times, `stride` bytes apart, which is how both FATs are written.
+typedef struct wbuf {
+    u8  *buf;
+    u64  off;
+    u32  len;
+    u32  copies;
+    u64  stride;
+} wbuf;
+
+static void wb_flush(wbuf *wb) {
+    for (u32 i = 0; i < wb->copies && wb->len; i++) {
+        if (pwrite(img, wb->buf, wb->len, wb->off + i * wb->stride) != wb->len) {
+            perror("mkfs: pwrite");
+            exit(1);
+        }
+    }
+    wb->len = 0;
+}
+
+static void wb_put(wbuf *wb, u64 off, const void *data, u32 n) {
+    if (wb->len && (off < wb->off + wb->len ||
+                    off - (wb->off + wb->len) > WBUF_GAP ||
+                    off + n - wb->off > WBUF_SIZE))
+        wb_flush(wb);
+    if (wb->len == 0)
+        wb->off = off;
+    if (n > WBUF_SIZE) {
+        if (pwrite(img, data, n, off) != n) {
+            perror("mkfs: pwrite");
+            exit(1);
+        }
+        return;
+    }
+    u32 at = off - wb->off;
+    memset(wb->buf + wb->len, 0, at - wb->len);
+    memcpy(wb->buf + at, data, n);
+    wb->len = at + n;
+}
+
+static u64 clus_off(u32 clus) {
+    return ((u64)data_sec + (u64)(clus - 2) * spc) * BSIZE;
+}
+
+// Generated tree: `dirs` directories under the root with `files` files of
+// `size` bytes each, or the files straight in the root if `dirs` is 0.
+static void gen_tree(u32 dirs, u32 files, u32 size) {
+    char name[16], sfn[11];
+    u32 ndirs = dirs ? dirs : 1, id = 0;
+
+    if (dirs) {
+        nodes[0].child = nnodes;
+        nodes[0].nchild = dirs;
+        for (u32 d = 0; d < dirs; d++) {
+            snprintf(name, sizeof(name), "D%07u", d);
+            fat_encode_sfn(sfn, name);
+            add_node(0, sfn, ATTR_DIRECTORY);
+        }
+    }
+    for (u32 d = 0; d < ndirs; d++) {
+        u32 dir = dirs ? 1 + d : 0;
+        nodes[dir].child = nnodes;
+        nodes[dir].nchild = files;
+        for (u32 f = 0; f < files; f++) {
+            snprintf(name, sizeof(name), "F%07u.DAT", f);
+            fat_encode_sfn(sfn, name);
+            u32 i = add_node(dir, sfn, ATTR_ARCHIVE);
+            nodes[i].size = size;
+            nodes[i].id = id++;
+        }
+    }
+}
+
+// Short names taken so far in the directory being filled, a hash set of
+// node indices with open addressing.
+typedef struct sfn_set {
+    u32 *slot; // Node index + 1, 0 if empty
+    u32  mask;
+} sfn_set;
+
+// Makes room for `n` names.
+static void sfn_set_init(sfn_set *set, u32 n) {
+    u32 cap = 16;
+    while (cap < 2 * n)
+        cap *= 2;
+    set->slot = calloc(cap, sizeof(u32));
+    assert(set->slot);
+    set->mask = cap - 1;
+}
+
+static u32 sfn_hash(const char *sfn) {
+    u32 h = 2166136261u;
+    for (int i = 0; i < 11; i++)
+        h = (h ^ (u8)sfn[i]) * 16777619u;
+    return h;
+}
+
+// Returns the slot holding `sfn`, or the empty one it would go in.
+static u32 *sfn_slot(sfn_set *set, const char *sfn) {
+    u32 i = sfn_hash(sfn) & set->mask;
+    while (set->slot[i] && memcmp(nodes[set->slot[i] - 1].sfn, sfn, 11))
+        i = (i + 1) & set->mask;
+    return &set->slot[i];
+}
+
+static int sfn_used(sfn_set *set, const char *sfn) {
+    return *sfn_slot(set, sfn) != 0;
+}
+
+static int cmp_names(const void *a, const void *b) {
+    return strcmp(*(char **)a, *(char **)b);
+}
+
+// Host tree, breadth first so the children of a directory are adjacent.
+static void host_tree(const char *root) {
+    nodes[0].src = strdup(root);
+
+    for (u32 dir = 0; dir < nnodes; dir++) {
+        if (!(nodes[dir].attr & ATTR_DIRECTORY))
+            continue;
+
+        DIR *d = opendir(nodes[dir].src);
+        if (!d) {
+            perror(nodes[dir].src);
+            exit(1);
+        }
+        char **names = NULL;
+        u32 n = 0, cap = 0;
+        struct dirent *de;
+        while ((de = readdir(d))) {
+            if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, ".."))
+                continue;
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                names = realloc(names, cap * sizeof(char *));
+                assert(names);
+            }
+            names[n++] = strdup(de->d_name);
+        }
+        closedir(d);
+        qsort(names, n, sizeof(char *), cmp_names);
+
+        nodes[dir].child = nnodes;
+        sfn_set taken;
+        sfn_set_init(&taken, n);
+        for (u32 i = 0; i < n; i++) {
+            char path[4096], sfn[11];
+            struct stat st;
+            snprintf(path, sizeof(path), "%s/%s", nodes[dir].src, names[i]);
+
+            int nlfn = fat_lfn_count(names[i]);
+            if (nlfn < 0) {
+                fprintf(stderr, "mkfs: skipping %s, not a valid name\n", path);
+                continue;
+            }
+            // Long names get the first alias no sibling has taken.
+            int dup = 1;
+            if (nlfn == 0) {
+                fat_encode_sfn(sfn, names[i]);
+                dup = sfn_used(&taken, sfn);
+            }
+            for (u32 k = 0; nlfn > 0 && dup; k++) {
+                if (fat_sfn_alias(names[i], k, sfn) == 0)
+                    dup = sfn_used(&taken, sfn);
+                else if (k > 0)
+                    break;
+            }
+            if (dup || stat(path, &st) != 0 ||
+                !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)) ||
+                st.st_size > 0xffffffffll) {
+                fprintf(stderr, "mkfs: skipping %s\n", path);
+                continue;
+            }
+
+            u32 k = add_node(dir, sfn,
+                             S_ISDIR(st.st_mode) ? ATTR_DIRECTORY : ATTR_ARCHIVE);
+            *sfn_slot(&taken, sfn) = k + 1;
+            nodes[k].src = strdup(path);
+            if (nlfn > 0) {
+                nodes[k].lname = strdup(names[i]);
+                nodes[k].nlfn = nlfn;
+            }
+            nodes[k].size = S_ISDIR(st.st_mode) ? 0 : st.st_size;
+        }
+        nodes[dir].nchild = nnodes - nodes[dir].child;
+        free(taken.slot);
+
+        for (u32 i = 0; i < n; i++)
+            free(names[i]);
+        free(names);
+    }
+}
+
+// Whether node `n` is laid out in `pass`: directories go in pass 0, ahead
+// of every file, so their entries stay below INUM_CLUS_END.
+static int in_pass(node *n, int pass) {
+    return !(n->attr & ATTR_DIRECTORY) == pass;
+}
+
+// Hands out clusters in node order, directories first, returns the first
+// free cluster.
+static u32 assign_clusters(u32 max_clus) {
+    u32 next = 2;
+
+    for (int pass = 0; pass < 2; pass++) {
+        for (u32 i = 0; i < nnodes; i++) {
+            node *n = &nodes[i];
+            if (!in_pass(n, pass))
+                continue;
+            if (n->attr & ATTR_DIRECTORY) {
+                // Dot entries for subdirectories, plus a free end marker.
+                u32 slots = n->nchild + (i ? 2 : 0) + 1;
+                for (u32 c = 0; c < n->nchild; c++)
+                    slots += nodes[n->child + c].nlfn;
+                n->nclus = (slots * DENTSZ + cbytes - 1) / cbytes;
+            } else {
+                n->nclus = ((u64)n->size + cbytes - 1) / cbytes;
+            }
+            if (n->nclus == 0)
+                continue;
+            if ((u64)next + n->nclus > max_clus) {
+                fprintf(stderr, "mkfs: image too small for the tree\n");
+                exit(1);
+            }
+            if (pass == 0 && (u64)next + n->nclus > INUM_CLUS_END) {
+                fprintf(stderr, "mkfs: directories don't fit below cluster "
+                        "%u\n", INUM_CLUS_END);
+                exit(1);
+            }
+            n->first = next;
+            next += n->nclus;
+        }
+    }
+
+    return next;
+}
+
+static void write_fat() {
+    wbuf wb = {.buf = malloc(WBUF_SIZE),
+               .copies = NUM_FATS,
+               .stride = (u64)fat_sz * BSIZE};
+    assert(wb.buf);
+    u64 base = (u64)RSVD_SECS * BSIZE;
+    u32 head[2] = {0x0ffffff8, 0x0fffffff};
+    wb_put(&wb, base, head, sizeof(head));
+
+    // Chains are contiguous and ascending, so this is one sequential sweep.
+    for (int pass = 0; pass < 2; pass++) {
+        for (u32 i = 0; i < nnodes; i++) {
+            node *n = &nodes[i];
+            if (!in_pass(n, pass))
+                continue;
+            for (u32 c = 0; c < n->nclus; c++) {
+                u32 clus = n->first + c;
+                u32 fe = (c + 1 == n->nclus) ? 0x0fffffff : clus + 1;
+                wb_put(&wb, base + clus * 4ull, &fe, 4);
+            }
+        }
+    }
+    wb_flush(&wb);
+    free(wb.buf);
+}
+
+static void fill_dirent(fat32_dirent *d, node *n) {
+    memset(d, 0, DENTSZ);
+    memcpy(d->name, n->sfn, 11);
+    d->attr = n->attr;
+    d->crt_date = d->wrt_date = d->last_acc_date = now_date;
+    d->crt_time = d->wrt_time = now_time;
+    d->fat_clus_hi = n->first >> 16;
+    d->fat_clus_lo = n->first & 0xffff;
+    d->file_size = n->size;
+}
+
+static void write_dir(wbuf *wb, u32 i) {
+    node *n = &nodes[i];
+    u32 len = n->nclus * cbytes;
+    fat32_dirent *ents = calloc(1, len);
+    assert(ents);
+    u32 k = 0;
+
+    if (i != 0) {
+        node dot = *n, dotdot = nodes[n->parent];
+        memcpy(dot.sfn, ".          ", 11);
+        memcpy(dotdot.sfn, "..         ", 11);
+        dotdot.attr = ATTR_DIRECTORY;
+        if (n->parent == 0)
+            dotdot.first = 0; // ".." of a top level dir points at cluster 0
+        fill_dirent(&ents[k++], &dot);
+        fill_dirent(&ents[k++], &dotdot);
+    }
+    for (u32 c = 0; c < n->nchild; c++) {
+        node *ch = &nodes[n->child + c];
+        if (ch->lname) {
+            fat_lfn_fill(&ents[k], ch->lname, ch->sfn);
+            k += ch->nlfn;
+        }
+        fill_dirent(&ents[k++], ch);
+    }
+
+    // Directory clusters are contiguous, so this is a single write.
+    wb_put(wb, clus_off(n->first), ents, len);
+    free(ents);
+}
+
+static void write_file(wbuf *wb, u32 i) {
+    static u8 buf[1 << 20];
+    node *n = &nodes[i];
+
+    if (n->src) {
+        int fd = open(n->src, O_RDONLY);
+        if (fd < 0) {
+            perror(n->src);
+            exit(1);
+        }
+        // Only what was stat()ed has clusters, the next file follows.
+        for (u32 off = 0; off < n->size;) {
+            ssize_t got = read(fd, buf, min(sizeof(buf), n->size - off));
+            if (got <= 0)
+                break;
+            wb_put(wb, clus_off(n->first) + off, buf, got);
+            off += got;
+        }
+        close(fd);
+        return;
+    }
+
+    // Generated files are holes that read back as zeros, unless -f asks
+    // for a line naming the file followed by a repeating pattern.
+    u32 len = full_data ? n->size : 0;
+    for (u32 off = 0; off < len; off += sizeof(buf)) {
+        u32 m = min(len - off, sizeof(buf));
+        for (u32 j = 0; j < m; j++)
+            buf[j] = 'a' + (off + j) % 26;
+        if (off == 0) {
+            char line[32];
+            int l = snprintf(line, sizeof(line), "file %u\n", n->id);
+            memcpy(buf, line, min(l, m));
+        }
+        wb_put(wb, clus_off(n->first) + off, buf, m);
+    }
+}
+
+static void write_boot(u32 tot_sec, u32 nclus, u32 next_free) {
+    u8 sec[BSIZE] = {0};
+    fat32_bpb *bpb = (fat32_bpb *)sec;
+
+    memcpy(bpb->jmp_boot, "\xeb\x58\x90", 3);
+    memcpy(bpb->oem_name, "SKINNY32", 8);
+    bpb->bytes_per_sec = BSIZE;
+    bpb->sec_per_clus = spc;
+    bpb->rsvd_sec_cnt = RSVD_SECS;
+    bpb->num_fats = NUM_FATS;
+    bpb->media = 0xf8;
+    bpb->sec_per_trk = 63;
+    bpb->num_heads = 255;
+    bpb->tot_sec_32 = tot_sec;
+    bpb->fat_sz_32 = fat_sz;
+    bpb->root_clus = 2;
+    bpb->fs_info = 1;
+    bpb->bk_boot_sec = 6;
+    bpb->drv_num = 0x80;
+    bpb->boot_sig = 0x29;
+    bpb->vol_id = (u32)time(NULL);
+    memcpy(bpb->vol_lab, "NO NAME    ", 11);
+    memcpy(bpb->fil_sys_type, "FAT32   ", 8);
+    sec[510] = 0x55;
+    sec[511] = 0xaa;
+
+    u8 fsi[BSIZE] = {0};
+    *(u32 *)(fsi + 0) = 0x41615252;
+    *(u32 *)(fsi + 484) = 0x61417272;
+    *(u32 *)(fsi + 488) = nclus - (next_free - 2);
+    *(u32 *)(fsi + 492) = next_free;
+    *(u32 *)(fsi + 508) = 0xaa550000;
+
+    // Boot sector and FSInfo, then their backups at sector 6.
+    for (u32 base = 0; base <= 6; base += 6) {
+        if (pwrite(img, sec, BSIZE, base * BSIZE) != BSIZE ||
+            pwrite(img, fsi, BSIZE, (base + 1) * BSIZE) != BSIZE) {
+            perror("mkfs: pwrite");
+            exit(1);
+        }
+    }
+}
+
+static void usage() {
+    fprintf(stderr, "usage: mkfs [-s size] [-c sectors_per_cluster] "
+                    "[-g dirs,files,bytes [-f]] [-d hostdir] image\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    u64 size = 48 << 20;
+    u32 gdirs = 0, gfiles = 0, gsize = 0;
+    char *host = NULL;
+    int opt, gen = 0;
+
+    while ((opt = getopt(argc, argv, "s:c:g:fd:")) != -1) {
+        switch (opt) {
+        case 's':
+            size = parse_size(optarg);
+            break;
+        case 'c':
+            spc = atoi(optarg);
+            break;
+        case 'g':
+            if (sscanf(optarg, "%u,%u,%u", &gdirs, &gfiles, &gsize) != 3)
+                usage();
+            gen = 1;
+            break;
+        case 'f':
+            full_data = 1;
+            break;
+        case 'd':
+            host = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind != argc - 1 || (gen && host) || spc == 0 || (spc & (spc - 1)))
+        usage();
+    if (spc > MAX_SPC) {
+        fprintf(stderr, "mkfs: -c is at most %u\n", MAX_SPC);
+        return 1;
+    }
+
+    u64 tot = size / BSIZE;
+    if (tot > 0xffffffffull || tot < RSVD_SECS + 1024) {
+        fprintf(stderr, "mkfs: size out of range for FAT32\n");
+        return 1;
+    }
+    u32 tot_sec = tot;
+    cbytes = spc * BSIZE;
+
+    // Grow the FAT until it covers every cluster left after it.
+    u32 nclus;
+    for (fat_sz = 1;;) {
+        nclus = (tot_sec - RSVD_SECS - NUM_FATS * fat_sz) / spc;
+        u32 need = ((u64)(nclus + 2) * 4 + BSIZE - 1) / BSIZE;
+        if (need <= fat_sz)
+            break;
+        fat_sz = need;
+    }
+    data_sec = RSVD_SECS + NUM_FATS * fat_sz;
+    if (nclus < 65525)
+        fprintf(stderr, "mkfs: warning: %u clusters is too few for FAT32\n",
+                nclus);
+    if (nclus > 0x0ffffff5) {
+        if (spc < MAX_SPC)
+            fprintf(stderr, "mkfs: too many clusters, use a larger -c\n");
+        else
+            fprintf(stderr, "mkfs: too many clusters, use a smaller -s\n");
+        return 1;
+    }
+
+    time_t t = time(NULL);
+    struct tm *tm = localtime(&t);
+    now_date = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+    now_time = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec / 2);
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    add_node(0, "           ", ATTR_DIRECTORY);
+    if (gen)
+        gen_tree(gdirs, gfiles, gsize);
+    else if (host)
+        host_tree(host);
+
+    u32 next_free = assign_clusters(nclus + 2);
+
+    img = open(argv[optind], O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (img < 0 || ftruncate(img, (u64)tot_sec * BSIZE) != 0) {
+        perror(argv[optind]);
+        return 1;
+    }
+
+    write_boot(tot_sec, nclus, next_free);
+    write_fat();
+
+    wbuf wb = {.buf = malloc(WBUF_SIZE), .copies = 1};
+    assert(wb.buf);
+    for (int pass = 0; pass < 2; pass++) {
+        for (u32 i = 0; i < nnodes; i++) {
+            if (!in_pass(&nodes[i], pass))
+                continue;
+            if (nodes[i].attr & ATTR_DIRECTORY)
+                write_dir(&wb, i);
+            else if (nodes[i].nclus)
+                write_file(&wb, i);
+        }
+    }
+    wb_flush(&wb);
+    free(wb.buf);
+    close(img);
+
+    u32 ndirs = 0;
+    for (u32 i = 0; i < nnodes; i++)
+        ndirs += !!(nodes[i].attr & ATTR_DIRECTORY);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    printf("%s: %llu MB, %u clusters of %u bytes, %u used, %u dirs, %u files, "
+           "%.2fs\n",
+           argv[optind], size >> 20, nclus, cbytes, next_free - 2, ndirs,
+           nnodes - ndirs,
+           (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9);
+    return 0;
+}
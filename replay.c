@@ -0,0 +1,191 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <block.h>
+#include <skinny.h>
+#include <stats.h>
+#include <trace.h>
+
+// Replays a trace recorded with SKINNY_TRACE against an image, which is
+// modified in place, and reports throughput and latency per operation.
+
+static const char *op_names[] = {
+    [TR_NAMEI] = "namei",     [TR_READI] = "readi",   [TR_WRITEI] = "writei",
+    [TR_DIRLINK] = "dirlink", [TR_ITRUNC] = "itrunc",
+    [TR_ITRUNCATE] = "itruncate", [TR_UNLINK] = "unlink",
+    [TR_RMDIR] = "rmdir",     [TR_FALLOCATE] = "fallocate",
+    [TR_COMPACT] = "compact",
+};
+
+#define NOPS (sizeof(op_names) / sizeof(op_names[0]))
+
+typedef struct op_stat {
+    u64  ops;
+    u64  bytes;
+    u64  ns;
+    u64 *lat;
+    u64  cap;
+} op_stat;
+
+static op_stat ops[NOPS];
+
+static void add(int op, u64 ns, u64 bytes) {
+    op_stat *s = &ops[op];
+    if (s->ops == s->cap) {
+        s->cap = s->cap ? s->cap * 2 : 1024;
+        s->lat = realloc(s->lat, s->cap * sizeof(u64));
+        assert(s->lat);
+    }
+    s->lat[s->ops++] = ns;
+    s->bytes += bytes;
+    s->ns += ns;
+}
+
+static int cmp_u64(const void *a, const void *b) {
+    u64 x = *(u64 *)a, y = *(u64 *)b;
+    return (x > y) - (x < y);
+}
+
+static double pct(op_stat *s, double p) {
+    if (s->ops == 0)
+        return 0;
+    return s->lat[(u64)(p * (s->ops - 1) + 0.5)] / 1000.0;
+}
+
+static void sleep_until(u64 t) {
+    u64 now = stat_now();
+    if (now >= t)
+        return;
+    struct timespec ts = {.tv_sec = (t - now) / 1000000000ull,
+                          .tv_nsec = (t - now) % 1000000000ull};
+    nanosleep(&ts, NULL);
+}
+
+static void usage() {
+    fprintf(stderr, "usage: replay [-t] trace image\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int timed = 0, opt;
+
+    while ((opt = getopt(argc, argv, "t")) != -1) {
+        if (opt != 't')
+            usage();
+        timed = 1;
+    }
+    if (argc - optind != 2)
+        usage();
+
+    FILE *f = trace_open(argv[optind]);
+    if (!f) {
+        fprintf(stderr, "replay: %s is not a trace\n", argv[optind]);
+        return 1;
+    }
+
+    open_block_device(argv[optind + 1]);
+    skinny_debug = 0;
+    fat32 fs;
+    init_fs(&fs);
+
+    char name[1 << 16];
+    char *data = NULL;
+    u32 data_cap = 0;
+    trace_rec rec;
+    u64 start = stat_now(), clock = 0, total = 0, failed = 0;
+
+    while (trace_next(f, &rec, name, sizeof(name))) {
+        clock += (u64)rec.delta_us * 1000;
+        if (timed)
+            sleep_until(start + clock);
+
+        if (rec.n > data_cap) {
+            data = realloc(data, rec.n);
+            assert(data);
+            for (u32 i = data_cap; i < rec.n; i++)
+                data[i] = 'a' + i % 26;
+            data_cap = rec.n;
+        }
+
+        inode *ip = NULL;
+        if (rec.op != TR_NAMEI && rec.op != TR_UNLINK && rec.op != TR_RMDIR)
+            ip = iget(0, rec.inum);
+
+        u64 t0 = stat_now(), bytes = 0;
+        int ok = 1;
+        switch (rec.op) {
+        case TR_NAMEI:
+            ip = namei(name);
+            ok = ip != NULL;
+            break;
+        case TR_READI:
+            bytes = readi(ip, 0, data, rec.off, rec.n, NULL);
+            break;
+        case TR_WRITEI:
+            ok = writei(ip, 0, data, rec.off, rec.n) == rec.n;
+            bytes = ok ? rec.n : 0;
+            break;
+        case TR_DIRLINK: {
+            inode *np = dirlink(ip, name, rec.type);
+            ok = np != NULL;
+            if (np)
+                iput(np);
+            break;
+        }
+        case TR_ITRUNC:
+            itrunc(ip);
+            break;
+        case TR_ITRUNCATE:
+            ok = itruncate(ip, rec.n) == 0;
+            break;
+        case TR_FALLOCATE:
+            ok = ifallocate(ip, rec.n, rec.type) == 0;
+            break;
+        case TR_COMPACT:
+            ok = dir_compact(ip) >= 0;
+            break;
+        case TR_UNLINK:
+            ok = fat_unlink(name) == 0;
+            break;
+        case TR_RMDIR:
+            ok = fat_rmdir(name) == 0;
+            break;
+        default:
+            fprintf(stderr, "replay: unknown op %d\n", rec.op);
+            return 1;
+        }
+        add(rec.op, stat_now() - t0, bytes);
+        total++;
+        failed += !ok;
+        if (ip)
+            iput(ip);
+    }
+
+    double secs = (stat_now() - start) / 1e9;
+    u64 bytes = 0;
+
+    printf("%-8s %10s %12s %10s %10s %10s\n", "op", "count", "ops/s", "MB/s",
+           "p50(us)", "p99(us)");
+    for (int i = 1; i < NOPS; i++) {
+        op_stat *s = &ops[i];
+        if (s->ops == 0)
+            continue;
+        qsort(s->lat, s->ops, sizeof(u64), cmp_u64);
+        double busy = s->ns / 1e9;
+        printf("%-8s %10llu %12.1f %10.2f %10.2f %10.2f\n", op_names[i], s->ops,
+               s->ops / busy, s->bytes / busy / (1024.0 * 1024.0),
+               pct(s, 0.50), pct(s, 0.99));
+        bytes += s->bytes;
+    }
+    printf("total: %llu ops (%llu failed) in %.3fs, %.1f ops/s, %.2f MB/s\n",
+           total, failed, secs, total / secs, bytes / secs / (1024.0 * 1024.0));
+
+    fclose(f);
+    fs_sync();
+    release_block();
+    return 0;
+}
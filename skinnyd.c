@@ -0,0 +1,63 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <block.h>
+#include <server.h>
+#include <skinny.h>
+
+static void usage() {
+    fprintf(stderr, "usage: skinnyd [-s socket] [-j workers] [image]\n");
+    exit(1);
+}
+
+// Mounts the image and serves it on a Unix socket until SIGINT or
+// SIGTERM, then writes everything back.
+int main(int argc, char **argv) {
+    const char *path = "skinny.sock";
+    u32 workers = 4;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "s:j:")) != -1) {
+        switch (opt) {
+        case 's':
+            path = optarg;
+            break;
+        case 'j':
+            workers = atoi(optarg);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind < argc - 1 || workers == 0)
+        usage();
+
+    // Blocked before any thread starts, so they all inherit it.
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    open_block_device(optind < argc ? argv[optind] : "fs.img");
+    skinny_debug = 0;
+    fat32 fs;
+    init_fs(&fs);
+
+    srv *s = srv_start(path, workers);
+    if (s == NULL) {
+        perror("skinnyd: listen");
+        return 1;
+    }
+    fprintf(stderr, "skinnyd: serving on %s with %u workers\n", path,
+            workers);
+
+    int sig;
+    sigwait(&set, &sig);
+    srv_stop(s);
+    fs_sync();
+    release_block();
+    return 0;
+}
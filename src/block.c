@@ -1,41 +1,151 @@
+#define _GNU_SOURCE // copy_file_range()
+
 #include <assert.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <stdint.h>
 #include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
 #include <block.h>
+#include <stats.h>
+
+#define HUGE_SIZE (2ul << 20) // A PMD mapping on x86-64 and arm64
+
+int block_hugepages = 1;
 
 static void *drive;
 static size_t map_len;
+static int drive_fd = -1;
+
+// Maps `len` bytes of image `f`. Images of a huge page or more go on a
+// huge page boundary and are advised to use them: a multi-GB image in 4k
+// pages takes a TLB miss on most FAT and data accesses. Whether the page
+// cache of the file actually comes in huge folios is up to its
+// filesystem; the advice is harmless where it doesn't.
+static void *map_image(int f, size_t len) {
+    int prot = PROT_READ | PROT_WRITE;
+    if (!block_hugepages || len < HUGE_SIZE) {
+        return mmap(0, len, prot, MAP_SHARED, f, 0);
+    }
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t mlen = (len + page - 1) & ~(page - 1);
+    char *area = mmap(0, mlen + HUGE_SIZE, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) {
+        return mmap(0, len, prot, MAP_SHARED, f, 0);
+    }
+    char *at = (char *)(((uintptr_t)area + HUGE_SIZE - 1) & ~(HUGE_SIZE - 1));
+    void *p = mmap(at, len, prot, MAP_SHARED | MAP_FIXED, f, 0);
+    if (p == MAP_FAILED) {
+        munmap(area, mlen + HUGE_SIZE);
+        return mmap(0, len, prot, MAP_SHARED, f, 0);
+    }
+    if (at > area) {
+        munmap(area, at - area);
+    }
+    munmap(at + mlen, area + HUGE_SIZE - at);
+    madvise(p, len, MADV_HUGEPAGE);
+    return p;
+}
 
 void init_block_device() {
+    open_block_device("fs.img");
+}
+
+void open_block_device(const char *path) {
     int f;
     struct stat statbuf;
 
-    f = openat(AT_FDCWD, "fs.img", O_RDWR);
+    f = openat(AT_FDCWD, path, O_RDWR);
     assert(f != 0);
     assert(fstat(f, &statbuf) == 0);
-    drive = mmap(0, statbuf.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, f, 0);
+    drive = map_image(f, statbuf.st_size);
     map_len = statbuf.st_size;
     assert(drive != (void *)-1);
+    // Kept for bexport(), the mapping shares its page cache.
+    drive_fd = f;
+}
+
+unsigned long long block_nsec() {
+    return map_len / BSIZE;
 }
 
 void release_block() {
     munmap(drive, map_len);
+    close(drive_fd);
+    drive_fd = -1;
 }
 
 // Reads `len` sectors from `sector` into `buf`, starting at `offset`.
-void bread(void *buf, int off, int len) {
-    memcpy(buf, drive + off * BSIZE, len * BSIZE);
+void bread(void *buf, sector_t off, unsigned len) {
+    stat_add(ST_BREAD, 1);
+    stat_add(ST_BREAD_BYTES, (u64)len * BSIZE);
+    memcpy(buf, drive + off * BSIZE, (size_t)len * BSIZE);
 }
 
 // Writes `len` sectors from `buf` into `sector` starting at `offset`.
-void bwrite(void *buf, int off, int len) {
-    memcpy(drive + off * BSIZE, buf, len * BSIZE);
+void bwrite(void *buf, sector_t off, unsigned len) {
+    stat_add(ST_BWRITE, 1);
+    stat_add(ST_BWRITE_BYTES, (u64)len * BSIZE);
+    memcpy(drive + off * BSIZE, buf, (size_t)len * BSIZE);
+}
+
+void bmove(sector_t to, sector_t from, unsigned len) {
+    stat_add(ST_BMOVE, 1);
+    stat_add(ST_BMOVE_BYTES, (u64)len * BSIZE);
+    memmove(drive + to * BSIZE, drive + from * BSIZE, (size_t)len * BSIZE);
+}
+
+const void *bview(sector_t off, unsigned len) {
+    stat_add(ST_BVIEW, 1);
+    stat_add(ST_BVIEW_BYTES, (u64)len * BSIZE);
+    return drive + off * BSIZE;
+}
+
+// How bexport() got the bytes out, the first one that works for an fd.
+enum { EX_COPY_RANGE, EX_SENDFILE, EX_WRITE };
+
+int bexport(int fd, const void *data, unsigned long long len) {
+    off_t pos = (const char *)data - (const char *)drive;
+    assert(pos >= 0 && pos + len <= map_len);
+    stat_add(ST_BEXPORT, 1);
+    stat_add(ST_BEXPORT_BYTES, len);
+
+    int how = EX_COPY_RANGE;
+    while (len > 0) {
+        ssize_t n;
+        if (how == EX_COPY_RANGE) {
+            n = copy_file_range(drive_fd, &pos, fd, NULL, len, 0);
+        } else if (how == EX_SENDFILE) {
+            n = sendfile(fd, drive_fd, &pos, len);
+        } else {
+            n = write(fd, drive + pos, len);
+            if (n > 0) {
+                pos += n;
+            }
+        }
+
+        if (n > 0) {
+            len -= n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (how != EX_WRITE && (n == 0 || errno == EXDEV ||
+                                       errno == EINVAL || errno == ENOSYS ||
+                                       errno == EOPNOTSUPP || errno == EBADF)) {
+            // Not for this kind of fd, try the next way.
+            how++;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
 }
 
 void debug_print_block(unsigned char *buf) {
@@ -2,13 +2,42 @@
 
 #define BSIZE 512
 
+// Sector numbers, 64-bit so that byte offsets into images past 4 GB
+// (FAT32 goes up to 2 TB with 512-byte sectors) can't wrap.
+typedef unsigned long long sector_t;
+
+// Set to zero before open_block_device() to map without huge pages.
+extern int block_hugepages;
+
 void init_block_device();
+
+// Maps the image at `path` as the block device.
+void open_block_device(const char *path);
+
+// Returns the number of sectors in the block device.
+unsigned long long block_nsec();
+
 void release_block();
 
 // Reads `len` sectors from `sector` into `buf`, starting at `offset`.
-void bread(void *buf, int off, int len);
+void bread(void *buf, sector_t off, unsigned len);
 
 // Writes `len` sectors from `buf` into `sector` starting at `offset`.
-void bwrite(void *buf, int off, int len);
+void bwrite(void *buf, sector_t off, unsigned len);
+
+// Returns where the `len` sectors from `off` sit in the mapped image, to
+// be read in place. Valid until release_block().
+const void *bview(sector_t off, unsigned len);
+
+// Copies `len` sectors from `from` to `to` within the image, without a
+// buffer in between.
+void bmove(sector_t to, sector_t from, unsigned len);
+
+// Writes the `len` bytes at `data`, which points into the mapped image,
+// to the host file or socket `fd` at its current position. The kernel
+// moves them from the image file with copy_file_range() or sendfile()
+// where it can, else they are written from the mapping. Returns 0, or -1
+// if `fd` failed.
+int bexport(int fd, const void *data, unsigned long long len);
 
 void debug_print_block(unsigned char *buf);
\ No newline at end of file
@@ -0,0 +1,610 @@
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <block.h>
+#include <check.h>
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+#define FAT_MASK     0x0fffffff
+#define FAT_EPS      (BSIZE / sizeof(fat_entry)) // FAT entries per sector
+#define DENTS_PS     (BSIZE / sizeof(fat32_dirent))
+#define SCAN_CHUNK   64 // Sectors per bread() while scanning the FAT
+
+// A directory waiting to be scanned.
+typedef struct fsck_work {
+    u32   clus; // First cluster of the directory
+    char *path;
+} fsck_work;
+
+// Owner pushes and pops at the tail, thieves take from the head.
+typedef struct fsck_deque {
+    pthread_mutex_t lock;
+    fsck_work *items;
+    u32 head, tail, cap;
+} fsck_deque;
+
+// A file whose size disagrees with its chain, remembered for repair.
+typedef struct fsck_fix {
+    sector_t sec; // Sector holding the dirent
+    u32 idx;      // Index of the dirent in that sector
+    u32 first;    // First cluster of the chain
+    u32 need;     // Clusters the file size asks for
+    u32 len;      // Clusters actually in the chain
+} fsck_fix;
+
+struct fsck_ctx;
+
+typedef struct fsck_worker {
+    struct fsck_ctx *ctx;
+    pthread_t   tid;
+    u32         id;
+    fsck_deque  dq;
+    fsck_report rep;   // Counts local to this worker, summed at the end
+    u8         *buf;   // One cluster worth of directory data
+
+    fsck_fix   *fixes;
+    u32         nfix, capfix;
+    u32        *ends;  // Clusters whose entry should become EOC
+    u32         nend, capend;
+} fsck_worker;
+
+typedef struct fsck_ctx {
+    fat32 *fs;
+    int    flags;
+    u32    fat_start;
+    u32    fat_sz;
+    u32    num_fats;
+    u32    spc;
+    u32    data_sec;
+    u32    nclus;     // One past the highest valid cluster number
+    u32   *fat;       // In-memory copy of FAT 1
+    u64   *owned;     // Clusters claimed by some chain
+    u64   *pointed;   // Clusters some FAT entry points to
+    u8    *dirty;     // FAT sectors to write back when repairing
+    u32    nworkers;
+    fsck_worker *workers;
+    u32    pending;   // Directories queued or being scanned
+} fsck_ctx;
+
+static int test_bit(u64 *map, u32 n) { return (map[n >> 6] >> (n & 63)) & 1; }
+
+// Sets bit `n` and returns its previous value.
+static int set_bit(u64 *map, u32 n) {
+    u64 mask = 1ull << (n & 63);
+    return (__atomic_fetch_or(&map[n >> 6], mask, __ATOMIC_RELAXED) & mask) != 0;
+}
+
+static int is_eoc(u32 fe) { return fe >= 0x0ffffff8; }
+
+static int is_valid_clus(fsck_ctx *ctx, u32 clus) {
+    return clus >= 2 && clus < ctx->nclus;
+}
+
+static sector_t clus_sector(fsck_ctx *ctx, u32 clus) {
+    return ctx->data_sec + (sector_t)(clus - 2) * ctx->spc;
+}
+
+static void *grow(void *p, u32 *cap, usize elem) {
+    *cap = *cap ? *cap * 2 : 64;
+    p = realloc(p, *cap * elem);
+    assert(p);
+    return p;
+}
+
+#define problem(ctx, ...)                                                      \
+    do {                                                                       \
+        if ((ctx)->flags & FSCK_VERBOSE)                                       \
+            printf(__VA_ARGS__);                                               \
+    } while (0)
+
+// Phase 1: FAT scan
+
+typedef struct fsck_part {
+    fsck_ctx   *ctx;
+    fsck_worker *w;
+    u32         lo, hi; // Range of FAT sectors
+} fsck_part;
+
+static void *fat_scan(void *arg) {
+    fsck_part *p = arg;
+    fsck_ctx *ctx = p->ctx;
+    fsck_report *rep = &p->w->rep;
+    u8 *mirror = malloc(SCAN_CHUNK * BSIZE);
+    assert(mirror);
+
+    for (u32 sec = p->lo; sec < p->hi; sec += SCAN_CHUNK) {
+        u32 n = min(SCAN_CHUNK, p->hi - sec);
+        u32 *ents = ctx->fat + sec * FAT_EPS;
+        bread(ents, ctx->fat_start + sec, n);
+
+        for (u32 f = 1; f < ctx->num_fats; f++) {
+            bread(mirror, ctx->fat_start + f * ctx->fat_sz + sec, n);
+            if (memcmp(mirror, ents, n * BSIZE) == 0)
+                continue;
+            u32 *m = (u32 *)mirror;
+            for (u32 i = 0; i < n * FAT_EPS; i++) {
+                if (m[i] != ents[i]) {
+                    rep->fat_mismatches++;
+                    ctx->dirty[sec + i / FAT_EPS] = 1;
+                }
+            }
+        }
+
+        u32 lo = sec * FAT_EPS, hi = (sec + n) * FAT_EPS;
+        for (u32 c = max(lo, 2); c < min(hi, ctx->nclus); c++) {
+            u32 fe = ents[c - lo] & FAT_MASK;
+            if (fe == FE_FREE) {
+                rep->free++;
+            } else if (fe == FE_BAD) {
+                rep->bad++;
+            } else {
+                rep->used++;
+                if (is_valid_clus(ctx, fe))
+                    set_bit(ctx->pointed, fe);
+            }
+        }
+    }
+
+    free(mirror);
+    return NULL;
+}
+
+// Phase 2: directory walk
+
+static void push_work(fsck_worker *w, u32 clus, char *path) {
+    fsck_deque *dq = &w->dq;
+    __atomic_add_fetch(&w->ctx->pending, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail == dq->cap)
+        dq->items = grow(dq->items, &dq->cap, sizeof(fsck_work));
+    dq->items[dq->tail++] = (fsck_work){.clus = clus, .path = path};
+    pthread_mutex_unlock(&dq->lock);
+}
+
+static int pop_work(fsck_worker *w, fsck_work *out) {
+    fsck_deque *dq = &w->dq;
+    int ok = 0;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail > dq->head) {
+        *out = dq->items[--dq->tail];
+        ok = 1;
+    }
+    if (dq->tail == dq->head)
+        dq->head = dq->tail = 0;
+    pthread_mutex_unlock(&dq->lock);
+    return ok;
+}
+
+static int steal_work(fsck_worker *w, fsck_work *out) {
+    fsck_ctx *ctx = w->ctx;
+    for (u32 i = 1; i < ctx->nworkers; i++) {
+        fsck_deque *dq = &ctx->workers[(w->id + i) % ctx->nworkers].dq;
+        int ok = 0;
+        pthread_mutex_lock(&dq->lock);
+        if (dq->tail > dq->head) {
+            *out = dq->items[dq->head++];
+            ok = 1;
+        }
+        pthread_mutex_unlock(&dq->lock);
+        if (ok)
+            return 1;
+    }
+    return 0;
+}
+
+// Claims every cluster of the chain starting at `first` and returns the
+// chain length. Stops early at a cross-link, in which case `*crossed` is set.
+// If `clus` is non-NULL the claimed clusters are stored there.
+static u32 claim_chain(fsck_worker *w, u32 first, const char *path,
+                       int *crossed, u32 **clus, u32 *cap) {
+    fsck_ctx *ctx = w->ctx;
+    u32 len = 0;
+    *crossed = 0;
+
+    for (u32 c = first;;) {
+        if (set_bit(ctx->owned, c)) {
+            w->rep.cross_links++;
+            *crossed = 1;
+            problem(ctx, "%s: cluster %u is cross-linked\n", path, c);
+            break;
+        }
+        if (clus) {
+            if (len == *cap)
+                *clus = grow(*clus, cap, sizeof(u32));
+            (*clus)[len] = c;
+        }
+        len++;
+
+        u32 next = ctx->fat[c] & FAT_MASK;
+        if (is_eoc(next))
+            break;
+        if (!is_valid_clus(ctx, next)) {
+            w->rep.bad_chains++;
+            problem(ctx, "%s: chain breaks at cluster %u (entry 0x%x)\n", path,
+                    c, next);
+            if (w->nend == w->capend)
+                w->ends = grow(w->ends, &w->capend, sizeof(u32));
+            w->ends[w->nend++] = c;
+            break;
+        }
+        c = next;
+    }
+
+    return len;
+}
+
+static char *join_path(const char *dir, const char *name) {
+    usize n = strlen(dir) + strlen(name) + 2;
+    char *path = malloc(n);
+    assert(path);
+    snprintf(path, n, "%s%s%s", dir, strcmp(dir, "/") ? "/" : "", name);
+    return path;
+}
+
+static void check_file(fsck_worker *w, fat32_dirent *d, const char *path,
+                       sector_t sec, u32 idx) {
+    fsck_ctx *ctx = w->ctx;
+    u32 first = ((u32)d->fat_clus_hi << 16) | d->fat_clus_lo;
+    u64 cbytes = (u64)ctx->spc * BSIZE;
+    u32 need = (d->file_size + cbytes - 1) / cbytes;
+    u32 len = 0;
+    int crossed = 0;
+
+    w->rep.files++;
+    if (first != 0) {
+        if (!is_valid_clus(ctx, first)) {
+            w->rep.bad_dirents++;
+            problem(ctx, "%s: first cluster %u out of range\n", path, first);
+            return;
+        }
+        len = claim_chain(w, first, path, &crossed, NULL, NULL);
+    }
+    if (crossed || len == need)
+        return;
+    if (len > need) {
+        // Reserved with ifallocate(FALLOC_KEEP_SIZE), nothing to fix.
+        w->rep.preallocated++;
+        return;
+    }
+
+    w->rep.size_mismatches++;
+    problem(ctx, "%s: size %u needs %u clusters, chain has %u\n", path,
+            d->file_size, need, len);
+    if (w->nfix == w->capfix)
+        w->fixes = grow(w->fixes, &w->capfix, sizeof(fsck_fix));
+    w->fixes[w->nfix++] = (fsck_fix){
+        .sec = sec, .idx = idx, .first = first, .need = need, .len = len};
+}
+
+static void scan_dir(fsck_worker *w, fsck_work *work) {
+    fsck_ctx *ctx = w->ctx;
+    u32 *clus = NULL, cap = 0;
+    int crossed;
+    u32 len = claim_chain(w, work->clus, work->path, &crossed, &clus, &cap);
+
+    for (u32 i = 0; i < len; i++) {
+        sector_t base = clus_sector(ctx, clus[i]);
+        bread(w->buf, base, ctx->spc);
+        fat32_dirent *dents = (fat32_dirent *)w->buf;
+
+        for (u32 j = 0; j < ctx->spc * DENTS_PS; j++) {
+            fat32_dirent *d = &dents[j];
+            u8 first_byte = d->name[0];
+            if (first_byte == 0x00)
+                goto out; // End of directory
+            if (first_byte == 0xe5 || first_byte == '.')
+                continue;
+            if ((d->attr & ATTR_LONG_NAME) == ATTR_LONG_NAME)
+                continue;
+            if ((d->attr & ATTR_VOLUME_ID) && !(d->attr & ATTR_DIRECTORY))
+                continue;
+
+            char name[SFNSIZ];
+            fat_decode_sfn(name, d);
+            char *path = join_path(work->path, name);
+
+            if (d->attr & ATTR_DIRECTORY) {
+                u32 first = ((u32)d->fat_clus_hi << 16) | d->fat_clus_lo;
+                if (!is_valid_clus(ctx, first)) {
+                    w->rep.bad_dirents++;
+                    problem(ctx, "%s: first cluster %u out of range\n", path,
+                            first);
+                    free(path);
+                    continue;
+                }
+                w->rep.dirs++;
+                push_work(w, first, path);
+            } else {
+                check_file(w, d, path, base + j / DENTS_PS, j % DENTS_PS);
+                free(path);
+            }
+        }
+    }
+out:
+    free(clus);
+}
+
+static void *walk_tree(void *arg) {
+    fsck_worker *w = arg;
+    fsck_ctx *ctx = w->ctx;
+    fsck_work work;
+
+    for (;;) {
+        if (pop_work(w, &work) || steal_work(w, &work)) {
+            scan_dir(w, &work);
+            free(work.path);
+            __atomic_sub_fetch(&ctx->pending, 1, __ATOMIC_SEQ_CST);
+            continue;
+        }
+        if (__atomic_load_n(&ctx->pending, __ATOMIC_SEQ_CST) == 0)
+            break;
+        sched_yield();
+    }
+
+    return NULL;
+}
+
+// Phase 3: lost clusters
+
+static void *find_lost(void *arg) {
+    fsck_part *p = arg;
+    fsck_ctx *ctx = p->ctx;
+    fsck_report *rep = &p->w->rep;
+
+    u32 lo = max(p->lo * FAT_EPS, 2);
+    u32 hi = min(p->hi * FAT_EPS, ctx->nclus);
+    for (u32 c = lo; c < hi; c++) {
+        u32 fe = ctx->fat[c] & FAT_MASK;
+        if (fe == FE_FREE || fe == FE_BAD || test_bit(ctx->owned, c))
+            continue;
+        rep->lost_clusters++;
+        if (!test_bit(ctx->pointed, c)) {
+            rep->lost_chains++;
+            problem(ctx, "lost chain starting at cluster %u\n", c);
+        }
+    }
+
+    return NULL;
+}
+
+// Runs `fn` over the FAT split into one partition per worker.
+static void run_partitioned(fsck_ctx *ctx, void *(*fn)(void *)) {
+    fsck_part parts[ctx->nworkers];
+    u32 per = (ctx->fat_sz + ctx->nworkers - 1) / ctx->nworkers;
+
+    for (u32 i = 0; i < ctx->nworkers; i++) {
+        parts[i] = (fsck_part){.ctx = ctx,
+                               .w = &ctx->workers[i],
+                               .lo = min(i * per, ctx->fat_sz),
+                               .hi = min((i + 1) * per, ctx->fat_sz)};
+        pthread_create(&ctx->workers[i].tid, NULL, fn, &parts[i]);
+    }
+    for (u32 i = 0; i < ctx->nworkers; i++)
+        pthread_join(ctx->workers[i].tid, NULL);
+}
+
+// Phase 4: repair
+
+static void free_clus(fsck_ctx *ctx, u32 clus) {
+    ctx->fat[clus] = FE_FREE;
+    ctx->dirty[clus / FAT_EPS] = 1;
+}
+
+static void set_eoc(fsck_ctx *ctx, u32 clus) {
+    ctx->fat[clus] = 0x0fffffff;
+    ctx->dirty[clus / FAT_EPS] = 1;
+}
+
+static void repair_size(fsck_ctx *ctx, fsck_fix *fix) {
+    u8 buf[BSIZE];
+    bread(buf, fix->sec, 1);
+    fat32_dirent *d = (fat32_dirent *)buf + fix->idx;
+
+    if (fix->len < fix->need) {
+        // Chain is too short, believe the chain.
+        d->file_size = fix->len * ctx->spc * BSIZE;
+    } else {
+        // Chain is too long, cut it after the clusters the size needs.
+        u32 c = fix->first;
+        for (u32 i = 1; i < fix->need; i++)
+            c = ctx->fat[c] & FAT_MASK;
+        u32 next = (fix->need == 0) ? c : ctx->fat[c] & FAT_MASK;
+        if (fix->need == 0) {
+            d->fat_clus_hi = d->fat_clus_lo = 0;
+        } else {
+            set_eoc(ctx, c);
+        }
+        for (u32 i = fix->need; i < fix->len; i++) {
+            u32 after = ctx->fat[next] & FAT_MASK;
+            free_clus(ctx, next);
+            next = after;
+        }
+    }
+
+    bwrite(buf, fix->sec, 1);
+}
+
+static u32 repair(fsck_ctx *ctx, fsck_report *rep) {
+    u32 fixed = 0;
+
+    for (u32 i = 0; i < ctx->nworkers; i++) {
+        fsck_worker *w = &ctx->workers[i];
+        for (u32 j = 0; j < w->nend; j++, fixed++)
+            set_eoc(ctx, w->ends[j]);
+    }
+    for (u32 i = 0; i < ctx->nworkers; i++) {
+        fsck_worker *w = &ctx->workers[i];
+        for (u32 j = 0; j < w->nfix; j++, fixed++)
+            repair_size(ctx, &w->fixes[j]);
+    }
+
+    u32 nfree = 0;
+    for (u32 c = 2; c < ctx->nclus; c++) {
+        u32 fe = ctx->fat[c] & FAT_MASK;
+        if (fe != FE_FREE && fe != FE_BAD && !test_bit(ctx->owned, c)) {
+            free_clus(ctx, c);
+            fe = FE_FREE;
+        }
+        nfree += (fe == FE_FREE);
+    }
+    fixed += rep->lost_chains;
+
+    // Rewrite changed sectors into every FAT, which also resyncs the mirrors.
+    for (u32 sec = 0; sec < ctx->fat_sz; sec++) {
+        if (!ctx->dirty[sec])
+            continue;
+        for (u32 f = 0; f < ctx->num_fats; f++)
+            bwrite(ctx->fat + sec * FAT_EPS, ctx->fat_start + f * ctx->fat_sz + sec,
+                   1);
+    }
+    if (rep->fat_mismatches)
+        fixed++;
+
+    u8 buf[BSIZE];
+    bread(buf, ctx->fs->bpb.fs_info, 1);
+    if (*(u32 *)buf == 0x41615252 && *(u32 *)(buf + 484) == 0x61417272) {
+        if (*(u32 *)(buf + 488) != nfree) {
+            *(u32 *)(buf + 488) = nfree;
+            bwrite(buf, ctx->fs->bpb.fs_info, 1);
+            fixed++;
+        }
+    }
+
+    return fixed;
+}
+
+static void merge_report(fsck_report *dst, fsck_report *src) {
+    u32 *d = (u32 *)dst, *s = (u32 *)src;
+    for (u32 i = 0; i < sizeof(fsck_report) / sizeof(u32); i++)
+        d[i] += s[i];
+}
+
+u32 fsck(fat32 *fs, int flags, int nthreads, fsck_report *rep) {
+    fat32_bpb *bpb = &fs->bpb;
+    fsck_ctx ctx = {
+        .fs = fs,
+        .flags = flags,
+        .fat_start = bpb->rsvd_sec_cnt,
+        .fat_sz = bpb->fat_sz_32,
+        .num_fats = bpb->num_fats,
+        .spc = bpb->sec_per_clus,
+        .data_sec = fs->rootdir_base_sec,
+    };
+    ctx.nclus = (bpb->tot_sec_32 - ctx.data_sec) / ctx.spc + 2;
+    ctx.nclus = min(ctx.nclus, ctx.fat_sz * FAT_EPS);
+    assert((u64)bpb->tot_sec_32 <= block_nsec());
+
+    if (nthreads <= 0)
+        nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    ctx.nworkers = max(nthreads, 1);
+
+    ctx.fat = malloc((usize)ctx.fat_sz * BSIZE);
+    ctx.owned = calloc(ctx.nclus / 64 + 1, sizeof(u64));
+    ctx.pointed = calloc(ctx.nclus / 64 + 1, sizeof(u64));
+    ctx.dirty = calloc(ctx.fat_sz, 1);
+    ctx.workers = calloc(ctx.nworkers, sizeof(fsck_worker));
+    assert(ctx.fat && ctx.owned && ctx.pointed && ctx.dirty && ctx.workers);
+
+    for (u32 i = 0; i < ctx.nworkers; i++) {
+        fsck_worker *w = &ctx.workers[i];
+        w->ctx = &ctx;
+        w->id = i;
+        w->buf = malloc(ctx.spc * BSIZE);
+        assert(w->buf);
+        pthread_mutex_init(&w->dq.lock, NULL);
+    }
+
+    run_partitioned(&ctx, fat_scan);
+
+    char *root = strdup("/");
+    ctx.workers[0].rep.dirs++;
+    push_work(&ctx.workers[0], bpb->root_clus, root);
+    for (u32 i = 0; i < ctx.nworkers; i++)
+        pthread_create(&ctx.workers[i].tid, NULL, walk_tree, &ctx.workers[i]);
+    for (u32 i = 0; i < ctx.nworkers; i++)
+        pthread_join(ctx.workers[i].tid, NULL);
+
+    run_partitioned(&ctx, find_lost);
+
+    memset(rep, 0, sizeof(fsck_report));
+    rep->clusters = ctx.nclus - 2;
+    for (u32 i = 0; i < ctx.nworkers; i++)
+        merge_report(rep, &ctx.workers[i].rep);
+
+    u8 buf[BSIZE];
+    bread(buf, bpb->fs_info, 1);
+    u32 fsi_free = *(u32 *)(buf + 488);
+    if (*(u32 *)buf == 0x41615252 && fsi_free != 0xffffffff &&
+        fsi_free != rep->free) {
+        rep->fsinfo_mismatch = 1;
+        problem(&ctx, "FSInfo claims %u free clusters, FAT has %u\n", fsi_free,
+                rep->free);
+    }
+
+    u32 problems = rep->cross_links + rep->bad_chains + rep->bad_dirents +
+                   rep->size_mismatches + rep->fsinfo_mismatch +
+                   (rep->fat_mismatches ? 1 : 0) +
+                   (rep->lost_chains ? rep->lost_chains : !!rep->lost_clusters);
+
+    if ((flags & FSCK_REPAIR) && problems)
+        rep->repaired = repair(&ctx, rep);
+
+    for (u32 i = 0; i < ctx.nworkers; i++) {
+        fsck_worker *w = &ctx.workers[i];
+        pthread_mutex_destroy(&w->dq.lock);
+        free(w->dq.items);
+        free(w->buf);
+        free(w->fixes);
+        free(w->ends);
+    }
+    free(ctx.workers);
+    free(ctx.dirty);
+    free(ctx.pointed);
+    free(ctx.owned);
+    free(ctx.fat);
+
+    return problems;
+}
+
+void fsck_print_report(fsck_report *rep) {
+    printf("clusters: %u total, %u used, %u free, %u bad\n", rep->clusters,
+           rep->used, rep->free, rep->bad);
+    printf("%u files, %u directories\n", rep->files, rep->dirs);
+    printf("lost: %u clusters in %u chains\n", rep->lost_clusters,
+           rep->lost_chains);
+    printf("cross-linked clusters: %u\n", rep->cross_links);
+    printf("broken chains: %u\n", rep->bad_chains);
+    printf("bad dirents: %u\n", rep->bad_dirents);
+    printf("size mismatches: %u\n", rep->size_mismatches);
+    printf("preallocated files: %u\n", rep->preallocated);
+    printf("FAT mirror mismatches: %u entries\n", rep->fat_mismatches);
+    printf("FSInfo free count: %s\n", rep->fsinfo_mismatch ? "wrong" : "ok");
+    if (rep->repaired)
+        printf("repaired: %u\n", rep->repaired);
+}
+
+void test_fsck(fat32 *fs) {
+    fsck_report rep;
+
+    fs_sync();
+    u32 problems = fsck(fs, FSCK_VERBOSE, 0, &rep);
+    fsck_print_report(&rep);
+    printf("problems: %u\n", problems);
+
+    if (problems) {
+        fsck(fs, FSCK_REPAIR, 0, &rep);
+        printf("repaired: %u\n", rep.repaired);
+        problems = fsck(fs, FSCK_VERBOSE, 4, &rep);
+        printf("problems after repair: %u\n", problems);
+        assert(problems == 0);
+        // Pick up the repaired free count.
+        init_fs(fs);
+    }
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <skinny.h>
+
+// Consistency checker for FAT32 images.
+//
+// The FAT is scanned in parallel partitions, the directory tree is walked
+// by a small work-stealing pool, and every cluster reachable from a
+// directory entry is claimed in an ownership bitmap. Whatever is allocated
+// in the FAT but owned by nobody is a lost chain, whatever is claimed twice
+// is cross-linked.
+
+#define FSCK_REPAIR  0x01 // Fix what can be fixed safely
+#define FSCK_VERBOSE 0x02 // Print every problem as it is found
+
+typedef struct fsck_report {
+    u32 clusters;        // Data clusters in the volume
+    u32 free;            // Free entries in FAT 1
+    u32 used;            // Allocated entries in FAT 1
+    u32 bad;             // Entries marked bad
+    u32 files;
+    u32 dirs;
+
+    u32 lost_clusters;   // Allocated, but not reachable from any dirent
+    u32 lost_chains;     // Heads of the lost clusters
+    u32 cross_links;     // Clusters claimed by more than one chain
+    u32 bad_chains;      // Chains running into free, bad or invalid entries
+    u32 bad_dirents;     // Dirents pointing outside the data region
+    u32 size_mismatches; // File size disagrees with the chain length
+    u32 preallocated;    // Files with clusters reserved past EOF, not a problem
+    u32 fat_mismatches;  // FAT 1 entries differing from a mirror
+    u32 fsinfo_mismatch; // FSInfo free count disagrees with the FAT
+
+    u32 repaired;        // Number of fixes written back
+} fsck_report;
+
+// Checks the mounted filesystem with `nthreads` workers (0 picks one per
+// CPU) and fills `rep`. Returns the number of problems found.
+u32 fsck(fat32 *fs, int flags, int nthreads, fsck_report *rep);
+
+void fsck_print_report(fsck_report *rep);
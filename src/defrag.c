@@ -0,0 +1,386 @@
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <block.h>
+#include <defrag.h>
+#include <stats.h>
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define DENTS_PS   (BSIZE / sizeof(fat32_dirent))
+#define SCAN_CHUNK 64 // Sectors per bread() while scanning the FAT
+
+// A live entry of a directory, collected before anything in it moves.
+typedef struct dentry {
+    u32  inum;
+    u32  first;
+    int  is_dir;
+    char name[SFNSIZ];
+} dentry;
+
+static int bucket(u32 v) {
+    int b = v ? 31 - __builtin_clz(v) : 0;
+    return min(b, FRAG_BUCKETS - 1);
+}
+
+// Returns the live entries of `dp` in a malloc'ed array, "." and ".."
+// left out.
+static dentry *list_dir(inode *dp, u32 *count) {
+    u8 buf[BSIZE];
+    dentry *ents = NULL;
+    u32 n = 0, cap = 0;
+
+    for (u32 off = 0; off < dp->size; off += BSIZE) {
+        u32 base;
+        if (readi(dp, 0, buf, off, BSIZE, &base) != BSIZE)
+            break;
+        fat32_dirent *dents = (fat32_dirent *)buf;
+
+        for (u32 i = 0; i < DENTS_PS; i++) {
+            fat32_dirent *d = &dents[i];
+            u8 c = d->name[0];
+            if (c == 0x00)
+                goto out;
+            if (c == 0xe5 || (d->attr & ATTR_LONG_NAME) == ATTR_LONG_NAME ||
+                (d->attr & ATTR_VOLUME_ID) || c == '.')
+                continue;
+
+            if (n == cap) {
+                cap = cap ? cap * 2 : 64;
+                ents = realloc(ents, cap * sizeof(dentry));
+                assert(ents);
+            }
+            dentry *e = &ents[n++];
+            e->inum = base + i * sizeof(fat32_dirent);
+            e->first = (d->fat_clus_hi << 16) | d->fat_clus_lo;
+            e->is_dir = (d->attr & ATTR_DIRECTORY) != 0;
+            fat_decode_sfn(e->name, d);
+        }
+    }
+out:
+    *count = n;
+    return ents;
+}
+
+static void scan_tree(frag_report *rep, inode *dp, char *path, FILE *list) {
+    u32 n;
+    dentry *ents = list_dir(dp, &n);
+    usize plen = strlen(path);
+
+    for (u32 i = 0; i < n; i++) {
+        dentry *e = &ents[i];
+        char *sub = malloc(plen + SFNSIZ + 2);
+        assert(sub);
+        sprintf(sub, "%s/%s", plen == 1 ? "" : path, e->name);
+
+        u32 nclus = 0, extents = 0;
+        if (e->first != 0)
+            extents = fat_chain_extents(e->first, &nclus);
+        if (e->is_dir)
+            rep->dirs++;
+        else
+            rep->files++;
+        rep->extents += extents;
+        if (extents)
+            rep->extent_hist[bucket(extents)]++;
+        if (extents > rep->max_extents)
+            rep->max_extents = extents;
+        if (extents > 1) {
+            rep->fragmented++;
+            if (list)
+                fprintf(list, "%8u %s\n", extents, sub);
+        }
+
+        if (e->is_dir) {
+            inode *ip = iget(0, e->inum);
+            scan_tree(rep, ip, sub, list);
+            iput(ip);
+        }
+        free(sub);
+    }
+    free(ents);
+}
+
+static void scan_free(fat32 *fs, frag_report *rep) {
+    u32 *ents = malloc(SCAN_CHUNK * BSIZE);
+    u32 eps = BSIZE / sizeof(fat_entry);
+    u32 end = fs->nclus + 2, run = 0;
+    assert(ents);
+
+    for (u32 sec = 0; sec * eps < end; sec += SCAN_CHUNK) {
+        u32 nsec = min(SCAN_CHUNK, fs->bpb.fat_sz_32 - sec);
+        bread(ents, fs->bpb.rsvd_sec_cnt + sec, nsec);
+
+        for (u32 i = 0; i < nsec * eps; i++) {
+            u32 clus = sec * eps + i;
+            if (clus < 2)
+                continue;
+            if (clus < end && ents[i] == FE_FREE) {
+                run++;
+                rep->free_clus++;
+                continue;
+            }
+            if (run) {
+                rep->free_runs++;
+                rep->free_hist[bucket(run)]++;
+                if (run > rep->largest_free)
+                    rep->largest_free = run;
+            }
+            run = 0;
+            if (clus >= end)
+                break;
+        }
+    }
+    if (run) {
+        rep->free_runs++;
+        rep->free_hist[bucket(run)]++;
+        if (run > rep->largest_free)
+            rep->largest_free = run;
+    }
+    free(ents);
+}
+
+void frag_scan(fat32 *fs, frag_report *rep, FILE *list) {
+    memset(rep, 0, sizeof(frag_report));
+    // First clusters are read from the entries.
+    iflush();
+
+    inode *root = iget(0, 0);
+    scan_tree(rep, root, "/", list);
+    iput(root);
+    scan_free(fs, rep);
+}
+
+static void print_hist(FILE *f, const char *what, u32 *hist) {
+    for (int b = 0; b < FRAG_BUCKETS; b++) {
+        if (hist[b])
+            fprintf(f, "  %-8s [%u, %u) %u\n", what, 1u << b,
+                    b == 31 ? ~0u : 2u << b, hist[b]);
+    }
+}
+
+void frag_print_report(FILE *f, frag_report *rep) {
+    u32 total = rep->files + rep->dirs;
+
+    fprintf(f, "%u files, %u directories, %u fragmented\n", rep->files,
+            rep->dirs, rep->fragmented);
+    fprintf(f, "extents: %llu, %.2f per file, at most %u\n", rep->extents,
+            total ? (double)rep->extents / total : 0.0, rep->max_extents);
+    print_hist(f, "extents", rep->extent_hist);
+    fprintf(f, "free: %u clusters in %u runs, largest %u\n", rep->free_clus,
+            rep->free_runs, rep->largest_free);
+    print_hist(f, "run", rep->free_hist);
+}
+
+typedef struct defrag_ctx {
+    defrag_budget *budget;
+    defrag_result *res;
+    u64 start;
+    int stopped;
+} defrag_ctx;
+
+static int over_budget(defrag_ctx *c) {
+    defrag_budget *b = c->budget;
+    if (b == NULL)
+        return 0;
+    if (b->max_ns && stat_now() - c->start >= b->max_ns)
+        return 1;
+    if (b->max_bytes && c->res->bytes >= b->max_bytes)
+        return 1;
+    return 0;
+}
+
+// Takes the subdirectories among `ents` while the lock they were listed
+// under is still held. Held, their inums follow their entries around, and
+// a slot that is reused later can't be mistaken for them.
+static inode **hold_dirs(dentry *ents, u32 n) {
+    inode **dirs = calloc(n ? n : 1, sizeof(inode *));
+    assert(dirs);
+    for (u32 i = 0; i < n; i++) {
+        if (ents[i].is_dir)
+            dirs[i] = iget(0, ents[i].inum);
+    }
+    return dirs;
+}
+
+static void put_dirs(inode **dirs, u32 n) {
+    engine_rdlock();
+    for (u32 i = 0; i < n; i++) {
+        if (dirs[i])
+            iput(dirs[i]);
+    }
+    engine_unlock();
+    free(dirs);
+}
+
+// Children first, then the entry itself.
+static void defrag_tree(defrag_ctx *c, inode *dp) {
+    u32 n;
+    engine_rdlock();
+    if (dp->dead) {
+        engine_unlock();
+        return;
+    }
+    dentry *ents = list_dir(dp, &n);
+    inode **dirs = hold_dirs(ents, n);
+    engine_unlock();
+
+    for (u32 i = 0; i < n && !c->stopped; i++) {
+        dentry *e = &ents[i];
+        if (dirs[i]) {
+            defrag_tree(c, dirs[i]);
+            // Let go first, irelocate() leaves held inodes alone.
+            engine_rdlock();
+            iput(dirs[i]);
+            engine_unlock();
+            dirs[i] = NULL;
+            if (c->stopped)
+                break;
+        }
+
+        if (over_budget(c)) {
+            c->stopped = 1;
+            break;
+        }
+        // One move at a time, so clients get in between. An entry that
+        // changed since it was listed is skipped.
+        u64 bytes;
+        engine_wrlock();
+        int moved = irelocate(e->inum, e->first, &bytes);
+        engine_unlock();
+        if (moved > 0)
+            c->res->moved++;
+        else if (moved < 0)
+            c->res->skipped++;
+        c->res->bytes += bytes;
+    }
+    put_dirs(dirs, n);
+    free(ents);
+}
+
+int defrag(fat32 *fs, defrag_budget *budget, defrag_result *res) {
+    defrag_ctx c = {.budget = budget, .res = res, .start = stat_now()};
+    memset(res, 0, sizeof(defrag_result));
+
+    inode *root = iget(0, 0);
+    defrag_tree(&c, root);
+    iput(root);
+
+    res->ns = stat_now() - c.start;
+    return !c.stopped;
+}
+
+static u32 compact_tree(inode *dp) {
+    u32 n;
+    engine_wrlock();
+    if (dp->dead) {
+        engine_unlock();
+        return 0;
+    }
+    u32 released = dir_compact(dp);
+    dentry *ents = list_dir(dp, &n);
+    inode **dirs = hold_dirs(ents, n);
+    engine_unlock();
+
+    for (u32 i = 0; i < n; i++) {
+        if (dirs[i])
+            released += compact_tree(dirs[i]);
+    }
+    put_dirs(dirs, n);
+    free(ents);
+    return released;
+}
+
+u32 compact_dirs(fat32 *fs) {
+    inode *root = iget(0, 0);
+    u32 released = compact_tree(root);
+    iput(root);
+    return released;
+}
+
+void test_defrag(fat32 *fs) {
+    u32 cbytes = fs->bpb.sec_per_clus * BSIZE;
+    char *buf = malloc(cbytes), *got = malloc(cbytes);
+    char name[DIRSIZ], path[64];
+    assert(buf && got);
+
+    // Interleave a file and a directory with a filler, a cluster at a time.
+    inode *root = namei("/");
+    inode *fa = dirlink(root, "FRAGA.TXT", T_FILE);
+    inode *fb = dirlink(root, "FRAGB.TXT", T_FILE);
+    inode *dir = dirlink(root, "FRAGDIR", T_DIR);
+    inode *sub = dirlink(dir, "SUB", T_DIR);
+    for (u32 i = 0; i < 8; i++) {
+        memset(buf, 'a' + i, cbytes);
+        assert(writei(fa, 0, buf, i * cbytes, cbytes) == cbytes);
+        for (u32 j = 0; j < DENTS_PS; j++) {
+            snprintf(name, sizeof(name), "F%u", (u32)(i * DENTS_PS + j));
+            iput(dirlink(dir, name, T_FILE));
+        }
+        assert(writei(fb, 0, buf, i * cbytes, cbytes) == cbytes);
+    }
+    iput(sub);
+
+    u32 nclus;
+    printf("FRAGA.TXT extents: %u\n", fat_chain_extents(fa->first, &nclus));
+    assert(fat_chain_extents(fa->first, &nclus) > 1);
+    assert(fat_chain_extents(dir->first, &nclus) > 1);
+
+    frag_report rep;
+    frag_scan(fs, &rep, stdout);
+    frag_print_report(stdout, &rep);
+    assert(rep.fragmented >= 3);
+
+    // Held inodes are skipped, so let go of them first.
+    iput(fa);
+    iput(fb);
+    iput(dir);
+    u64 bytes;
+    fb = namei("/FRAGB.TXT");
+    assert(irelocate(fb->inum, fb->first, &bytes) == -1 && bytes == 0);
+    iput(fb);
+
+    // So is a slot that was freed since it was listed.
+    inode *x = dirlink(root, "STALE.TXT", T_FILE);
+    assert(writei(x, 0, buf, 0, cbytes) == cbytes);
+    u32 xinum = x->inum, xfirst = x->first;
+    iput(x);
+    assert(fat_unlink("/STALE.TXT") == 0);
+    assert(irelocate(xinum, xfirst, &bytes) == -1 && bytes == 0);
+
+    // A tiny budget stops after the first move, the rest finishes it.
+    defrag_result res;
+    defrag_budget tiny = {.max_bytes = 1};
+    assert(defrag(fs, &tiny, &res) == 0);
+    assert(res.moved == 1);
+    assert(defrag(fs, NULL, &res) == 1);
+    printf("moved %u, skipped %u, %llu bytes\n", res.moved, res.skipped,
+           res.bytes);
+
+    // Inums below the moved directory changed, so look everything up again.
+    fa = namei("/FRAGA.TXT");
+    dir = namei("/FRAGDIR");
+    assert(fat_chain_extents(fa->first, &nclus) == 1);
+    assert(fat_chain_extents(dir->first, &nclus) == 1);
+    for (u32 i = 0; i < 8; i++) {
+        assert(readi(fa, 0, got, i * cbytes, cbytes, NULL) == cbytes);
+        for (u32 j = 0; j < cbytes; j++)
+            assert(got[j] == 'a' + i);
+    }
+    snprintf(path, sizeof(path), "/FRAGDIR/F%u", 8 * (u32)DENTS_PS - 1);
+    assert(namei(path) != NULL);
+
+    // The subdirectory's ".." follows its parent.
+    sub = namei("/FRAGDIR/SUB");
+    fat32_dirent dots[2];
+    assert(readi(sub, 0, dots, 0, sizeof(dots), NULL) == sizeof(dots));
+    assert(((dots[1].fat_clus_hi << 16) | dots[1].fat_clus_lo) ==
+           dir->first);
+
+    frag_scan(fs, &rep, NULL);
+    frag_print_report(stdout, &rep);
+    free(buf);
+    free(got);
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <skinny.h>
+
+// Online defragmenter.
+//
+// The tree is walked children first, so by the time a directory is moved
+// (which changes the inums of everything in it) nothing below it is left
+// to visit. Each fragmented file or directory is copied into one free run
+// by irelocate(). A budget bounds a pass, and the next pass picks up where
+// it left off since whatever was already moved is contiguous and skipped.
+
+#define FRAG_BUCKETS 32
+
+typedef struct frag_report {
+    u32 files;
+    u32 dirs;
+    u32 fragmented;                // Files and dirs with more than one extent
+    u64 extents;                   // Extents over all files and dirs
+    u32 max_extents;
+    u32 extent_hist[FRAG_BUCKETS]; // Non-empty files by extents, bucket i
+                                   // is [2^i, 2^(i+1))
+    u32 free_clus;
+    u32 free_runs;
+    u32 free_hist[FRAG_BUCKETS];   // Free runs by clusters, same buckets
+    u32 largest_free;              // Longest free run in clusters
+} frag_report;
+
+typedef struct defrag_budget {
+    u64 max_ns;    // Wall time for the pass, 0 for no limit
+    u64 max_bytes; // Bytes copied in the pass, 0 for no limit
+} defrag_budget;
+
+typedef struct defrag_result {
+    u32 moved;   // Files and dirs made contiguous
+    u32 skipped; // Fragmented, but held or no free run long enough
+    u64 bytes;   // Bytes copied
+    u64 ns;
+} defrag_result;
+
+// Fills `rep`. If `list` is set, each fragmented path is printed to it
+// with its extent count.
+void frag_scan(fat32 *fs, frag_report *rep, FILE *list);
+
+void frag_print_report(FILE *f, frag_report *rep);
+
+// Runs one pass within `budget` (NULL for none) and fills `res`.
+// Returns 1 if the pass got through the whole tree, 0 if the budget ran out.
+int defrag(fat32 *fs, defrag_budget *budget, defrag_result *res);
+
+// Compacts every directory, returns the clusters released.
+u32 compact_dirs(fat32 *fs);
@@ -0,0 +1,802 @@
+#define _GNU_SOURCE // accept4(), memfd_create()
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <server.h>
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+#define SRV_EVENTS 64
+#define SRV_INBUF  (64 * 1024)
+#define SRV_BURST  64 // Requests a worker runs for a client before the next
+
+typedef struct request {
+    struct request *next;
+    p_req hdr;
+    u8 payload[]; // hdr.len bytes and a terminator, for paths and names
+} request;
+
+typedef struct conn {
+    int fd;
+    u8 *in; // Bytes read that aren't a whole request yet
+    u32 inlen, incap;
+    request *head, *tail; // Read, not run yet
+    int busy;             // On the ready list or with a worker
+    int dead;             // Hung up, freed by whoever lets go of it last
+    struct conn *next_ready;
+    struct conn *next, *prev; // All connections
+    inode **fh;               // Handles, only touched by the worker
+    u32 nfh;
+} conn;
+
+struct srv {
+    int lfd, efd, stopfd;
+    char *path;
+    pthread_t loop;
+    pthread_t *workers;
+    u32 nworkers;
+    pthread_mutex_t lock; // Guards everything of a conn but fd, in and fh
+    pthread_cond_t ready;
+    conn *ready_head, *ready_tail;
+    conn *conns;
+    int stopping;
+};
+
+// Handles.
+
+static u32 handle_add(conn *c, inode *ip) {
+    u32 i = 0;
+    while (i < c->nfh && c->fh[i] != NULL) {
+        i++;
+    }
+    if (i == c->nfh) {
+        c->nfh = c->nfh ? c->nfh * 2 : 16;
+        c->fh = realloc(c->fh, c->nfh * sizeof(inode *));
+        assert(c->fh);
+        memset(c->fh + i, 0, (c->nfh - i) * sizeof(inode *));
+    }
+    c->fh[i] = ip;
+    return i;
+}
+
+static inode *handle_get(conn *c, u32 fh) {
+    return fh < c->nfh ? c->fh[fh] : NULL;
+}
+
+// Call with s->lock held, once nobody runs or reads for `c` any more.
+static void conn_free(srv *s, conn *c) {
+    if (c->prev) {
+        c->prev->next = c->next;
+    } else {
+        s->conns = c->next;
+    }
+    if (c->next) {
+        c->next->prev = c->prev;
+    }
+
+    engine_rdlock();
+    for (u32 i = 0; i < c->nfh; i++) {
+        if (c->fh[i]) {
+            iput(c->fh[i]);
+        }
+    }
+    engine_unlock();
+    while (c->head) {
+        request *r = c->head;
+        c->head = r->next;
+        free(r);
+    }
+    close(c->fd);
+    free(c->fh);
+    free(c->in);
+    free(c);
+}
+
+// Sends all of `iov`, the descriptor `pfd` along with it if it isn't -1.
+static int send_all(int fd, struct iovec *iov, int niov, int pfd) {
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct msghdr m = {.msg_iov = iov, .msg_iovlen = niov};
+
+    if (pfd >= 0) {
+        memset(cbuf, 0, sizeof(cbuf));
+        m.msg_control = cbuf;
+        m.msg_controllen = sizeof(cbuf);
+        struct cmsghdr *cm = CMSG_FIRSTHDR(&m);
+        cm->cmsg_level = SOL_SOCKET;
+        cm->cmsg_type = SCM_RIGHTS;
+        cm->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cm), &pfd, sizeof(int));
+    }
+
+    while (m.msg_iovlen > 0) {
+        ssize_t n = sendmsg(fd, &m, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN) {
+                struct pollfd p = {.fd = fd, .events = POLLOUT};
+                poll(&p, 1, -1);
+                continue;
+            }
+            return -1;
+        }
+        // The descriptor went with the first bytes.
+        m.msg_control = NULL;
+        m.msg_controllen = 0;
+        while (m.msg_iovlen > 0 && (size_t)n >= m.msg_iov->iov_len) {
+            n -= m.msg_iov->iov_len;
+            m.msg_iov++;
+            m.msg_iovlen--;
+        }
+        if (m.msg_iovlen > 0) {
+            m.msg_iov->iov_base = (u8 *)m.msg_iov->iov_base + n;
+            m.msg_iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static void fill_stat(p_stat *st, inode *ip) {
+    memset(st, 0, sizeof(p_stat));
+    st->inum = ip->inum;
+    st->type = ip->type;
+    st->size = ip->size;
+    st->mdate = ip->mdate;
+    st->mtime = ip->mtime;
+    st->adate = ip->adate;
+}
+
+typedef struct pack_ctx {
+    u8 *buf;
+    u32 cap, used;
+    u32 skip;  // Entries still to pass over
+    u32 count; // Entries packed
+    int full;
+} pack_ctx;
+
+static void pack_one(dir_entry *e, void *arg) {
+    pack_ctx *c = arg;
+    if (c->full) {
+        return;
+    }
+    if (c->skip > 0) {
+        c->skip--;
+        return;
+    }
+    u32 len = strlen(e->name);
+    if (c->used + sizeof(p_dirent) + len > c->cap) {
+        c->full = 1;
+        return;
+    }
+    p_dirent d = {.inum = e->inum, .type = e->type, .size = e->size,
+                  .namelen = len};
+    memcpy(c->buf + c->used, &d, sizeof(p_dirent));
+    memcpy(c->buf + c->used + sizeof(p_dirent), e->name, len);
+    c->used += sizeof(p_dirent) + len;
+    c->count++;
+}
+
+static void run_request(conn *c, request *r) {
+    p_req *rq = &r->hdr;
+    p_reply rp = {.tag = rq->tag, .res = -1};
+    p_stat st;
+    void *out = NULL;
+    u8 *buf = NULL;
+    u32 olen = 0;
+    int pfd = -1;
+    inode *ip;
+
+    switch (rq->op) {
+    case P_OPEN:
+    case P_STAT:
+        engine_rdlock();
+        ip = namei((char *)r->payload);
+        engine_unlock();
+        if (ip == NULL) {
+            break;
+        }
+        fill_stat(&st, ip);
+        out = &st;
+        olen = sizeof(st);
+        if (rq->op == P_OPEN) {
+            rp.res = handle_add(c, ip);
+        } else {
+            rp.res = 0;
+            engine_rdlock();
+            iput(ip);
+            engine_unlock();
+        }
+        break;
+
+    case P_CLOSE:
+        if ((ip = handle_get(c, rq->fh)) == NULL) {
+            break;
+        }
+        c->fh[rq->fh] = NULL;
+        engine_rdlock();
+        iput(ip);
+        engine_unlock();
+        rp.res = 0;
+        break;
+
+    case P_READ: {
+        if ((ip = handle_get(c, rq->fh)) == NULL) {
+            break;
+        }
+        u32 n = min(rq->n, P_MAX_PAYLOAD);
+        if ((rq->flags & P_FD) && n >= SRV_FD_MIN && ip->type == T_FILE) {
+            // Straight from the image into a file of its own, which the
+            // client maps or reads as it likes.
+            int mfd = memfd_create("skinnyd", MFD_CLOEXEC);
+            if (mfd < 0) {
+                break;
+            }
+            engine_rdlock();
+            long got = iexport(ip, rq->off, n, mfd);
+            engine_unlock();
+            if (got < 0) {
+                close(mfd);
+                break;
+            }
+            rp.res = got;
+            rp.flags = P_FD;
+            pfd = mfd;
+            break;
+        }
+        buf = malloc(n ? n : 1);
+        assert(buf);
+        engine_rdlock();
+        int got = readi(ip, 0, buf, rq->off, n, NULL);
+        engine_unlock();
+        if (got >= 0) {
+            rp.res = got;
+            out = buf;
+            olen = got;
+        }
+        break;
+    }
+
+    case P_WRITE: {
+        if ((ip = handle_get(c, rq->fh)) == NULL || ip->type != T_FILE) {
+            break;
+        }
+        engine_wrlock();
+        int got = writei(ip, 0, r->payload, rq->off, rq->len);
+        engine_unlock();
+        rp.res = got == rq->len ? got : -1;
+        break;
+    }
+
+    case P_READDIR: {
+        if ((ip = handle_get(c, rq->fh)) == NULL || ip->type != T_DIR) {
+            break;
+        }
+        pack_ctx pc = {.cap = min(rq->n, P_MAX_PAYLOAD), .skip = rq->off};
+        buf = pc.buf = malloc(pc.cap ? pc.cap : 1);
+        assert(buf);
+        engine_rdlock();
+        dir_list(ip, pack_one, &pc);
+        engine_unlock();
+        rp.res = pc.count;
+        out = buf;
+        olen = pc.used;
+        break;
+    }
+
+    case P_CREATE:
+        if ((ip = handle_get(c, rq->fh)) == NULL || ip->type != T_DIR ||
+            (rq->n != T_FILE && rq->n != T_DIR)) {
+            break;
+        }
+        // dirlink() doesn't look for the name, a taken one fails here.
+        engine_wrlock();
+        inode *old = fat_dirlookup(ip, (char *)r->payload);
+        if (old) {
+            iput(old);
+            ip = NULL;
+        } else {
+            ip = dirlink(ip, (char *)r->payload, rq->n);
+        }
+        engine_unlock();
+        if (ip == NULL) {
+            break;
+        }
+        fill_stat(&st, ip);
+        out = &st;
+        olen = sizeof(st);
+        rp.res = handle_add(c, ip);
+        break;
+    }
+
+    rp.len = olen;
+    struct iovec iov[2] = {{&rp, sizeof(rp)}, {out, olen}};
+    // A client that went away is noticed by the loop.
+    send_all(c->fd, iov, olen ? 2 : 1, pfd);
+    if (pfd >= 0) {
+        close(pfd);
+    }
+    free(buf);
+}
+
+// Call with s->lock held.
+static void make_ready(srv *s, conn *c) {
+    c->busy = 1;
+    c->next_ready = NULL;
+    if (s->ready_tail) {
+        s->ready_tail->next_ready = c;
+    } else {
+        s->ready_head = c;
+    }
+    s->ready_tail = c;
+    pthread_cond_signal(&s->ready);
+}
+
+static void *srv_worker(void *arg) {
+    srv *s = arg;
+
+    pthread_mutex_lock(&s->lock);
+    for (;;) {
+        while (s->ready_head == NULL && !s->stopping) {
+            pthread_cond_wait(&s->ready, &s->lock);
+        }
+        conn *c = s->ready_head;
+        if (c == NULL) {
+            break;
+        }
+        s->ready_head = c->next_ready;
+        if (s->ready_head == NULL) {
+            s->ready_tail = NULL;
+        }
+
+        for (u32 k = 0; k < SRV_BURST && !c->dead && c->head; k++) {
+            request *r = c->head;
+            c->head = r->next;
+            if (c->head == NULL) {
+                c->tail = NULL;
+            }
+            pthread_mutex_unlock(&s->lock);
+            run_request(c, r);
+            free(r);
+            pthread_mutex_lock(&s->lock);
+        }
+
+        if (c->dead) {
+            conn_free(s, c);
+        } else if (c->head) {
+            // Others get a turn before the rest of this one's.
+            make_ready(s, c);
+        } else {
+            c->busy = 0;
+        }
+    }
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+static void conn_hangup(srv *s, conn *c) {
+    epoll_ctl(s->efd, EPOLL_CTL_DEL, c->fd, NULL);
+    pthread_mutex_lock(&s->lock);
+    c->dead = 1;
+    if (!c->busy) {
+        conn_free(s, c);
+    }
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Reads what `c` sent and queues the whole requests in it. Returns -1 if
+// it hung up or broke the protocol.
+static int conn_read(srv *s, conn *c) {
+    request *first = NULL, **tail = &first, *last = NULL;
+    int gone = 0;
+
+    for (;;) {
+        ssize_t n = read(c->fd, c->in + c->inlen, c->incap - c->inlen);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN) {
+            break;
+        }
+        if (n <= 0) {
+            gone = 1;
+            break;
+        }
+        c->inlen += n;
+
+        u32 at = 0, want = 0;
+        while (c->inlen - at >= sizeof(p_req)) {
+            p_req hdr;
+            memcpy(&hdr, c->in + at, sizeof(p_req));
+            if (hdr.len > P_MAX_PAYLOAD) {
+                gone = 1;
+                break;
+            }
+            u32 whole = sizeof(p_req) + hdr.len;
+            if (c->inlen - at < whole) {
+                want = whole;
+                break;
+            }
+            request *r = malloc(sizeof(request) + hdr.len + 1);
+            assert(r);
+            r->next = NULL;
+            r->hdr = hdr;
+            memcpy(r->payload, c->in + at + sizeof(p_req), hdr.len);
+            r->payload[hdr.len] = '\0';
+            *tail = last = r;
+            tail = &r->next;
+            at += whole;
+        }
+        memmove(c->in, c->in + at, c->inlen - at);
+        c->inlen -= at;
+        if (gone) {
+            break;
+        }
+        if (c->inlen == c->incap || want > c->incap) {
+            c->incap = want > c->incap * 2 ? want : c->incap * 2;
+            c->in = realloc(c->in, c->incap);
+            assert(c->in);
+        }
+    }
+
+    if (first) {
+        pthread_mutex_lock(&s->lock);
+        if (c->tail) {
+            c->tail->next = first;
+        } else {
+            c->head = first;
+        }
+        c->tail = last;
+        if (!c->busy) {
+            make_ready(s, c);
+        }
+        pthread_mutex_unlock(&s->lock);
+    }
+    return gone ? -1 : 0;
+}
+
+static void srv_accept(srv *s) {
+    for (;;) {
+        int fd = accept4(s->lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        conn *c = calloc(1, sizeof(conn));
+        assert(c);
+        c->fd = fd;
+        c->incap = SRV_INBUF;
+        c->in = malloc(c->incap);
+        assert(c->in);
+
+        pthread_mutex_lock(&s->lock);
+        c->next = s->conns;
+        if (s->conns) {
+            s->conns->prev = c;
+        }
+        s->conns = c;
+        pthread_mutex_unlock(&s->lock);
+
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP, .data.ptr = c};
+        assert(epoll_ctl(s->efd, EPOLL_CTL_ADD, fd, &ev) == 0);
+    }
+}
+
+static void *srv_loop(void *arg) {
+    srv *s = arg;
+    struct epoll_event evs[SRV_EVENTS];
+
+    for (;;) {
+        int n = epoll_wait(s->efd, evs, SRV_EVENTS, -1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        assert(n >= 0);
+        for (int i = 0; i < n; i++) {
+            void *p = evs[i].data.ptr;
+            if (p == &s->stopfd) {
+                return NULL;
+            }
+            if (p == &s->lfd) {
+                srv_accept(s);
+                continue;
+            }
+            conn *c = p;
+            if (conn_read(s, c) != 0) {
+                conn_hangup(s, c);
+            }
+        }
+    }
+}
+
+srv *srv_start(const char *path, u32 workers) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return NULL;
+    }
+    strcpy(addr.sun_path, path);
+
+    int lfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lfd < 0) {
+        return NULL;
+    }
+    unlink(path);
+    if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(lfd, 128) != 0) {
+        close(lfd);
+        return NULL;
+    }
+
+    srv *s = calloc(1, sizeof(srv));
+    assert(s && workers > 0);
+    s->lfd = lfd;
+    s->path = strdup(path);
+    s->efd = epoll_create1(EPOLL_CLOEXEC);
+    s->stopfd = eventfd(0, EFD_CLOEXEC);
+    assert(s->efd >= 0 && s->stopfd >= 0);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->ready, NULL);
+
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &s->lfd};
+    assert(epoll_ctl(s->efd, EPOLL_CTL_ADD, lfd, &ev) == 0);
+    ev.data.ptr = &s->stopfd;
+    assert(epoll_ctl(s->efd, EPOLL_CTL_ADD, s->stopfd, &ev) == 0);
+
+    s->nworkers = workers;
+    s->workers = malloc(workers * sizeof(pthread_t));
+    assert(s->workers);
+    for (u32 i = 0; i < workers; i++) {
+        assert(pthread_create(&s->workers[i], NULL, srv_worker, s) == 0);
+    }
+    assert(pthread_create(&s->loop, NULL, srv_loop, s) == 0);
+    return s;
+}
+
+void srv_stop(srv *s) {
+    u64 one = 1;
+    assert(write(s->stopfd, &one, sizeof(one)) == sizeof(one));
+    pthread_join(s->loop, NULL);
+    close(s->lfd);
+    unlink(s->path);
+
+    // Nothing is read any more; the workers free the ones they hold.
+    pthread_mutex_lock(&s->lock);
+    for (conn *c = s->conns, *next; c; c = next) {
+        next = c->next;
+        c->dead = 1;
+        if (!c->busy) {
+            conn_free(s, c);
+        }
+    }
+    s->stopping = 1;
+    pthread_cond_broadcast(&s->ready);
+    pthread_mutex_unlock(&s->lock);
+    for (u32 i = 0; i < s->nworkers; i++) {
+        pthread_join(s->workers[i], NULL);
+    }
+    assert(s->conns == NULL);
+
+    close(s->efd);
+    close(s->stopfd);
+    pthread_mutex_destroy(&s->lock);
+    pthread_cond_destroy(&s->ready);
+    free(s->workers);
+    free(s->path);
+    free(s);
+}
+
+int srv_connect(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        return -1;
+    }
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+int srv_send(int fd, p_req *rq, const void *payload, u32 plen) {
+    rq->len = plen;
+    struct iovec iov[2] = {{rq, sizeof(p_req)}, {(void *)payload, plen}};
+    return send_all(fd, iov, plen ? 2 : 1, -1);
+}
+
+static int recv_all(int fd, void *buf, u32 len) {
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        buf = (u8 *)buf + n;
+        len -= n;
+    }
+    return 0;
+}
+
+int srv_recv(int fd, p_reply *rp, void *buf, u32 cap, int *pfd) {
+    char cbuf[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = {rp, sizeof(p_reply)};
+    struct msghdr m = {.msg_iov = &iov, .msg_iovlen = 1,
+                       .msg_control = cbuf, .msg_controllen = sizeof(cbuf)};
+    ssize_t n;
+
+    *pfd = -1;
+    while ((n = recvmsg(fd, &m, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR) {
+    }
+    if (n <= 0) {
+        return -1;
+    }
+    struct cmsghdr *cm = CMSG_FIRSTHDR(&m);
+    if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+        memcpy(pfd, CMSG_DATA(cm), sizeof(int));
+    }
+    if (recv_all(fd, (u8 *)rp + n, sizeof(p_reply) - n) != 0) {
+        return -1;
+    }
+
+    u32 keep = min(rp->len, cap);
+    if (recv_all(fd, buf, keep) != 0) {
+        return -1;
+    }
+    for (u32 left = rp->len - keep; left > 0;) {
+        u8 skip[4096];
+        u32 k = min(left, sizeof(skip));
+        if (recv_all(fd, skip, k) != 0) {
+            return -1;
+        }
+        left -= k;
+    }
+    return 0;
+}
+
+// Sends one request and waits for its reply, for the test.
+static int call(int fd, p_req rq, const void *payload, u32 plen, void *buf,
+                u32 cap, int *pfd) {
+    p_reply rp;
+    int dummy;
+    assert(srv_send(fd, &rq, payload, plen) == 0);
+    assert(srv_recv(fd, &rp, buf, cap, pfd ? pfd : &dummy) == 0);
+    assert(rp.tag == rq.tag);
+    return rp.res;
+}
+
+void test_server() {
+    printf("file server test\n");
+    enum { BIG = 100 * 1024 };
+    char path[64];
+    u8 *data = malloc(BIG), *got = malloc(BIG);
+    p_stat st;
+    assert(data && got);
+    for (u32 i = 0; i < BIG; i++) {
+        data[i] = i * 7 + 3;
+    }
+
+    snprintf(path, sizeof(path), "/tmp/skinny-test-%d.sock", getpid());
+    srv *s = srv_start(path, 4);
+    assert(s != NULL);
+    int fd = srv_connect(path);
+    assert(fd >= 0);
+
+    int root = call(fd, (p_req){.op = P_OPEN, .tag = 1}, "/", 1, &st,
+                    sizeof(st), NULL);
+    assert(root >= 0 && st.type == T_DIR);
+    int dir = call(fd, (p_req){.op = P_CREATE, .tag = 2, .fh = root, .n = T_DIR},
+                   "Served", 6, &st, sizeof(st), NULL);
+    assert(dir >= 0 && st.type == T_DIR);
+    assert(call(fd, (p_req){.op = P_CREATE, .tag = 3, .fh = root, .n = T_FILE},
+                "Served", 6, &st, sizeof(st), NULL) == -1);
+
+    // Pipelined: the replies come back in order, and the writes are done
+    // before the reads behind them run.
+    p_req rq[8];
+    rq[0] = (p_req){.op = P_CREATE, .tag = 10, .fh = dir, .n = T_FILE};
+    rq[1] = (p_req){.op = P_CREATE, .tag = 11, .fh = dir, .n = T_FILE};
+    assert(srv_send(fd, &rq[0], "big.bin", 7) == 0);
+    assert(srv_send(fd, &rq[1], "SMALL.TXT", 9) == 0);
+    p_reply rp;
+    int pfd, fh[2];
+    for (u32 i = 0; i < 2; i++) {
+        assert(srv_recv(fd, &rp, &st, sizeof(st), &pfd) == 0);
+        assert(rp.tag == 10 + i && rp.res >= 0 && pfd == -1);
+        fh[i] = rp.res;
+    }
+
+    rq[0] = (p_req){.op = P_WRITE, .tag = 20, .fh = fh[0]};
+    rq[1] = (p_req){.op = P_WRITE, .tag = 21, .fh = fh[1]};
+    rq[2] = (p_req){.op = P_READ, .tag = 22, .fh = fh[0], .n = BIG,
+                    .flags = P_FD};
+    rq[3] = (p_req){.op = P_READ, .tag = 23, .fh = fh[1], .off = 1, .n = 100};
+    rq[4] = (p_req){.op = P_STAT, .tag = 24};
+    rq[5] = (p_req){.op = P_READDIR, .tag = 25, .fh = dir, .n = 4096};
+    rq[6] = (p_req){.op = P_READ, .tag = 26, .fh = 999, .n = 10};
+    assert(srv_send(fd, &rq[0], data, BIG) == 0);
+    assert(srv_send(fd, &rq[1], "hello", 5) == 0);
+    assert(srv_send(fd, &rq[2], NULL, 0) == 0);
+    assert(srv_send(fd, &rq[3], NULL, 0) == 0);
+    assert(srv_send(fd, &rq[4], "/Served/big.bin", 15) == 0);
+    assert(srv_send(fd, &rq[5], NULL, 0) == 0);
+    assert(srv_send(fd, &rq[6], NULL, 0) == 0);
+
+    assert(srv_recv(fd, &rp, NULL, 0, &pfd) == 0);
+    assert(rp.tag == 20 && rp.res == BIG);
+    assert(srv_recv(fd, &rp, NULL, 0, &pfd) == 0);
+    assert(rp.tag == 21 && rp.res == 5);
+
+    // The big read comes as a descriptor.
+    assert(srv_recv(fd, &rp, NULL, 0, &pfd) == 0);
+    assert(rp.tag == 22 && rp.res == BIG && (rp.flags & P_FD) && pfd >= 0);
+    assert(rp.len == 0);
+    assert(pread(pfd, got, BIG, 0) == BIG);
+    assert(memcmp(got, data, BIG) == 0);
+    close(pfd);
+
+    assert(srv_recv(fd, &rp, got, BIG, &pfd) == 0);
+    assert(rp.tag == 23 && rp.res == 4 && rp.len == 4 && pfd == -1);
+    assert(memcmp(got, "ello", 4) == 0);
+
+    assert(srv_recv(fd, &rp, &st, sizeof(st), &pfd) == 0);
+    assert(rp.tag == 24 && rp.res == 0 && st.size == BIG && st.type == T_FILE);
+
+    assert(srv_recv(fd, &rp, got, BIG, &pfd) == 0);
+    assert(rp.tag == 25 && rp.res == 2);
+    p_dirent de;
+    memcpy(&de, got, sizeof(de));
+    assert(de.namelen == 7 && memcmp(got + sizeof(de), "big.bin", 7) == 0);
+    assert(de.size == BIG && de.type == T_FILE);
+    memcpy(&de, got + sizeof(de) + 7, sizeof(de));
+    assert(de.namelen == 9 && de.size == 5);
+
+    assert(srv_recv(fd, &rp, NULL, 0, &pfd) == 0);
+    assert(rp.tag == 26 && rp.res == -1);
+
+    // Paging through a directory.
+    assert(call(fd, (p_req){.op = P_READDIR, .tag = 27, .fh = dir, .off = 1,
+                            .n = 4096}, NULL, 0, got, BIG, NULL) == 1);
+    assert(call(fd, (p_req){.op = P_READDIR, .tag = 28, .fh = dir, .off = 2,
+                            .n = 4096}, NULL, 0, got, BIG, NULL) == 0);
+
+    // Another client sees it, and handles are per connection.
+    int fd2 = srv_connect(path);
+    assert(fd2 >= 0);
+    int h = call(fd2, (p_req){.op = P_OPEN, .tag = 1}, "/Served/SMALL.TXT",
+                 17, &st, sizeof(st), NULL);
+    assert(h >= 0 && st.size == 5);
+    assert(call(fd2, (p_req){.op = P_READ, .tag = 2, .fh = h, .n = 5}, NULL, 0,
+                got, BIG, NULL) == 5);
+    assert(memcmp(got, "hello", 5) == 0);
+    assert(call(fd2, (p_req){.op = P_CLOSE, .tag = 3, .fh = h}, NULL, 0, NULL,
+                0, NULL) == 0);
+    assert(call(fd2, (p_req){.op = P_READ, .tag = 4, .fh = h, .n = 5}, NULL, 0,
+                got, BIG, NULL) == -1);
+    assert(call(fd2, (p_req){.op = P_OPEN, .tag = 5}, "/Served/NOPE", 12, &st,
+                sizeof(st), NULL) == -1);
+    close(fd2);
+
+    // Hanging up leaves the handles to the server to drop.
+    close(fd);
+    srv_stop(s);
+
+    inode *ip = namei("/Served/big.bin");
+    assert(ip != NULL && ip->size == BIG && ip->ref == 1);
+    iput(ip);
+    free(data);
+    free(got);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+#include <skinny.h>
+
+// File server.
+//
+// Serves the mounted image to other processes over a Unix domain socket.
+// An epoll loop reads requests off every connection, a pool of workers
+// runs them against the engine and sends the replies. Requests of one
+// connection run one at a time, in order, so a client may pipeline as
+// many as it likes; different connections run side by side.
+//
+// Every message is a fixed header followed by `len` bytes of payload, in
+// host byte order: the socket is local.
+
+enum {
+    P_OPEN = 1, // Path in the payload. Replies a handle, and a p_stat
+    P_CLOSE,    // Drops handle `fh`
+    P_READ,     // `n` bytes of `fh` from `off`. Replies the bytes read
+    P_WRITE,    // The payload to `fh` at `off`. Replies the bytes written
+    P_READDIR,  // Entries of directory `fh` from the `off`th on, as many
+                // p_dirents as fit in `n` bytes. Replies how many
+    P_STAT,     // Path in the payload. Replies 0, and a p_stat
+    P_CREATE,   // Name in the payload, in directory `fh`, of type `n`.
+                // Replies a handle, and a p_stat
+};
+
+// In a P_READ: a reply of at least SRV_FD_MIN bytes may come as a
+// descriptor instead. In its reply: it did, the bytes are at the start of
+// the passed file and the payload is empty.
+#define P_FD       0x01
+#define SRV_FD_MIN (64 * 1024)
+
+#define P_MAX_PAYLOAD (4 * 1024 * 1024) // Longer requests drop the client
+
+typedef struct __attribute__((__packed__)) p_req {
+    u32 len; // Payload bytes after the header
+    u32 tag; // Handed back in the reply
+    u16 op;
+    u16 flags;
+    u32 fh;
+    u32 off;
+    u32 n;
+} p_req;
+
+typedef struct __attribute__((__packed__)) p_reply {
+    u32 len;
+    u32 tag;
+    int res; // -1 if the request failed
+    u16 flags;
+    u16 pad;
+} p_reply;
+
+typedef struct __attribute__((__packed__)) p_stat {
+    u32 inum;
+    u32 type;
+    u32 size;
+    u16 mdate, mtime, adate; // FAT encoded
+    u16 pad;
+} p_stat;
+
+// Followed by `namelen` bytes of name, no terminator.
+typedef struct __attribute__((__packed__)) p_dirent {
+    u32 inum;
+    u32 type;
+    u32 size;
+    u16 namelen;
+} p_dirent;
+
+typedef struct srv srv;
+
+// Listens on `path`, replacing any socket there, and serves the mounted
+// image with `workers` threads. Returns NULL if it can't listen.
+srv *srv_start(const char *path, u32 workers);
+
+// Stops listening, waits for the requests being run, and drops every
+// connection along with the handles it held.
+void srv_stop(srv *s);
+
+// Client side, for tools and tests.
+
+// Returns a socket connected to the server at `path`, or -1.
+int srv_connect(const char *path);
+
+// Sends a request, its `len` set from `plen`. Returns 0, or -1.
+int srv_send(int fd, p_req *rq, const void *payload, u32 plen);
+
+// Receives the next reply. Up to `cap` bytes of its payload go to `buf`,
+// the rest is dropped; a passed descriptor goes to `*pfd`, else it is set
+// to -1. Returns 0, or -1 if the connection is gone.
+int srv_recv(int fd, p_reply *rp, void *buf, u32 cap, int *pfd);
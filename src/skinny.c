@@ -1,21 +1,35 @@
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include <block.h>
 #include <skinny.h>
+#include <stats.h>
+#include <trace.h>
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+static inline void stat_chain_walk(u32 *len) {
+    stat_add(ST_CHAIN_WALK, 1);
+    stat_add(ST_CHAIN_STEP, *len);
+    stat_record(H_CHAIN_LEN, *len);
+}
 
 #define FOR_EACH_CLUS(__inum, __clus, __fat_ent, ...)                              \
     do {                                                                       \
         u32 __first_clus = get_first_data_cluster(__inum);                       \
         if (__first_clus == 0)                                                   \
             break;                                                             \
+        u32 __walk __attribute__((cleanup(stat_chain_walk))) = 0;              \
                                                                                \
         for (u32 __clus = __first_clus, __fat_ent;;) {                               \
             __fat_ent = get_fat_entry(__clus);                                       \
+            __walk++;                                                          \
             __VA_ARGS__                                                        \
             if (is_fat_entry_eoc(__fat_ent))                                       \
                 break;                                                         \
@@ -28,12 +42,14 @@
     do {                                                                       \
         u8 __buf[BSIZE];                                                         \
         FOR_EACH_CLUS(__inum, __clus, __fat_ent, {                                 \
-            bread(__buf, clus_data_sector(__clus), 1);                           \
-            fat32_dirent *dents = (fat32_dirent *)__buf;                         \
-            for (u32 __i = 0; __i < BSIZE / sizeof(fat32_dirent); __i++) {           \
-                u32 __off = __i * sizeof(fat32_dirent);                          \
-                fat32_dirent *__dirent = &dents[__i];                            \
-                __VA_ARGS__                                                    \
+            for (u32 __s = 0; __s < 1u << spc_shift; __s++) {                   \
+                bread(__buf, clus_data_sector(__clus) + __s, 1);                 \
+                fat32_dirent *dents = (fat32_dirent *)__buf;                     \
+                for (u32 __i = 0; __i < BSIZE / sizeof(fat32_dirent); __i++) {   \
+                    u32 __off = __s * BSIZE + __i * sizeof(fat32_dirent);        \
+                    fat32_dirent *__dirent = &dents[__i];                        \
+                    __VA_ARGS__                                                \
+                }                                                              \
             }                                                                  \
         });                                                                    \
     } while (0)
@@ -41,23 +57,63 @@
 
 static fat32 *ff;
 
+// Set to zero to silence the engine's chatter, e.g. when benchmarking.
+int skinny_debug = 1;
+
+int skinny_times = TIME_RELATIME;
+
+// The engine has no per-inode locks to keep two writers to a directory or
+// a chain apart, so every front end shares this one.
+static pthread_rwlock_t engine_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+void engine_rdlock(void) {
+    pthread_rwlock_rdlock(&engine_lock);
+}
+
+void engine_wrlock(void) {
+    pthread_rwlock_wrlock(&engine_lock);
+}
+
+void engine_unlock(void) {
+    pthread_rwlock_unlock(&engine_lock);
+}
+
+#define debugf(...)                                                            \
+    do {                                                                       \
+        if (skinny_debug)                                                      \
+            printf(__VA_ARGS__);                                               \
+    } while (0)
+
 static u32 fat_dir_size(struct inode *ip);
-static u32 fat_encode_sfn(void *res, const char *name);
+static void zero_clus(u32 clus, u32 from, u32 to);
+static void dindex_drop(u32 first);
+static int chain_resize(inode *ip, u32 len);
+static u32 chain_alloc(u32 last, u32 n, u32 end, int zero, u32 *lastp);
 void iupdate(struct inode *ip);
 
+// Cluster geometry, set at mount by geom_select(). A cluster is a power
+// of two sectors, so going between clusters, sectors and byte offsets is
+// shifts and masks.
+static u32 spc_shift;  // log2 of sectors per cluster
+static u32 clus_shift; // log2 of bytes per cluster
+
+#define CLUS_BYTES (1u << clus_shift)
+#define CLUS_MASK  (CLUS_BYTES - 1)
+
 #define CLUS2SEC(_CLUS_NO, _CLUS_OFF, _SEC_NO, _SEC_OFF)                       \
     do {                                                                       \
         _SEC_NO = ff->rootdir_base_sec +                                       \
-                  (_CLUS_NO - 2) * ff->bpb.sec_per_clus + _CLUS_OFF / BSIZE;   \
+                  ((sector_t)(_CLUS_NO - 2) << spc_shift) +                    \
+                  _CLUS_OFF / BSIZE;                                           \
         _SEC_OFF = _CLUS_OFF % BSIZE;                                          \
     } while (0)
 
-static u32 clus_data_sector(u32 clus_no) {
-    return ff->rootdir_base_sec + (clus_no - 2) * ff->bpb.sec_per_clus;
+static sector_t clus_data_sector(u32 clus_no) {
+    return ff->rootdir_base_sec + ((sector_t)(clus_no - 2) << spc_shift);
 }
 
-static u32 sec_to_clus(u32 sec) {
-    return (sec - ff->rootdir_base_sec) / ff->bpb.sec_per_clus + 2;
+static u32 sec_to_clus(sector_t sec) {
+    return ((sec - ff->rootdir_base_sec) >> spc_shift) + 2;
 }
 
 static fat_entry get_fat_entry(u32 clus_no) {
@@ -67,11 +123,161 @@ static fat_entry get_fat_entry(u32 clus_no) {
 
     u8 buf[BSIZE];
     bread(buf, fat_off_sec, 1);
+    stat_add(ST_FAT_READ, 1);
 
     fat_entry fe = *((fat_entry *)(buf + fat_entry_off));
     return fe;
 }
 
+// Anything that rewrites FAT sectors holds this, so the background
+// reclaimer and the foreground never lose each other's updates.
+static pthread_mutex_t fat_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Free space index.
+//
+// Mounting reads the BPB and FSInfo and nothing else. A background thread
+// then goes through the FAT a chunk at a time and counts the free entries
+// of every FAT sector, and allocations skip the sectors it found full;
+// those it hasn't got to yet are read like before. Each FAT sector the
+// engine writes is recounted, so the counts stay exact. One that is off
+// because the FAT was written behind our back costs a read, or a scan
+// without the index before the disk is called full.
+//
+// If FSInfo had no usable free count, the finished index provides it;
+// fs_free_clusters() and fs_sync() wait for that. All of it is guarded by
+// fat_lock.
+
+#define FAT_EPS    (BSIZE / sizeof(fat_entry))
+#define FIDX_CHUNK 64 // FAT sectors the indexer reads at a time
+
+static u8 *fidx;        // Free entries of each FAT sector below fidx_done
+static u32 fidx_done;
+static u32 fidx_low;    // Indexed sectors below it have none
+static u32 fidx_busy;   // End of the chunk being read
+static int fidx_raced;  // A sector in it was written meanwhile
+static int fidx_stop;
+static int fidx_running;
+static pthread_cond_t fidx_cond = PTHREAD_COND_INITIALIZER; // Indexer done
+static int free_known = 1; // ff->free_clus is right
+
+// Returns how many entries of FAT sector `sec`, counted from the start of
+// the FAT, are free clusters.
+static u32 fidx_count(const fat_entry *ents, u32 sec) {
+    u32 n = 0, clus = sec * FAT_EPS;
+    for (u32 i = 0; i < FAT_EPS; i++, clus++) {
+        n += clus >= 2 && clus < ff->nclus + 2 && ents[i] == FE_FREE;
+    }
+    return n;
+}
+
+// FAT sector `sec` now holds `buf`. Caller holds fat_lock.
+static void fidx_update(const void *buf, u32 sec) {
+    if (sec < fidx_done) {
+        fidx[sec] = fidx_count(buf, sec);
+        if (fidx[sec] != 0 && sec < fidx_low) {
+            fidx_low = sec;
+        }
+    } else if (sec < fidx_busy) {
+        fidx_raced = 1;
+    }
+}
+
+// Returns the first FAT sector that may have a free entry, going by the
+// index. Caller holds fat_lock.
+static u32 fidx_first() {
+    while (fidx_low < fidx_done && fidx[fidx_low] == 0) {
+        fidx_low++;
+    }
+    return fidx_low;
+}
+
+static void *fidx_worker(void *arg) {
+    u32 fat_start = ff->bpb.rsvd_sec_cnt, fat_sz = ff->bpb.fat_sz_32;
+    fat_entry *ents = malloc(FIDX_CHUNK * BSIZE);
+    assert(ents);
+
+    pthread_mutex_lock(&fat_lock);
+    while (!fidx_stop && fidx_done < fat_sz) {
+        u32 sec = fidx_done, n = min(FIDX_CHUNK, fat_sz - sec);
+        fidx_busy = sec + n;
+        fidx_raced = 0;
+        // Allocations go on while we read.
+        pthread_mutex_unlock(&fat_lock);
+        bread(ents, fat_start + sec, n);
+        pthread_mutex_lock(&fat_lock);
+        if (fidx_raced) {
+            bread(ents, fat_start + sec, n);
+        }
+        for (u32 k = 0; k < n; k++) {
+            fidx[sec + k] = fidx_count(ents + k * FAT_EPS, sec + k);
+        }
+        fidx_done = sec + n;
+        stat_add(ST_FAT_INDEX, n);
+    }
+    fidx_busy = 0;
+    free(ents);
+
+    if (fidx_done == fat_sz && !free_known) {
+        u32 nfree = 0;
+        for (u32 sec = 0; sec < fat_sz; sec++) {
+            nfree += fidx[sec];
+        }
+        ff->free_clus = nfree;
+        ff->fsinfo_dirty = 1;
+        free_known = 1;
+    }
+    fidx_running = 0;
+    pthread_cond_broadcast(&fidx_cond);
+    pthread_mutex_unlock(&fat_lock);
+    return NULL;
+}
+
+// Stops the indexer of an earlier mount, if any.
+static void fidx_halt() {
+    pthread_mutex_lock(&fat_lock);
+    fidx_stop = 1;
+    while (fidx_running) {
+        pthread_cond_wait(&fidx_cond, &fat_lock);
+    }
+    pthread_mutex_unlock(&fat_lock);
+}
+
+// Starts building the index for `fs`.
+static void fidx_start(fat32 *fs) {
+    assert(!fidx_running);
+    free(fidx);
+    fidx = calloc(fs->bpb.fat_sz_32, 1);
+    assert(fidx);
+    fidx_done = fidx_low = fidx_busy = 0;
+    fidx_stop = 0;
+    fidx_running = 1;
+    pthread_t t;
+    assert(pthread_create(&t, NULL, fidx_worker, NULL) == 0);
+    pthread_detach(t);
+}
+
+// Caller holds fat_lock.
+static void fidx_wait_locked(int all) {
+    while (!free_known || (all && fidx_running)) {
+        pthread_cond_wait(&fidx_cond, &fat_lock);
+    }
+}
+
+void fs_index_wait() {
+    pthread_mutex_lock(&fat_lock);
+    fidx_wait_locked(1);
+    pthread_mutex_unlock(&fat_lock);
+}
+
+// Writes a FAT sector back to every FAT copy so the mirrors never diverge.
+// `fat_sec` is the sector number inside the first FAT.
+static void write_fat_sec(void *buf, u32 fat_sec) {
+    for (u32 i = 0; i < ff->bpb.num_fats; i++) {
+        bwrite(buf, fat_sec + i * ff->bpb.fat_sz_32, 1);
+    }
+    fidx_update(buf, fat_sec - ff->bpb.rsvd_sec_cnt);
+}
+
 // TODO: Performance stonks!
 static void set_fat_entry(u32 clus_no, fat_entry entry) {
     u32 fat_offset = clus_no * 4;
@@ -79,17 +285,185 @@ static void set_fat_entry(u32 clus_no, fat_entry entry) {
     u32 fat_entry_off = fat_offset % BSIZE;
 
     u8 buf[BSIZE];
+    pthread_mutex_lock(&fat_lock);
     bread(buf, fat_off_sec, 1);
 
     *((fat_entry *)(buf + fat_entry_off)) = entry;
+    stat_add(ST_FAT_WRITE, 1);
 
-    bwrite(buf, fat_off_sec, 1);
+    write_fat_sec(buf, fat_off_sec);
+    pthread_mutex_unlock(&fat_lock);
 }
 
 static int is_fat_entry_eoc(fat_entry fe) {
     return fe >= 0x0ffffff8 && fe <= 0x0fffffff;
 }
 
+// Batches FAT updates so entries sharing a sector cost one read and one
+// write. Flush before anything else touches the FAT (balloc() does).
+typedef struct fat_batch {
+    u32 sec; // FAT sector held in buf, 0 if none
+    int dirty;
+    u8  buf[BSIZE];
+} fat_batch;
+
+// Also lets go of the sector: once fat_lock is dropped, or balloc() got
+// to it, what buf holds may be stale.
+static void fat_batch_flush(fat_batch *b) {
+    if (b->dirty) {
+        write_fat_sec(b->buf, b->sec);
+    }
+    b->dirty = 0;
+    b->sec = 0;
+}
+
+static fat_entry *fat_batch_entry(fat_batch *b, u32 clus_no) {
+    u32 fat_offset = clus_no * 4;
+    u32 fat_off_sec = ff->bpb.rsvd_sec_cnt + (fat_offset / BSIZE);
+
+    if (b->sec != fat_off_sec) {
+        fat_batch_flush(b);
+        bread(b->buf, fat_off_sec, 1);
+        b->sec = fat_off_sec;
+    }
+
+    return (fat_entry *)(b->buf + fat_offset % BSIZE);
+}
+
+static fat_entry fat_batch_get(fat_batch *b, u32 clus_no) {
+    stat_add(ST_FAT_READ, 1);
+    return *fat_batch_entry(b, clus_no);
+}
+
+static void fat_batch_set(fat_batch *b, u32 clus_no, fat_entry entry) {
+    stat_add(ST_FAT_WRITE, 1);
+    *fat_batch_entry(b, clus_no) = entry;
+    b->dirty = 1;
+}
+
+// Frees up to `max` clusters of the chain starting at `*clus_no`, which is
+// left at the first cluster still to free, 0 once the chain is gone.
+// Returns the number of clusters freed. Caller holds fat_lock.
+static u32 fat_free_chain_n(fat_batch *b, u32 *clus_no, u32 max) {
+    u32 n = 0, clus = *clus_no;
+
+    while (n < max && clus >= 2 && clus < ff->nclus + 2) {
+        fat_entry next = fat_batch_get(b, clus);
+        assert(next != FE_FREE);
+        assert(next != FE_BAD);
+        fat_batch_set(b, clus, FE_FREE);
+        n++;
+        clus = is_fat_entry_eoc(next) ? 0 : next;
+    }
+
+    *clus_no = (clus >= 2 && clus < ff->nclus + 2) ? clus : 0;
+    ff->free_clus += n;
+    ff->fsinfo_dirty = 1;
+    return n;
+}
+
+// Frees the chain starting at `clus_no`, returns the number of clusters freed.
+static u32 fat_free_chain(fat_batch *b, u32 clus_no) {
+    return fat_free_chain_n(b, &clus_no, ~0u);
+}
+
+// Deferred reclamation.
+//
+// unlink and rmdir only mark the dir entry deleted and queue its chain.
+// A background thread frees queued chains RECLAIM_BATCH clusters at a
+// time, letting go of fat_lock in between so allocations aren't stalled
+// behind a big delete. Until then the clusters already count as free in
+// fs_free_clusters(), estimated from the file size.
+
+#define RECLAIM_BATCH 4096
+
+typedef struct reclaim_item {
+    u32 clus; // Next cluster to free
+    u32 est;  // Clusters still counted as pending for this chain
+    struct reclaim_item *next;
+} reclaim_item;
+
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t reclaim_done = PTHREAD_COND_INITIALIZER;
+static reclaim_item *reclaim_head, *reclaim_tail;
+static u32 reclaim_pending; // Sum of est over the queue
+static int reclaim_started;
+
+static void *reclaim_worker(void *arg) {
+    fat_batch b = {0};
+
+    pthread_mutex_lock(&reclaim_lock);
+    for (;;) {
+        while (reclaim_head == NULL) {
+            pthread_cond_wait(&reclaim_work, &reclaim_lock);
+        }
+        reclaim_item *it = reclaim_head;
+        pthread_mutex_unlock(&reclaim_lock);
+
+        pthread_mutex_lock(&fat_lock);
+        u32 n = fat_free_chain_n(&b, &it->clus, RECLAIM_BATCH);
+        fat_batch_flush(&b);
+        stat_add(ST_RECLAIM, n);
+
+        // Move the clusters from pending to free before anyone can look.
+        pthread_mutex_lock(&reclaim_lock);
+        u32 d = (it->clus == 0) ? it->est : min(n, it->est);
+        it->est -= d;
+        reclaim_pending -= d;
+        pthread_mutex_unlock(&fat_lock);
+
+        if (it->clus == 0) {
+            reclaim_head = it->next;
+            if (reclaim_head == NULL) {
+                reclaim_tail = NULL;
+                pthread_cond_broadcast(&reclaim_done);
+            }
+            free(it);
+        }
+    }
+    return NULL;
+}
+
+// Hands the chain starting at `clus_no`, about `est` clusters long, to
+// the reclaimer.
+static void reclaim_queue(u32 clus_no, u32 est) {
+    reclaim_item *it = malloc(sizeof(reclaim_item));
+    assert(it);
+    it->clus = clus_no;
+    it->est = est;
+    it->next = NULL;
+
+    pthread_mutex_lock(&reclaim_lock);
+    if (!reclaim_started) {
+        pthread_t t;
+        assert(pthread_create(&t, NULL, reclaim_worker, NULL) == 0);
+        pthread_detach(t);
+        reclaim_started = 1;
+    }
+    if (reclaim_tail) {
+        reclaim_tail->next = it;
+    } else {
+        reclaim_head = it;
+    }
+    reclaim_tail = it;
+    reclaim_pending += est;
+    pthread_cond_signal(&reclaim_work);
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+// Waits for the reclaimer to empty its queue.
+// Returns non-zero if there was anything to wait for.
+static int reclaim_drain() {
+    pthread_mutex_lock(&reclaim_lock);
+    int waited = reclaim_head != NULL;
+    while (reclaim_head != NULL) {
+        pthread_cond_wait(&reclaim_done, &reclaim_lock);
+    }
+    pthread_mutex_unlock(&reclaim_lock);
+    return waited;
+}
+
 // Returns non-zero if this file is a directory.
 static inline int is_dirent_dir(fat32_dirent *dent) {
     return (dent->attr & ATTR_DIRECTORY);
@@ -114,13 +488,84 @@ static void read_bpb(fat32 *fs) {
     assert(bpb->root_clus == 2);
     assert(bpb->fs_info == 1);
     assert(bpb->bk_boot_sec == 6);
-    assert(bpb->sec_per_clus == 1);
+    // A power of two, and small enough that an offset in a cluster fits
+    // the bits inums have for it. mkfs makes nothing larger.
+    assert(bpb->sec_per_clus != 0 &&
+           (bpb->sec_per_clus & (bpb->sec_per_clus - 1)) == 0 &&
+           bpb->sec_per_clus * BSIZE <= (1u << INUM_OFF_BITS));
 
     // @TODO: Make some assertions about the drive/vol numbers.
 }
 
+// Sets the cluster geometry of `fs`.
+static void geom_select(fat32 *fs) {
+    spc_shift = __builtin_ctz(fs->bpb.sec_per_clus);
+    clus_shift = spc_shift + __builtin_ctz(BSIZE);
+}
+
+#define FSI_LEAD_SIG   0x41615252
+#define FSI_STRUC_SIG  0x61417272
+#define FSI_TRAIL_SIG  0xaa550000
+#define FSI_FREE_COUNT 488
+#define FSI_NXT_FREE   492
+
+// Loads the free-space accounting. If FSInfo can't be trusted the count
+// is left to the free space index.
+static void read_fsinfo(fat32 *fs) {
+    u8 buf[BSIZE];
+    bread(buf, fs->bpb.fs_info, 1);
+
+    fs->free_clus = *(u32 *)(buf + FSI_FREE_COUNT);
+    fs->next_free = *(u32 *)(buf + FSI_NXT_FREE);
+    fs->fsinfo_dirty = 0;
+
+    free_known = *(u32 *)buf == FSI_LEAD_SIG &&
+                 *(u32 *)(buf + 484) == FSI_STRUC_SIG &&
+                 fs->free_clus <= fs->nclus;
+    if (fs->next_free < 2 || fs->next_free >= fs->nclus + 2) {
+        fs->next_free = 2;
+    }
+}
+
+void fs_sync() {
+    iflush();
+    // Leave no half-freed chains behind on disk.
+    reclaim_drain();
+
+    pthread_mutex_lock(&fat_lock);
+    // Also keeps the indexer off the image once the caller lets it go.
+    fidx_wait_locked(1);
+    if (!ff->fsinfo_dirty) {
+        pthread_mutex_unlock(&fat_lock);
+        return;
+    }
+
+    u8 buf[BSIZE];
+    bread(buf, ff->bpb.fs_info, 1);
+    *(u32 *)buf = FSI_LEAD_SIG;
+    *(u32 *)(buf + 484) = FSI_STRUC_SIG;
+    *(u32 *)(buf + FSI_FREE_COUNT) = ff->free_clus;
+    *(u32 *)(buf + FSI_NXT_FREE) = ff->next_free;
+    *(u32 *)(buf + 508) = FSI_TRAIL_SIG;
+    bwrite(buf, ff->bpb.fs_info, 1);
+
+    ff->fsinfo_dirty = 0;
+    pthread_mutex_unlock(&fat_lock);
+}
+
+u32 fs_free_clusters() {
+    pthread_mutex_lock(&fat_lock);
+    fidx_wait_locked(0);
+    pthread_mutex_lock(&reclaim_lock);
+    u32 n = ff->free_clus + reclaim_pending;
+    pthread_mutex_unlock(&reclaim_lock);
+    pthread_mutex_unlock(&fat_lock);
+    return n;
+}
+
 void init_fs(fat32 *fs) {
     u8 boot_sector[BSIZE];
+    fidx_halt();
     ff = fs;
     bread(boot_sector, 0, 1);
     memcpy(&fs->bpb, boot_sector, sizeof(fat32_bpb));
@@ -128,21 +573,31 @@ void init_fs(fat32 *fs) {
     assert(boot_sector[511] == 0xaa);
 
     read_bpb(fs);
+    geom_select(fs);
     fat32_bpb *bpb = &fs->bpb;
     fs->rootdir_base_sec = bpb->rsvd_sec_cnt + bpb->fat_sz_32 * bpb->num_fats;
-
-    printf("Sectors per cluster: %d\n", bpb->sec_per_clus);
-    printf("Reserved sectors: %d\n", bpb->rsvd_sec_cnt);
-    printf("FAT size: %d sectors\n", bpb->fat_sz_32);
-    printf("Root cluster: %d\n", bpb->root_clus);
-    printf("FAT 1 offset: 0x%x bytes\n", 512 * bpb->rsvd_sec_cnt);
-    printf("FAT 2 offset: 0x%x bytes\n",
+    fs->nclus = min((bpb->tot_sec_32 - fs->rootdir_base_sec) / bpb->sec_per_clus,
+                    bpb->fat_sz_32 * (BSIZE / 4) - 2);
+    read_fsinfo(fs);
+    fidx_start(fs);
+    dindex_drop(0);
+
+    debugf("Sectors per cluster: %d\n", bpb->sec_per_clus);
+    debugf("Reserved sectors: %d\n", bpb->rsvd_sec_cnt);
+    debugf("FAT size: %d sectors\n", bpb->fat_sz_32);
+    debugf("Root cluster: %d\n", bpb->root_clus);
+    debugf("FAT 1 offset: 0x%x bytes\n", 512 * bpb->rsvd_sec_cnt);
+    debugf("FAT 2 offset: 0x%x bytes\n",
            512 * (bpb->rsvd_sec_cnt + bpb->fat_sz_32));
-    printf("Root directory offset: 0x%x bytes\n", 512 * fs->rootdir_base_sec);
+    debugf("Root directory offset: 0x%x bytes\n", 512 * fs->rootdir_base_sec);
+
+    debugf("sizeof(fat32_dirent) = %lu\n", sizeof(fat32_dirent));
 
-    printf("sizeof(fat32_dirent) = %lu\n", sizeof(fat32_dirent));
+    debugf("FAT32 setup successfully\n");
 
-    printf("FAT32 setup successfully\n");
+    char *trace = getenv("SKINNY_TRACE");
+    if (trace && trace_start(trace) != 0)
+        fprintf(stderr, "cannot record trace to %s\n", trace);
 }
 
 static fat32_dirent read_fat32_dirent(u32 inum) {
@@ -155,7 +610,8 @@ static fat32_dirent read_fat32_dirent(u32 inum) {
     u32 dir_clus = (inum >> 12);
     u32 dir_off_clus = (inum & 0xfff);
 
-    u32 dir_sec, dir_off_sec;
+    sector_t dir_sec;
+    u32 dir_off_sec;
     CLUS2SEC(dir_clus, dir_off_clus, dir_sec, dir_off_sec);
     u8 buf[BSIZE];
     bread(buf, dir_sec, 1);
@@ -165,20 +621,26 @@ static fat32_dirent read_fat32_dirent(u32 inum) {
     return *dent;
 }
 
-static void write_fat32_dirent(u32 inum, fat32_dirent *dirent) {
-    assert(inum != 0);
+// Held around every read-modify-write of a sector of dir entries, since
+// the inode flusher patches entries behind everybody's back. Moving entries
+// (and so changing inums) happens under it too.
+static pthread_mutex_t dirent_lock = PTHREAD_MUTEX_INITIALIZER;
 
-    u32 clus = inum >> 12;
-    u32 off = inum & 0xfff;
+static sector_t slot_sector(u32 inum) {
+    return clus_data_sector(inum >> 12) + (inum & 0xfff) / BSIZE;
+}
 
-    u32 sec = clus_data_sector(clus);
+static void write_fat32_dirent(u32 inum, fat32_dirent *dirent) {
+    assert(inum != 0);
 
+    sector_t sec = slot_sector(inum);
     char buf[BSIZE];
-    bread(buf, sec, 1);
-    fat32_dirent *d = (fat32_dirent *)(buf + off);
 
-    *d = *dirent;
+    pthread_mutex_lock(&dirent_lock);
+    bread(buf, sec, 1);
+    memcpy(buf + (inum & 0xfff) % BSIZE, dirent, sizeof(fat32_dirent));
     bwrite(buf, sec, 1);
+    pthread_mutex_unlock(&dirent_lock);
 }
 
 // Plug in your OS's favorite allocation scheme here.
@@ -190,30 +652,450 @@ static inode *ialloc() {
 
 static void idalloc(inode *in) { free(in); }
 
-// We alloc an inode everytime we get,
-// but in reality we should check if
-// we already have the requested inode in memory.
-// and just return that with ref+1?
-// and when we somehow release the inode,
-// we decrease ref by 1, and when it reaches
-// 0, we can recycle the inode.
-static inode *iget(u32 dev, u32 inum) {
+// Inode cache.
+//
+// Every inode somebody holds is in here exactly once, so all holders see
+// the same size, and an operation that moves dir entries around (compaction,
+// relocating a directory) can fix their inums in one place. Inodes live as
+// long as they are referenced; nothing is kept around after the last iput().
+
+#define ICACHE_BUCKETS 1024
+
+static pthread_mutex_t icache_lock = PTHREAD_MUTEX_INITIALIZER;
+static inode *icache[ICACHE_BUCKETS];
+
+static u32 icache_hash(u32 inum) {
+    return (inum * 2654435761u) >> 22;
+}
+
+// Caller holds icache_lock.
+static void icache_unhash(inode *ip) {
+    for (inode **pp = &icache[icache_hash(ip->inum)]; *pp; pp = &(*pp)->next) {
+        if (*pp == ip) {
+            *pp = ip->next;
+            break;
+        }
+    }
+    ip->next = NULL;
+}
+
+// Caller holds icache_lock.
+static void icache_insert(inode *ip) {
+    u32 h = icache_hash(ip->inum);
+    ip->next = icache[h];
+    icache[h] = ip;
+}
+
+// Gives the holders of `old` the inode `new` after its dir entry moved.
+static void icache_remap(u32 old, u32 new) {
+    pthread_mutex_lock(&icache_lock);
+    for (inode *ip = icache[icache_hash(old)]; ip; ip = ip->next) {
+        if (ip->inum == old) {
+            icache_unhash(ip);
+            ip->inum = new;
+            icache_insert(ip);
+            break;
+        }
+    }
+    pthread_mutex_unlock(&icache_lock);
+}
+
+// Moves the inodes whose dir entries sit in the chain starting at `old`
+// to the same place in the contiguous run starting at `new`.
+static void icache_remap_chain(u32 old, u32 new) {
+    inode *moved = NULL;
+
+    pthread_mutex_lock(&icache_lock);
+    for (u32 k = 0, clus = old; clus != 0; k++) {
+        for (u32 h = 0; h < ICACHE_BUCKETS; h++) {
+            for (inode **pp = &icache[h]; *pp;) {
+                inode *ip = *pp;
+                if (ip->inum != 0 && (ip->inum >> 12) == clus) {
+                    // Park it, so it isn't found again under its new inum.
+                    *pp = ip->next;
+                    ip->inum = ((new + k) << 12) | (ip->inum & 0xfff);
+                    ip->next = moved;
+                    moved = ip;
+                } else {
+                    pp = &ip->next;
+                }
+            }
+        }
+        fat_entry next = get_fat_entry(clus);
+        clus = is_fat_entry_eoc(next) ? 0 : next;
+    }
+    while (moved) {
+        inode *ip = moved;
+        moved = ip->next;
+        icache_insert(ip);
+    }
+    pthread_mutex_unlock(&icache_lock);
+}
+
+// Detaches the inode of a deleted entry, so a file later created in the
+// same slot doesn't get it. Whoever still holds it keeps a stale copy.
+static void icache_forget(u32 inum) {
+    pthread_mutex_lock(&icache_lock);
+    for (inode *ip = icache[icache_hash(inum)]; ip; ip = ip->next) {
+        if (ip->inum == inum) {
+            icache_unhash(ip);
+            ip->dead = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&icache_lock);
+}
+
+// Stores the first data cluster and the size of the held inode for
+// `inum`, which its dir entry may not have caught up with, in `*first`
+// and `*size`. Returns 0 if nobody holds it.
+static int icache_held(u32 inum, u32 *first, u32 *size) {
+    int found = 0;
+    pthread_mutex_lock(&icache_lock);
+    for (inode *ip = icache[icache_hash(inum)]; ip; ip = ip->next) {
+        if (ip->inum == inum) {
+            *first = ip->first;
+            *size = ip->size;
+            found = 1;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&icache_lock);
+    return found;
+}
+
+// The inode being relocated, which iget() waits for. Nobody may hold it
+// while its data moves. Guarded by icache_lock.
+static u32 moving_inum;
+static pthread_cond_t moving_done = PTHREAD_COND_INITIALIZER;
+
+// Keeps `inum` out of the cache until icache_release(). Returns -1 if
+// somebody holds it already.
+static int icache_claim(u32 inum) {
+    assert(inum != 0);
+    pthread_mutex_lock(&icache_lock);
+    while (moving_inum != 0) {
+        pthread_cond_wait(&moving_done, &icache_lock);
+    }
+    for (inode *ip = icache[icache_hash(inum)]; ip; ip = ip->next) {
+        if (ip->inum == inum) {
+            pthread_mutex_unlock(&icache_lock);
+            return -1;
+        }
+    }
+    moving_inum = inum;
+    pthread_mutex_unlock(&icache_lock);
+    return 0;
+}
+
+static void icache_release(void) {
+    pthread_mutex_lock(&icache_lock);
+    moving_inum = 0;
+    pthread_cond_broadcast(&moving_done);
+    pthread_mutex_unlock(&icache_lock);
+}
+
+// Dirty inodes.
+//
+// Changing the size or the first cluster only marks the inode dirty, so a
+// run of small appends doesn't rewrite its dir entry each time. Write-back
+// sorts the dirty inodes by the sector their entry is in and does one read
+// and write per sector. It happens on isync(), iflush() (and so fs_sync()),
+// the last iput(), and from a background flusher every IFLUSH_MS. Inodes
+// with only new times (I_DIRTY_TIME) are left to it for LAZYTIME_MS.
+//
+// Lock order is iflush_lock, dirent_lock, icache_lock; iput() lets go of
+// icache_lock before writing back.
+
+static pthread_mutex_t iflush_lock = PTHREAD_MUTEX_INITIALIZER;
+static inode *dirty_list;
+static int iflush_started;
+
+static int cmp_inum_sector(const void *a, const void *b) {
+    u32 x = slot_sector((*(inode **)a)->inum);
+    u32 y = slot_sector((*(inode **)b)->inum);
+    return (x > y) - (x < y);
+}
+
+// Caller holds iflush_lock.
+static void dirty_unlink(inode *ip) {
+    *ip->dprev = ip->dnext;
+    if (ip->dnext) {
+        ip->dnext->dprev = ip->dprev;
+    }
+    ip->dnext = NULL;
+    ip->dprev = NULL;
+    ip->dirty = 0;
+}
+
+// Writes back the `n` dirty inodes in `ips` and takes them off the dirty
+// list. Deleted ones are just taken off. Caller holds iflush_lock.
+static void iwrite_back(inode **ips, u32 n) {
+    u8 buf[BSIZE];
+
+    // Entries don't move while we hold dirent_lock, so neither do inums.
+    pthread_mutex_lock(&dirent_lock);
+    u32 live = 0;
+    for (u32 i = 0; i < n; i++) {
+        if (ips[i]->dead) {
+            dirty_unlink(ips[i]);
+        } else {
+            ips[live++] = ips[i];
+        }
+    }
+    qsort(ips, live, sizeof(inode *), cmp_inum_sector);
+
+    for (u32 i = 0; i < live;) {
+        sector_t sec = slot_sector(ips[i]->inum);
+        bread(buf, sec, 1);
+        for (; i < live && slot_sector(ips[i]->inum) == sec; i++) {
+            inode *ip = ips[i];
+            fat32_dirent *d = (fat32_dirent *)(buf + (ip->inum & 0xfff) % BSIZE);
+            if (ip->type != T_DIR) {
+                d->file_size = ip->size;
+                d->wrt_date = ip->mdate;
+                d->wrt_time = ip->mtime;
+                d->last_acc_date = ip->adate;
+            }
+            d->fat_clus_lo = ip->first & 0xffff;
+            d->fat_clus_hi = (ip->first >> 16) & 0xffff;
+            dirty_unlink(ip);
+        }
+        bwrite(buf, sec, 1);
+    }
+    pthread_mutex_unlock(&dirent_lock);
+    stat_add(ST_IFLUSH, live);
+}
+
+// Writes back the inodes with any of the `bits` dirty. Caller holds
+// iflush_lock.
+static void iflush_locked(int bits) {
+    u32 n = 0, cap = 0;
+    inode **ips = NULL;
+
+    for (inode *ip = dirty_list; ip; ip = ip->dnext) {
+        if (!(ip->dirty & bits)) {
+            continue;
+        }
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            ips = realloc(ips, cap * sizeof(inode *));
+            assert(ips);
+        }
+        ips[n++] = ip;
+    }
+    if (n > 0) {
+        iwrite_back(ips, n);
+    }
+    free(ips);
+}
+
+static void *iflush_worker(void *arg) {
+    struct timespec ts = {.tv_sec = IFLUSH_MS / 1000,
+                          .tv_nsec = (IFLUSH_MS % 1000) * 1000000l};
+    for (u32 tick = 1;; tick++) {
+        nanosleep(&ts, NULL);
+        int lazy = tick % (LAZYTIME_MS / IFLUSH_MS) == 0;
+        pthread_mutex_lock(&iflush_lock);
+        iflush_locked(lazy ? I_DIRTY | I_DIRTY_TIME : I_DIRTY);
+        pthread_mutex_unlock(&iflush_lock);
+    }
+    return NULL;
+}
+
+static void imark(inode *ip, int bits) {
+    if (ip->inum == 0) {
+        return;
+    }
+
+    pthread_mutex_lock(&iflush_lock);
+    if (!iflush_started) {
+        pthread_t t;
+        assert(pthread_create(&t, NULL, iflush_worker, NULL) == 0);
+        pthread_detach(t);
+        iflush_started = 1;
+    }
+    if (!ip->dirty) {
+        ip->dnext = dirty_list;
+        ip->dprev = &dirty_list;
+        if (dirty_list) {
+            dirty_list->dprev = &ip->dnext;
+        }
+        dirty_list = ip;
+    }
+    ip->dirty |= bits;
+    pthread_mutex_unlock(&iflush_lock);
+}
+
+void iupdate(struct inode *ip) { imark(ip, I_DIRTY); }
+
+void isync(inode *ip) {
+    pthread_mutex_lock(&iflush_lock);
+    if (ip->dirty) {
+        iwrite_back(&ip, 1);
+    }
+    pthread_mutex_unlock(&iflush_lock);
+}
+
+void iflush() {
+    pthread_mutex_lock(&iflush_lock);
+    iflush_locked(I_DIRTY | I_DIRTY_TIME);
+    pthread_mutex_unlock(&iflush_lock);
+}
+
+// File times.
+//
+// FAT keeps the modify time to 2 seconds and the access time to the day,
+// so most reads and writes find the times in the inode already current
+// and don't touch anything.
+
+static void fat_stamp(time_t t, u16 *date, u16 *time) {
+    struct tm tm;
+    localtime_r(&t, &tm);
+    *date = ((tm.tm_year - 80) << 9) | ((tm.tm_mon + 1) << 5) | tm.tm_mday;
+    *time = (tm.tm_hour << 11) | (tm.tm_min << 5) | (tm.tm_sec / 2);
+}
+
+// Stores the local time, FAT encoded. Worked out once a second per thread.
+static void fat_now(u16 *date, u16 *time) {
+    static __thread time_t last = -1;
+    static __thread u16 last_date, last_time;
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    if (ts.tv_sec != last) {
+        fat_stamp(ts.tv_sec, &last_date, &last_time);
+        last = ts.tv_sec;
+    }
+    *date = last_date;
+    *time = last_time;
+}
+
+// Days since the epoch of a FAT date.
+static int fat_day(u16 date) {
+    struct tm tm = {.tm_year = (date >> 9) + 80,
+                    .tm_mon = ((date >> 5) & 0xf) - 1,
+                    .tm_mday = date & 0x1f};
+    return timegm(&tm) / 86400;
+}
+
+// Notes a read of file `ip`, or a write if `modified`, as skinny_times
+// says.
+static void itouch(inode *ip, int modified) {
+    if (ip->inum == 0 || ip->type == T_DIR) {
+        return;
+    }
+
+    u16 date, time;
+    fat_now(&date, &time);
+    if (modified) {
+        if (ip->mdate == date && ip->mtime == time && ip->adate == date) {
+            return;
+        }
+        ip->mdate = date;
+        ip->mtime = time;
+    } else {
+        if (ip->adate == date) {
+            return;
+        }
+        if (skinny_times == TIME_RELATIME && ip->adate > ip->mdate &&
+            fat_day(date) - fat_day(ip->adate) <= 1) {
+            return;
+        }
+    }
+    ip->adate = date;
+
+    switch (skinny_times) {
+    case TIME_STRICT:
+        iupdate(ip);
+        isync(ip);
+        break;
+    case TIME_RELATIME:
+        iupdate(ip);
+        break;
+    default:
+        imark(ip, I_DIRTY_TIME);
+        break;
+    }
+}
+
+void iput(inode *ip) {
+    pthread_mutex_lock(&icache_lock);
+    assert(ip->ref > 0);
+    // Write back the last reference while the inode can still be found,
+    // so an iget() in between doesn't read the stale entry.
+    while (ip->ref == 1 && ip->dirty && !ip->dead) {
+        pthread_mutex_unlock(&icache_lock);
+        isync(ip);
+        pthread_mutex_lock(&icache_lock);
+    }
+    if (--ip->ref > 0) {
+        pthread_mutex_unlock(&icache_lock);
+        return;
+    }
+    if (!ip->dead) {
+        icache_unhash(ip);
+    }
+    pthread_mutex_unlock(&icache_lock);
+
+    if (ip->dirty) {
+        // Deleted, so there is nothing to write back.
+        pthread_mutex_lock(&iflush_lock);
+        if (ip->dirty) {
+            dirty_unlink(ip);
+        }
+        pthread_mutex_unlock(&iflush_lock);
+    }
+    if (ip->parent) {
+        iput(ip->parent);
+    }
+    idalloc(ip);
+}
+
+inode *idup(inode *ip) {
+    pthread_mutex_lock(&icache_lock);
+    ip->ref++;
+    pthread_mutex_unlock(&icache_lock);
+    return ip;
+}
+
+inode *iget(u32 dev, u32 inum) {
+    pthread_mutex_lock(&icache_lock);
+    while (inum != 0 && inum == moving_inum) {
+        pthread_cond_wait(&moving_done, &icache_lock);
+    }
+    for (inode *ip = icache[icache_hash(inum)]; ip; ip = ip->next) {
+        if (ip->inum == inum) {
+            ip->ref++;
+            pthread_mutex_unlock(&icache_lock);
+            return ip;
+        }
+    }
+
     inode *in = ialloc();
     in->inum = inum;
     in->parent = NULL;
+    in->ref = 1;
 
     if (inum != 0) {
         fat32_dirent entry = read_fat32_dirent(inum);
         in->type = (entry.attr & ATTR_DIRECTORY) ? T_DIR : T_FILE;
         in->size = entry.file_size;
+        in->first = (entry.fat_clus_hi << 16) | entry.fat_clus_lo;
+        in->mdate = entry.wrt_date;
+        in->mtime = entry.wrt_time;
+        in->adate = entry.last_acc_date;
     } else {
         in->type = T_DIR;
+        in->first = 2;
     }
 
     if (in->type == T_DIR) {
         in->size = fat_dir_size(in);
     }
 
+    icache_insert(in);
+    pthread_mutex_unlock(&icache_lock);
     return in;
 }
 
@@ -246,63 +1128,209 @@ static u32 get_first_data_cluster(u32 inum) {
     // we can conclude from that where the fat entry is,
     // thus find the data region of the directory.
     //
-    // this is 2 step memory or even disk indirection, thus extremely
-    // inefficient, we can imporve it later
+    // this is 2 step memory or even disk indirection, so a held inode
+    // answers from memory, and has the only up to date answer anyway.
 
     // inode is root dir?
     if (inum == 0) {
         return 2;
     }
 
+    u32 first, size;
+    if (icache_held(inum, &first, &size)) {
+        return first;
+    }
     fat32_dirent dent = read_fat32_dirent(inum);
     u32 fat_clus = ((dent.fat_clus_hi << 16) + dent.fat_clus_lo);
 
     return fat_clus;
 }
 
-// Allocate a new cluster and return its cluster number.
-static u32 balloc() {
-    // TODO: Optimize balloc using FSINFO
-    // Go thourgh the FAT and find the first free cluster.
-
-    // sizes are in the unit of sectors
-    u32 fat_start = ff->bpb.rsvd_sec_cnt;
-    u32 fat_sz = ff->bpb.fat_sz_32;
-
-    for (u32 fat_sec = fat_start, clus_no = 0; fat_sec < fat_start + fat_sz;
-         fat_sec++) {
+// Points the dir entry of `inum`, which nobody holds, at a new first data
+// cluster in one sector write. Caller holds dirent_lock.
+static void set_first_data_cluster(u32 inum, u32 clus) {
+    assert(inum != 0);
 
-        u8 buf[BSIZE];
-        bread(buf, fat_sec, 1);
+    sector_t sec = slot_sector(inum);
+    char buf[BSIZE];
 
-        for (u32 i = 0; i < BSIZE; i += 4, clus_no++) {
-            if (clus_no < 2) {
+    bread(buf, sec, 1);
+    fat32_dirent *dent = (fat32_dirent *)(buf + (inum & 0xfff) % BSIZE);
+    dent->fat_clus_lo = clus & 0xffff;
+    dent->fat_clus_hi = (clus >> 16) & 0xffff;
+    bwrite(buf, sec, 1);
+}
+
+// Where the clusters of an inode of `type` have to come from below. Past
+// INUM_CLUS_END the inums of a directory's entries would wrap.
+static u32 alloc_end(u32 type) {
+    return type == T_DIR ? INUM_CLUS_END : 0xffffffff;
+}
+
+// Allocate a new cluster below `end` and return its cluster number.
+// Caller holds fat_lock.
+static u32 balloc_locked(u32 end) {
+    // Go through the FAT and find the first free cluster, skipping the
+    // sectors the index knows are full.
+
+    // sizes are in the unit of sectors
+    u32 fat_start = ff->bpb.rsvd_sec_cnt;
+    u32 fat_sz = ff->bpb.fat_sz_32;
+    u32 clus_end = min(ff->nclus + 2, end);
+    u32 scanned = 0;
+
+    // A count can only be wrong if someone wrote the FAT behind our back,
+    // so the index is ignored on the second pass rather than trusted to
+    // call the disk full.
+    for (int pass = 0; pass < 2; pass++) {
+        u32 sec = pass == 0 ? fidx_first() : 0;
+        u32 clus_no = sec * FAT_EPS;
+
+        for (; sec < fat_sz && clus_no < clus_end; sec++) {
+            if (pass == 0 && sec < fidx_done && fidx[sec] == 0) {
+                clus_no += FAT_EPS;
+                stat_add(ST_BALLOC_SKIP, 1);
                 continue;
             }
 
-            fat_entry fe = *((fat_entry *)(buf + i));
-            if (fe == FE_FREE) {
-                // found a free cluster
-                // set it to EOC
-                *((fat_entry *)(buf + i)) = 0x0fffffff;
-                bwrite(buf, fat_sec, 1);
-                return clus_no;
+            u8 buf[BSIZE];
+            bread(buf, fat_start + sec, 1);
+
+            for (u32 i = 0; i < BSIZE && clus_no < clus_end;
+                 i += 4, clus_no++, scanned++) {
+                if (clus_no < 2) {
+                    continue;
+                }
+
+                fat_entry fe = *((fat_entry *)(buf + i));
+                if (fe == FE_FREE) {
+                    // found a free cluster
+                    // set it to EOC
+                    *((fat_entry *)(buf + i)) = 0x0fffffff;
+                    write_fat_sec(buf, fat_start + sec);
+                    ff->free_clus--;
+                    ff->next_free = clus_no + 1;
+                    ff->fsinfo_dirty = 1;
+                    stat_add(ST_BALLOC, 1);
+                    stat_add(ST_FAT_WRITE, 1);
+                    stat_add(ST_BALLOC_SCAN, scanned);
+                    stat_record(H_BALLOC_SCAN, scanned);
+                    return clus_no;
+                }
+            }
+            if (sec < fidx_done) {
+                fidx[sec] = 0;
             }
         }
     }
 
+    stat_add(ST_BALLOC_SCAN, scanned);
+    stat_record(H_BALLOC_SCAN, scanned);
     return 0; // No free clusters found
 }
 
+// Allocates up to `want` contiguous clusters below `end`, linked into a
+// chain that ends in EOC. Takes the first free run that is long enough,
+// or else the longest one there is. Returns its first cluster and its
+// length in `*got`, 0 if there are no free clusters. Caller holds
+// fat_lock.
+static u32 balloc_run_locked(u32 want, u32 *got, u32 end) {
+    u32 fat_start = ff->bpb.rsvd_sec_cnt;
+    u32 clus_end = min(ff->nclus + 2, end), scanned = 0;
+    u32 best = 0, best_len = 0, run = 0, run_len = 0;
+    u8 buf[BSIZE];
+
+    // Only full sectors are skipped: a count of free entries doesn't say
+    // whether they are in a row. As in balloc_locked(), the index isn't
+    // trusted to call the disk full.
+    for (int pass = 0; pass < 2 && best_len == 0; pass++) {
+        u32 clus_no = 0;
+        run_len = 0;
+        for (u32 sec = 0; clus_no < clus_end && best_len < want; sec++) {
+            if (pass == 0 && sec < fidx_done && fidx[sec] == 0) {
+                clus_no += FAT_EPS;
+                run_len = 0;
+                stat_add(ST_BALLOC_SKIP, 1);
+                continue;
+            }
+            bread(buf, fat_start + sec, 1);
+
+            for (u32 i = 0; i < BSIZE && clus_no < clus_end;
+                 i += 4, clus_no++, scanned++) {
+                if (clus_no < 2) {
+                    continue;
+                }
+                if (*((fat_entry *)(buf + i)) != FE_FREE) {
+                    run_len = 0;
+                    continue;
+                }
+                if (run_len++ == 0) {
+                    run = clus_no;
+                }
+                if (run_len > best_len) {
+                    best = run;
+                    best_len = run_len;
+                    if (best_len == want) {
+                        break;
+                    }
+                }
+            }
+        }
+    }
+
+    stat_add(ST_BALLOC_SCAN, scanned);
+    stat_record(H_BALLOC_SCAN, scanned);
+    *got = best_len;
+    if (best_len == 0) {
+        return 0;
+    }
+
+    fat_batch b = {0};
+    for (u32 c = best; c < best + best_len; c++) {
+        fat_batch_set(&b, c, (c + 1 < best + best_len) ? c + 1 : 0x0fffffff);
+    }
+    fat_batch_flush(&b);
+
+    ff->free_clus -= best_len;
+    ff->next_free = best + best_len;
+    ff->fsinfo_dirty = 1;
+    stat_add(ST_BALLOC, best_len);
+    return best;
+}
+
+static u32 balloc_run(u32 want, u32 *got, u32 end) {
+    for (;;) {
+        pthread_mutex_lock(&fat_lock);
+        u32 clus_no = balloc_run_locked(want, got, end);
+        pthread_mutex_unlock(&fat_lock);
+        if (clus_no != 0 || !reclaim_drain()) {
+            return clus_no;
+        }
+    }
+}
+
+// Allocate a new cluster below `end` and return its cluster number, 0 if
+// there is none even after the reclaimer caught up.
+static u32 balloc(u32 end) {
+    for (;;) {
+        pthread_mutex_lock(&fat_lock);
+        u32 clus_no = balloc_locked(end);
+        pthread_mutex_unlock(&fat_lock);
+        if (clus_no != 0 || !reclaim_drain()) {
+            return clus_no;
+        }
+    }
+}
+
 // Returns the sector number of the nth block
 // in inode ip.
 //
 // If there's no such block, bmap allocates one.
-static u32 bmap(inode *ip, u32 bn, int alloc) {
+static sector_t bmap(inode *ip, u32 bn, int alloc) {
 
     assert(ip);
 
-    u32 clus = get_first_data_cluster(ip->inum);
+    u32 clus = ip->first;
 
     if (clus == 0) {
         // I don't know upon regular file creation,
@@ -314,26 +1342,30 @@ static u32 bmap(inode *ip, u32 bn, int alloc) {
         // whose fat entry is expected to be 0xffffffff
         // which is EOC
         if (alloc) {
-            clus = balloc();
-            printf("new clus: %d\n", clus);
-            printf("clus sec: %d\n", clus_data_sector(clus));
-            fat32_dirent dent = read_fat32_dirent(ip->inum);
-            dent.fat_clus_lo = clus & 0xffff;
-            dent.fat_clus_hi = (clus >> 16) & 0xffff;
-            write_fat32_dirent(ip->inum, &dent);
+            clus = balloc(alloc_end(ip->type));
+            if (clus == 0) {
+                return 0;
+            }
+            if (ip->type == T_DIR) {
+                zero_clus(clus, 0, CLUS_BYTES);
+            }
+            debugf("new clus: %d\n", clus);
+            debugf("clus sec: %llu\n", clus_data_sector(clus));
+            ip->first = clus;
+            iupdate(ip);
         } else {
             return 0;
         }
     }
 
-    int curr = 0;
+    u32 curr = 0, cn = bn >> spc_shift;
     u32 res_clus = 0;
     FOR_EACH_CLUS(ip->inum, clus, fat_ent, {
         assert(fat_ent != FE_FREE);
         assert(fat_ent != FE_BAD);
 
         res_clus = clus;
-        if (curr == bn) {
+        if (curr == cn) {
             break;
         }
 
@@ -342,7 +1374,13 @@ static u32 bmap(inode *ip, u32 bn, int alloc) {
             // set the fat entry to be this clus
             // and assign it to clus.
             if (alloc) {
-                u32 new_clus = balloc();
+                u32 new_clus = balloc(alloc_end(ip->type));
+                if (new_clus == 0) {
+                    return 0;
+                }
+                if (ip->type == T_DIR) {
+                    zero_clus(new_clus, 0, CLUS_BYTES);
+                }
                 set_fat_entry(clus, new_clus);
                 
                 // NOTE: Make the macro continue the loop
@@ -354,7 +1392,7 @@ static u32 bmap(inode *ip, u32 bn, int alloc) {
         curr += 1;
     });
 
-    u32 sec = clus_data_sector(res_clus);
+    sector_t sec = clus_data_sector(res_clus) + (bn & ((1u << spc_shift) - 1));
 
     // Cache the nth block -> sector mapping
     // ip->bn = bn;
@@ -363,9 +1401,7 @@ static u32 bmap(inode *ip, u32 bn, int alloc) {
     return sec;
 }
 
-static u32 bmap_noalloc(inode *ip, u32 bn) { return bmap(ip, bn, 0); }
-
-static u32 bmap_alloc(inode *ip, u32 bn) { return bmap(ip, bn, 1); }
+static sector_t bmap_alloc(inode *ip, u32 bn) { return bmap(ip, bn, 1); }
 
 static u32 fat_dir_size(struct inode *ip) {
     assert(ip);
@@ -373,16 +1409,19 @@ static u32 fat_dir_size(struct inode *ip) {
 
     u32 size = 0;
 
-    FOR_EACH_CLUS(ip->inum, __clus, fat_ent, {
+    // Not FOR_EACH_CLUS, iget() calls this holding icache_lock.
+    for (u32 clus = ip->first; clus != 0;) {
+        fat_entry fat_ent = get_fat_entry(clus);
         assert(fat_ent != FE_FREE);
         assert(fat_ent != FE_BAD);
-        size += BSIZE;
-    });
+        size += CLUS_BYTES;
+        clus = is_fat_entry_eoc(fat_ent) ? 0 : fat_ent;
+    }
 
     return size;
 }
 
-static void fat_decode_sfn(char *name, fat32_dirent *dent) {
+void fat_decode_sfn(char *name, fat32_dirent *dent) {
     int si = 0, di = 0;
     while (si < 11) {
         char c = dent->name[si++];
@@ -419,7 +1458,7 @@ static int dbc_1st(u8 c) { return 0; /* Always false */ }
 /* Test if the byte is DBC 2nd byte */
 static int dbc_2nd(u8 c) { return 0; /* Always false */ }
 
-static u32 fat_encode_sfn(void *res, const char *name) {
+u32 fat_encode_sfn(void *res, const char *name) {
     u8 c, d, *sfn;
     u32 ni, si, i;
     const char *p;
@@ -477,14 +1516,276 @@ static u32 fat_encode_sfn(void *res, const char *name) {
     return 0;
 }
 
+u8 fat_sfn_checksum(const char *sfn) {
+    u8 sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = ((sum & 1) << 7) + (sum >> 1) + (u8)sfn[i];
+    }
+    return sum;
+}
+
+// Converts UTF-8 `s` to UCS-2 in `out`, which holds LFN_MAX characters.
+// Returns the length, or -1 if `s` is malformed, too long or needs
+// characters past the BMP.
+static int utf8_to_ucs2(const char *s, u16 *out) {
+    u32 n = 0;
+
+    while (*s) {
+        u8 c = *s++;
+        u32 cp, more;
+        if (c < 0x80) {
+            cp = c, more = 0;
+        } else if ((c & 0xe0) == 0xc0) {
+            cp = c & 0x1f, more = 1;
+        } else if ((c & 0xf0) == 0xe0) {
+            cp = c & 0x0f, more = 2;
+        } else {
+            return -1;
+        }
+        while (more--) {
+            if ((*s & 0xc0) != 0x80) {
+                return -1;
+            }
+            cp = (cp << 6) | (*s++ & 0x3f);
+        }
+        if (n == LFN_MAX) {
+            return -1;
+        }
+        out[n++] = cp;
+    }
+    return n;
+}
+
+// Converts `n` UCS-2 characters to a terminated UTF-8 string in `out` of
+// `size` bytes. Returns -1 if it doesn't fit.
+static int ucs2_to_utf8(const u16 *s, u32 n, char *out, u32 size) {
+    u32 o = 0;
+
+    for (u32 i = 0; i < n; i++) {
+        u16 c = s[i];
+        u32 len = c < 0x80 ? 1 : c < 0x800 ? 2 : 3;
+        if (o + len >= size) {
+            return -1;
+        }
+        if (len == 1) {
+            out[o++] = c;
+        } else if (len == 2) {
+            out[o++] = 0xc0 | (c >> 6);
+            out[o++] = 0x80 | (c & 0x3f);
+        } else {
+            out[o++] = 0xe0 | (c >> 12);
+            out[o++] = 0x80 | ((c >> 6) & 0x3f);
+            out[o++] = 0x80 | (c & 0x3f);
+        }
+    }
+    out[o] = 0;
+    return o;
+}
+
+static u16 lfn_fold(u16 c) { return IsLower(c) ? c - 0x20 : c; }
+
+// FNV-1a over the case folded name.
+static u32 lfn_hash(const u16 *s, u32 n) {
+    u32 h = 2166136261u;
+    for (u32 i = 0; i < n; i++) {
+        h = (h ^ lfn_fold(s[i])) * 16777619u;
+    }
+    return h;
+}
+
+#define LFN_ORD(l) ((l)->ord & 0x1f)
+
+static u16 lfn_get(fat32_lfn *l, u32 k) {
+    return k < 5 ? l->name1[k] : k < 11 ? l->name2[k - 5] : l->name3[k - 11];
+}
+
+static void lfn_set(fat32_lfn *l, u32 k, u16 c) {
+    if (k < 5) {
+        l->name1[k] = c;
+    } else if (k < 11) {
+        l->name2[k - 5] = c;
+    } else {
+        l->name3[k - 11] = c;
+    }
+}
+
+// Length of the name a run starting with `l` holds, read off its first
+// entry alone.
+static u32 lfn_len(fat32_lfn *l) {
+    u32 k = 0;
+    while (k < LFN_CHARS && lfn_get(l, k) != 0) {
+        k++;
+    }
+    return (LFN_ORD(l) - 1) * LFN_CHARS + k;
+}
+
+// Compares the part of the name in `l` with the same part of `s`.
+static int lfn_match(fat32_lfn *l, const u16 *s, u32 n) {
+    u32 base = (LFN_ORD(l) - 1) * LFN_CHARS;
+    for (u32 k = 0; k < LFN_CHARS && base + k < n; k++) {
+        if (lfn_fold(lfn_get(l, k)) != lfn_fold(s[base + k])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Fills `sfn` with the 8.3 form of `name`, in any case, if it has one.
+static int sfn_key(const char *name, char *sfn) {
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        memcpy(sfn, "..         ", 11);
+        sfn[1] = name[1] ? '.' : ' ';
+        return 1;
+    }
+    if (name[0] == '.') {
+        return 0;
+    }
+    for (const char *c = name; *c; c++) {
+        if ((u8)*c <= ' ' || (u8)*c >= 0x80 || IsSeparator(*c)) {
+            return 0;
+        }
+    }
+    return fat_encode_sfn(sfn, name) == 0;
+}
+
+int fat_lfn_count(const char *name) {
+    u16 u[LFN_MAX];
+    char sfn[11];
+    int n = utf8_to_ucs2(name, u);
+
+    if (n <= 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (u[i] < ' ' || (u[i] < 0x80 && strchr("\"*/:<>?\\|\x7f", u[i]))) {
+            return -1;
+        }
+    }
+    int lower = 0;
+    for (const char *c = name; *c; c++) {
+        lower |= IsLower(*c);
+    }
+    if (!lower && sfn_key(name, sfn)) {
+        return 0;
+    }
+    return (n + LFN_CHARS - 1) / LFN_CHARS;
+}
+
+// Upper cased short name character for `c`, 0 if it is dropped.
+static char sfn_char(u16 c) {
+    if (c == ' ' || c == '.') {
+        return 0;
+    }
+    if (c >= 0x80 || strchr("+,;=[]", c)) {
+        return '_';
+    }
+    return IsLower(c) ? c - 0x20 : c;
+}
+
+int fat_sfn_alias(const char *name, u32 k, char *sfn) {
+    u16 u[LFN_MAX];
+    int n = utf8_to_ucs2(name, u);
+    if (n <= 0) {
+        return -1;
+    }
+    if (k == 0) {
+        return sfn_key(name, sfn) ? 0 : -1;
+    }
+    if (k > 999999) {
+        return -1;
+    }
+
+    // The last dot starts the extension, unless it leads the name.
+    int dot = n - 1;
+    while (dot > 0 && u[dot] != '.') {
+        dot--;
+    }
+    char body[8], ext[3];
+    u32 nb = 0, ne = 0;
+    for (int i = 0; i < (dot > 0 ? dot : n) && nb < 8; i++) {
+        if ((body[nb] = sfn_char(u[i])) != 0) {
+            nb++;
+        }
+    }
+    for (int i = dot + 1; dot > 0 && i < n && ne < 3; i++) {
+        if ((ext[ne] = sfn_char(u[i])) != 0) {
+            ne++;
+        }
+    }
+    if (nb == 0) {
+        body[nb++] = '_';
+    }
+
+    // Past ~4, two characters and four hex digits of a hash of the name
+    // stand in for the body, so lots of names alike don't all probe
+    // through the same ~1, ~2, ...
+    char tail[8];
+    if (k > 4) {
+        nb = min(nb, 2);
+        snprintf(body + nb, sizeof(body) - nb, "%04X",
+                 lfn_hash(u, n) & 0xffff);
+        nb += 4;
+        k -= 4;
+    }
+    u32 nt = snprintf(tail, sizeof(tail), "~%u", k);
+    nb = min(nb, 8 - nt);
+
+    memset(sfn, ' ', 11);
+    memcpy(sfn, body, nb);
+    memcpy(sfn + nb, tail, nt);
+    memcpy(sfn + 8, ext, ne);
+    return 0;
+}
+
+void fat_lfn_fill(fat32_dirent *ents, const char *name, const char *sfn) {
+    u16 u[LFN_MAX];
+    int n = utf8_to_ucs2(name, u), count = fat_lfn_count(name);
+    u8 sum = fat_sfn_checksum(sfn);
+
+    for (int i = 0; i < count; i++) {
+        fat32_lfn *l = (fat32_lfn *)&ents[i];
+        u32 ord = count - i;
+        memset(l, 0, sizeof(fat32_lfn));
+        l->ord = ord | (i == 0 ? LFN_LAST : 0);
+        l->attr = ATTR_LONG_NAME;
+        l->chksum = sum;
+        for (u32 k = 0; k < LFN_CHARS; k++) {
+            u32 at = (ord - 1) * LFN_CHARS + k;
+            lfn_set(l, k, at < n ? u[at] : at == n ? 0x0000 : 0xffff);
+        }
+    }
+}
+
+// Returns the sector of byte `off` of `ip`, `sec` being the one of byte
+// `off` - 1, or 0 to look it up from the start of the chain. So a read or
+// write seeks once and then goes a sector at a time, following the chain
+// only where it crosses into the next cluster.
+static sector_t bmap_next(inode *ip, sector_t sec, u32 off, int alloc) {
+    if (sec == 0) {
+        return bmap(ip, off / BSIZE, alloc);
+    }
+    if ((off & CLUS_MASK) != 0) {
+        return sec + 1;
+    }
+    fat_entry next = get_fat_entry(sec_to_clus(sec));
+    if (is_fat_entry_eoc(next)) {
+        // Past the end, bmap() allocates or gives up.
+        return bmap(ip, off / BSIZE, alloc);
+    }
+    return clus_data_sector(next);
+}
+
 // Read data from inode.
 // Caller must hold ip->lock.
 // If user_dst==1, then dst is a user virtual address;
 // otherwise, dst is a kernel address.
 int readi(struct inode *ip, int user_dst, void *dst, u32 off, u32 n,
           u32 *inum) {
+    STAT_TIME(H_READI);
+    TRACE_OP(TR_READI, 0, ip->inum, off, n, NULL);
     u32 tot, m;
     char buf[BSIZE];
+    sector_t sec = 0;
 
     
     if(off > ip->size || off + n < off)
@@ -492,20 +1793,19 @@ int readi(struct inode *ip, int user_dst, void *dst, u32 off, u32 n,
     if(off + n > ip->size)
       n = ip->size - off;
   
-    u32 inum_written = 0;
-
     for (tot = 0; tot < n; tot += m, off += m, dst += m) {
-        u32 sec = bmap_noalloc(ip, off / BSIZE);
-        u32 clus = sec_to_clus(sec);
+        sec = bmap_next(ip, sec, off, 0);
         bread(buf, sec, 1);
-        if (inum_written == 0 && inum) {
-            inum_written = 1;
-            *inum = (clus << 12) | (off % BSIZE);
+        if (tot == 0 && inum) {
+            *inum = (sec_to_clus(sec) << 12) | (off & CLUS_MASK);
         }
         m = min(n - tot, BSIZE - off % BSIZE);
         memcpy(dst, buf + (off % BSIZE), m);
     }
 
+    if (tot > 0) {
+        itouch(ip, 0);
+    }
     return tot;
 }
 
@@ -517,23 +1817,47 @@ int readi(struct inode *ip, int user_dst, void *dst, u32 off, u32 n,
 // If the return value is less than the requested n,
 // there was an error of some kind.
 int writei(struct inode *ip, int user_src, void *src, u32 off, u32 n) {
+    STAT_TIME(H_WRITEI);
+    TRACE_OP(TR_WRITEI, 0, ip->inum, off, n, NULL);
     u32 tot, m;
     char buf[BSIZE];
+    sector_t sec = 0;
 
     // FIXME: Check the bound
-    if (off > ip->size || off + n < off)
+    if (off + n < off)
         return -1;
+    if (off > ip->size && ip->type != T_FILE)
+        return -1;
+
+    if (ip->type == T_FILE && off + n > ip->size) {
+        // Take everything this write needs in one go, and zero the gap
+        // between the old end and `off`.
+        if (ifallocate(ip, off + n, FALLOC_KEEP_SIZE) != 0)
+            return -1;
+        if (off > ip->size && itruncate(ip, off) != 0)
+            return -1;
+    }
     /*
     if(off + n > MAXFILE*BSIZE)
       return -1;
     */
 
     for (tot = 0; tot < n; tot += m, off += m, src += m) {
-        u32 sec = bmap_alloc(ip, off / BSIZE);
-        bread(buf, sec, 1);
+        sec = bmap_next(ip, sec, off, 1);
+        if (sec == 0) {
+            // Disk full.
+            break;
+        }
         m = min(n - tot, BSIZE - off % BSIZE);
+        if (ip->type == T_DIR) {
+            pthread_mutex_lock(&dirent_lock);
+        }
+        bread(buf, sec, 1);
         memcpy(buf + (off % BSIZE), src, m);
         bwrite(buf, sec, 1);
+        if (ip->type == T_DIR) {
+            pthread_mutex_unlock(&dirent_lock);
+        }
     }
 
     // Round ip->size up to the nearest BSIZE
@@ -544,164 +1868,950 @@ int writei(struct inode *ip, int user_src, void *src, u32 off, u32 n) {
             ip->size = (size + BSIZE - 1) & ~(BSIZE - 1);
         } else {
             ip->size = off;
+            // Only marks it, see iupdate(). A new first cluster from
+            // bmap() already did.
+            iupdate(ip);
         }
     }
 
-    // FIXME: Write back inode.
-    // write the i-node back to disk even if the size didn't change
-    // because the loop above might have called bmap() and added a new
-    // block to ip->addrs[].
-    iupdate(ip);
-
+    if (tot > 0) {
+        itouch(ip, 1);
+    }
     return tot;
 }
 
-inode *fat_dirlookup(inode *dir, char *name) {
-    assert(dir->type == T_DIR);
+// Spans.
+//
+// A pinned file keeps its clusters: the views point straight into them.
 
-    FOR_EACH_DIRENT(dir->inum, clus, __fat_ent, off, dent, {
-        u32 inum = (clus << 12) | off;
-        u8 first_byte = dent->name[0];
+void span_begin(span_iter *it, inode *ip, u32 off, u32 n) {
+    assert(ip->type == T_FILE);
 
-        if (first_byte == 0xe5) {
-            // Directory entry is free, skip this one
-            continue;
-        } else if (first_byte == 0x00) {
-            // End of directory
-            return NULL;
-        }
+    it->ip = idup(ip);
+    pthread_mutex_lock(&icache_lock);
+    ip->pins++;
+    // Deleted before we got here, its clusters may be gone already.
+    int gone = ip->dead && !ip->orphan;
+    u32 clus = ip->first;
+    pthread_mutex_unlock(&icache_lock);
+
+    it->off = off;
+    it->end = (off < ip->size && !gone) ? off + min(n, ip->size - off) : off;
+    for (u32 k = 0; k < off >> clus_shift && clus != 0; k++) {
+        fat_entry next = get_fat_entry(clus);
+        clus = is_fat_entry_eoc(next) ? 0 : next;
+    }
+    it->clus = it->off < it->end ? clus : 0;
+    if (it->off < it->end) {
+        // Reading in place is still a read.
+        itouch(ip, 0);
+    }
+}
 
-        char filename[12];
-        fat_decode_sfn(filename, dent);
+int span_next(span_iter *it, span *sp) {
+    u32 cbytes = CLUS_BYTES;
+    if (it->off >= it->end || it->clus == 0) {
+        return 0;
+    }
 
-        // printf("%s\n", filename);
-        if (strcmp(filename, name) == 0) {
-            // printf("Found!\n");
-            return iget(0, inum);
-        }
-    });
+    // Take clusters while they follow each other and the range goes on.
+    u32 start = it->clus, clus = start, nclus = 1;
+    u32 base = it->off & ~(cbytes - 1);
+    fat_entry next = get_fat_entry(clus);
+    while (base + nclus * cbytes < it->end && !is_fat_entry_eoc(next) &&
+           next == clus + 1) {
+        clus = next;
+        nclus++;
+        next = get_fat_entry(clus);
+    }
 
-    return NULL;
+    u32 stop = min(it->end, base + nclus * cbytes);
+    const u8 *data = bview(clus_data_sector(start), nclus << spc_shift);
+    sp->data = data + (it->off - base);
+    sp->off = it->off;
+    sp->len = stop - it->off;
+    it->off = stop;
+    it->clus = (stop < it->end && !is_fat_entry_eoc(next)) ? next : 0;
+    return 1;
 }
 
-static u32 dirent_alloc(inode *ip) {
-    assert(ip->type == T_DIR);
+void span_end(span_iter *it) {
+    inode *ip = it->ip;
 
-    u32 inum = 0;
-    int i = 0;
+    pthread_mutex_lock(&icache_lock);
+    assert(ip->pins > 0);
+    int reclaim = --ip->pins == 0 && ip->orphan;
+    if (reclaim) {
+        ip->orphan = 0;
+    }
+    pthread_mutex_unlock(&icache_lock);
 
-    FOR_EACH_DIRENT(ip->inum, clus, __fat_ent, off, dent, {
-        printf("i = %d\n", i);
-        inum = (clus << 12) | off;
-        u8 first_byte = dent->name[0];
+    if (reclaim && ip->first != 0) {
+        reclaim_queue(ip->first, ((u64)ip->size + CLUS_MASK) >> clus_shift);
+    }
+    iput(ip);
+    it->ip = NULL;
+}
 
-        if (first_byte == 0xe5 || first_byte == 0x00) {
-            printf("Allocated %d\n", inum);
-            
-            // Performance: Don't use bmap here.
-            // Since we already know the current cluster,
-            // we don't need bmap to traverse the FAT again.
-            if (dent->name[0] == 0x00 && (i + 1) % 8 == 0) {
-                bmap_alloc(ip, ip->size / BSIZE + 1);
-                fat32_dirent last_entry = {0};
-                writei(ip, 0, &last_entry, ip->size, sizeof(fat32_dirent));
-            }
+long iexport(inode *ip, u32 off, u32 n, int fd) {
+    span_iter it;
+    span sp;
+    long tot = 0;
 
-            return inum;
+    span_begin(&it, ip, off, n);
+    while (span_next(&it, &sp)) {
+        if (bexport(fd, sp.data, sp.len) != 0) {
+            tot = -1;
+            break;
         }
-
-        i += 1;
-    });
-
-    assert(0 && "Panic");
-
-    return 0;
+        tot += sp.len;
+    }
+    span_end(&it);
+    return tot;
 }
 
-// Paths
-
-// Copy the next path element from path into name.
-// Return a pointer to the element following the copied one.
-// The returned path has no leading slashes,
-// so the caller can check *path=='\0' to see if the name is the last one.
-// If no name to remove, return 0.
-//
-// Examples:
-//   skipelem("a/bb/c", name) = "bb/c", setting name = "a"
-//   skipelem("///a//bb", name) = "bb", setting name = "a"
-//   skipelem("a", name) = "", setting name = "a"
-//   skipelem("", name) = skipelem("////", name) = 0
+// Dir entry slots.
 //
-static char *skipelem(char *path, char *name) {
-    char *s;
-    int len;
-
-    while (*path == '/')
-        path++;
-    if (*path == 0)
-        return 0;
-    s = path;
-    while (*path != '/' && *path != 0)
-        path++;
-    len = path - s;
-    if (len >= DIRSIZ)
-        memcpy(name, s, DIRSIZ);
-    else {
-        memcpy(name, s, len);
-        name[len] = 0;
+// An entry with a long name takes several slots, which may run on into
+// the next cluster of the directory. Its inum is that of the short entry
+// at the end, `start` is the inum of the first slot of the run.
+
+// Returns the slot after `inum`, or 0 at the end of the directory.
+static u32 dir_next_slot(u32 inum) {
+    u32 off = (inum & 0xfff) + sizeof(fat32_dirent);
+    if (off < CLUS_BYTES) {
+        return (inum & ~0xfff) | off;
     }
-    while (*path == '/')
-        path++;
-    return path;
+    fat_entry next = get_fat_entry(inum >> 12);
+    return is_fat_entry_eoc(next) ? 0 : next << 12;
 }
 
-// Look up and return the inode for a path name.
-// If parent != 0, return the inode for the parent and copy the final
-// path element into name, which must have room for DIRSIZ bytes.
-// Must be called inside a transaction since it calls iput().
-static struct inode *namex(char *path, int nameiparent, char *name) {
-    struct inode *ip, *next;
+// Reads the slots from `start` through `slot` into `ents`, which holds
+// LFN_RUN_MAX + 1 of them, and their inums into `inums`. Returns how many
+// were read, or 0 if `slot` doesn't follow `start` closely enough.
+static u32 read_run(u32 start, u32 slot, fat32_dirent *ents, u32 *inums) {
+    u8 buf[BSIZE];
+    sector_t cached = 0;
 
-    if (*path == '/')
-        ip = get_root_inode();
-    else
-        assert(0 && "namex: relative path not supported");
-    // ip = idup(myproc()->cwd);
+    for (u32 n = 0, s = start; n <= LFN_RUN_MAX && s != 0; n++) {
+        sector_t sec = slot_sector(s);
+        if (sec != cached) {
+            bread(buf, sec, 1);
+            cached = sec;
+        }
+        memcpy(&ents[n], buf + (s & 0xfff) % BSIZE, sizeof(fat32_dirent));
+        inums[n] = s;
+        if (s == slot) {
+            return n + 1;
+        }
+        s = dir_next_slot(s);
+    }
+    return 0;
+}
 
-    while ((path = skipelem(path, name)) != 0) {
-        // FIXME: Check if ip is a directory
-        // if not, return NULL
-        // if (ip->type != T_DIR) {
-        // iunlockput(ip);
-        // return 0;
-        //}
+// Writes `n` dir entries to the slots in `inums`, one read and write per
+// sector they fall in.
+static void write_dirents(u32 *inums, fat32_dirent *ents, u32 n) {
+    u8 buf[BSIZE];
 
-        if (nameiparent && *path == '\0') {
-            // Stop one level early.
-            return ip;
+    pthread_mutex_lock(&dirent_lock);
+    for (u32 i = 0; i < n;) {
+        sector_t sec = slot_sector(inums[i]);
+        bread(buf, sec, 1);
+        for (; i < n && slot_sector(inums[i]) == sec; i++) {
+            memcpy(buf + (inums[i] & 0xfff) % BSIZE, &ents[i],
+                   sizeof(fat32_dirent));
         }
+        bwrite(buf, sec, 1);
+    }
+    pthread_mutex_unlock(&dirent_lock);
+}
 
-        if ((next = fat_dirlookup(ip, name)) == 0) {
-            return 0;
+// Puts the long name of a run of `cnt` entries read by read_run() in
+// `out`, which holds LFN_RUN_MAX * LFN_CHARS characters. Returns its
+// length, 0 if the run is just a short entry.
+static u32 run_name(fat32_dirent *ents, u32 cnt, u16 *out) {
+    if (cnt < 2) {
+        return 0;
+    }
+    for (u32 i = 0; i + 1 < cnt; i++) {
+        fat32_lfn *l = (fat32_lfn *)&ents[i];
+        for (u32 k = 0; k < LFN_CHARS; k++) {
+            out[(LFN_ORD(l) - 1) * LFN_CHARS + k] = lfn_get(l, k);
         }
-        next->parent = ip;
-        ip = next;
     }
-    if (nameiparent) {
+    return lfn_len((fat32_lfn *)&ents[0]);
+}
+
+// Tells whether the run of `cnt` entries read by read_run() is named `u`
+// (of `n` characters), or has the short name `key` if that is set.
+static int run_matches(fat32_dirent *ents, u32 cnt, const u16 *u, u32 n,
+                       const char *key) {
+    fat32_dirent *d = &ents[cnt - 1];
+    if (key && memcmp(d->name, key, 11) == 0) {
+        return 1;
+    }
+    if (cnt < 2 || lfn_len((fat32_lfn *)&ents[0]) != n) {
         return 0;
     }
-    return ip;
+    u8 sum = fat_sfn_checksum(d->name);
+    for (u32 i = 0; i + 1 < cnt; i++) {
+        fat32_lfn *l = (fat32_lfn *)&ents[i];
+        if (l->chksum != sum || !lfn_match(l, u, n)) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
-struct inode *namei(char *path) {
-    char name[DIRSIZ];
-    return namex(path, 0, name);
-}
+typedef void (*walk_fn)(u32 start, u32 slot, fat32_dirent *d, u16 *lname,
+                        u32 llen, void *arg);
+
+// Calls `fn` for every entry of `dp`, with its long name if it has one.
+// A long name run that is broken off, out of order or whose checksum
+// doesn't match the short entry after it is ignored.
+static void dir_walk(inode *dp, walk_fn fn, void *arg) {
+    u16 lname[LFN_RUN_MAX * LFN_CHARS];
+    u32 ord = 0, run = 0, len = 0;
+    u8 sum = 0;
+
+    FOR_EACH_DIRENT(dp->inum, clus, __fat_ent, off, dent, {
+        u32 inum = (clus << 12) | off;
+        u8 first_byte = dent->name[0];
+
+        if (first_byte == 0x00) {
+            return;
+        }
+        if (first_byte == 0xe5) {
+            ord = 0;
+            continue;
+        }
+        if ((dent->attr & ATTR_LONG_NAME) == ATTR_LONG_NAME) {
+            fat32_lfn *l = (fat32_lfn *)dent;
+            if ((l->ord & LFN_LAST) && LFN_ORD(l) != 0 &&
+                LFN_ORD(l) <= LFN_RUN_MAX) {
+                ord = LFN_ORD(l);
+                sum = l->chksum;
+                run = inum;
+                len = lfn_len(l);
+            } else if (ord > 1 && LFN_ORD(l) == ord - 1 && l->chksum == sum) {
+                ord--;
+            } else {
+                ord = 0;
+                continue;
+            }
+            for (u32 k = 0; k < LFN_CHARS; k++) {
+                lname[(ord - 1) * LFN_CHARS + k] = lfn_get(l, k);
+            }
+            continue;
+        }
+        if (dent->attr & ATTR_VOLUME_ID) {
+            ord = 0;
+            continue;
+        }
+
+        int lfn = ord == 1 && fat_sfn_checksum(dent->name) == sum;
+        fn(lfn ? run : inum, inum, dent, lfn ? lname : NULL, lfn ? len : 0,
+           arg);
+        ord = 0;
+    });
+}
+
+// Name index.
+//
+// Looking a name up reads the directory up to the entry, which adds up in
+// big ones. So the DINDEX_DIRS most recently used directories of at least
+// DINDEX_MIN clusters get a hash table from names to entries, built by
+// the first lookup. Every entry is in it under its long name and under
+// its short alias. The table only says where to look, each hit is checked
+// against the entry on disk. Creating and removing entries keeps it up to
+// date, whatever moves entries around drops it.
+
+#define DINDEX_DIRS 64
+#define DINDEX_MIN  4
+#define DX_TOMB     1 // Deleted slot, no dir entry has inum 1
+
+typedef struct dindex_ent {
+    u32 hash;
+    u32 len;   // Of the name, checked before reading the entry
+    u32 start;
+    u32 slot;  // 0 if free
+} dindex_ent;
+
+typedef struct dindex {
+    u32 first; // First cluster of the directory, 0 if unused
+    u32 cap;   // Power of two
+    u32 used;  // Including deleted slots
+    u64 stamp; // Last use
+    dindex_ent *tab;
+} dindex;
+
+static pthread_mutex_t dindex_lock = PTHREAD_MUTEX_INITIALIZER;
+static dindex dindexes[DINDEX_DIRS];
+static u64 dindex_clock;
+
+static void dindex_put(dindex *dx, dindex_ent *e) {
+    u32 i = e->hash & (dx->cap - 1);
+    while (dx->tab[i].slot > DX_TOMB) {
+        i = (i + 1) & (dx->cap - 1);
+    }
+    dx->used += dx->tab[i].slot == 0;
+    dx->tab[i] = *e;
+}
+
+// Rehashes into a table at most a quarter full, dropping deleted slots.
+static void dindex_grow(dindex *dx) {
+    dindex_ent *old = dx->tab;
+    u32 ocap = dx->cap, live = 0;
+
+    for (u32 i = 0; i < ocap; i++) {
+        live += old[i].slot > DX_TOMB;
+    }
+    for (dx->cap = 64; dx->cap < live * 4; dx->cap *= 2)
+        ;
+    dx->tab = calloc(dx->cap, sizeof(dindex_ent));
+    assert(dx->tab);
+    dx->used = 0;
+    for (u32 i = 0; i < ocap; i++) {
+        if (old[i].slot > DX_TOMB) {
+            dindex_put(dx, &old[i]);
+        }
+    }
+    free(old);
+}
+
+static void dindex_insert(dindex *dx, u32 hash, u32 len, u32 start,
+                          u32 slot) {
+    if ((dx->used + 1) * 2 > dx->cap) {
+        dindex_grow(dx);
+    }
+    dindex_ent e = {.hash = hash, .len = len, .start = start, .slot = slot};
+    dindex_put(dx, &e);
+}
+
+static void dindex_remove(dindex *dx, u32 hash, u32 slot) {
+    for (u32 i = hash & (dx->cap - 1); dx->tab[i].slot != 0;
+         i = (i + 1) & (dx->cap - 1)) {
+        if (dx->tab[i].slot == slot && dx->tab[i].hash == hash) {
+            dx->tab[i].slot = DX_TOMB;
+            return;
+        }
+    }
+}
+
+// Hash of the short name of `d`, as it would be typed.
+static u32 sfn_hash(fat32_dirent *d, u32 *len) {
+    char name[SFNSIZ];
+    u16 u[SFNSIZ];
+    fat_decode_sfn(name, d);
+    for (*len = 0; name[*len]; (*len)++) {
+        u[*len] = (u8)name[*len];
+    }
+    return lfn_hash(u, *len);
+}
+
+// Adds the entry, or removes it if `del` is set.
+static void dindex_entry(dindex *dx, u32 start, u32 slot, fat32_dirent *d,
+                         u16 *lname, u32 llen, int del) {
+    u32 len, h = sfn_hash(d, &len);
+    u32 lh = lname ? lfn_hash(lname, llen) : 0;
+
+    if (del) {
+        dindex_remove(dx, h, slot);
+        if (lname) {
+            dindex_remove(dx, lh, slot);
+        }
+        return;
+    }
+    dindex_insert(dx, h, len, start, slot);
+    if (lname) {
+        dindex_insert(dx, lh, llen, start, slot);
+    }
+}
+
+static void dindex_build_one(u32 start, u32 slot, fat32_dirent *d,
+                             u16 *lname, u32 llen, void *arg) {
+    dindex_entry(arg, start, slot, d, lname, llen, 0);
+}
+
+// Caller holds dindex_lock.
+static dindex *dindex_find(u32 first) {
+    for (u32 i = 0; i < DINDEX_DIRS; i++) {
+        if (dindexes[i].first == first) {
+            return &dindexes[i];
+        }
+    }
+    return NULL;
+}
+
+// Returns the index of `dp`, whose first cluster is `first`, building it
+// if `dp` is big enough to get one. Caller holds dindex_lock.
+static dindex *dindex_get(inode *dp, u32 first) {
+    dindex *dx = dindex_find(first);
+
+    if (dx == NULL) {
+        if (dp->size < DINDEX_MIN * ff->bpb.sec_per_clus * BSIZE) {
+            return NULL;
+        }
+        dx = &dindexes[0];
+        for (u32 i = 1; i < DINDEX_DIRS; i++) {
+            if (dindexes[i].stamp < dx->stamp) {
+                dx = &dindexes[i];
+            }
+        }
+        free(dx->tab);
+        memset(dx, 0, sizeof(dindex));
+        dx->first = first;
+        dindex_grow(dx);
+        dir_walk(dp, dindex_build_one, dx);
+    }
+    dx->stamp = ++dindex_clock;
+    return dx;
+}
+
+// Brings the index of `dp`, if it has one, in line with the run of `cnt`
+// entries from `start` having been created, or deleted if `del` is set.
+static void dindex_update(inode *dp, fat32_dirent *ents, u32 cnt, u32 start,
+                          u32 slot, int del) {
+    u16 lname[LFN_RUN_MAX * LFN_CHARS];
+    u32 llen = run_name(ents, cnt, lname);
+
+    pthread_mutex_lock(&dindex_lock);
+    dindex *dx = dindex_find(dp->first);
+    if (dx) {
+        dindex_entry(dx, start, slot, &ents[cnt - 1], llen ? lname : NULL,
+                     llen, del);
+    }
+    pthread_mutex_unlock(&dindex_lock);
+}
+
+// Forgets the index of the directory starting at `first`, or of all of
+// them if `first` is 0.
+static void dindex_drop(u32 first) {
+    pthread_mutex_lock(&dindex_lock);
+    for (u32 i = 0; i < DINDEX_DIRS; i++) {
+        if (first == 0 || dindexes[i].first == first) {
+            free(dindexes[i].tab);
+            memset(&dindexes[i], 0, sizeof(dindex));
+        }
+    }
+    pthread_mutex_unlock(&dindex_lock);
+}
+
+static void stat_dirlookup(u32 scanned) {
+    stat_add(ST_DIRLOOKUP, 1);
+    stat_add(ST_DIRLOOKUP_SCAN, scanned);
+    stat_record(H_DIRLOOKUP_SCAN, scanned);
+}
+
+// Finds `name` in `dp`, storing the first slot of its entry in `*start`
+// and the slot of its short entry in `*slot`. Returns 0, or -1 if there
+// is no such entry.
+static int dir_find(inode *dp, const char *name, u32 *start, u32 *slot) {
+    assert(dp->type == T_DIR);
+    u16 u[LFN_MAX];
+    char key[11];
+    int n = utf8_to_ucs2(name, u);
+    if (n <= 0) {
+        return -1;
+    }
+    int has_key = sfn_key(name, key);
+    u32 scanned = 0;
+
+    pthread_mutex_lock(&dindex_lock);
+    dindex *dx = dindex_get(dp, dp->first);
+    if (dx) {
+        u32 h = lfn_hash(u, n);
+        int found = -1;
+        for (u32 i = h & (dx->cap - 1); dx->tab[i].slot != 0;
+             i = (i + 1) & (dx->cap - 1)) {
+            dindex_ent *e = &dx->tab[i];
+            if (e->slot == DX_TOMB || e->hash != h || e->len != n) {
+                continue;
+            }
+            fat32_dirent ents[LFN_RUN_MAX + 1];
+            u32 inums[LFN_RUN_MAX + 1];
+            u32 cnt = read_run(e->start, e->slot, ents, inums);
+            scanned += cnt;
+            if (cnt && run_matches(ents, cnt, u, n, has_key ? key : NULL)) {
+                *start = e->start;
+                *slot = e->slot;
+                found = 0;
+                break;
+            }
+        }
+        pthread_mutex_unlock(&dindex_lock);
+        stat_dirlookup(scanned);
+        return found;
+    }
+    pthread_mutex_unlock(&dindex_lock);
+
+    // No index, read through. Only the first entry of a long name run is
+    // looked at closely: it tells the length of the name, and if that is
+    // off the rest of the run is passed over checking nothing but order
+    // and checksum. The short entry is a memcmp() against the 8.3 form.
+    u32 ord = 0, run = 0, match = 0;
+    u8 sum = 0;
+    FOR_EACH_DIRENT(dp->inum, clus, __fat_ent, off, dent, {
+        u32 inum = (clus << 12) | off;
+        u8 first_byte = dent->name[0];
+        scanned++;
+
+        if (first_byte == 0x00) {
+            // End of directory
+            stat_dirlookup(scanned);
+            return -1;
+        }
+        if (first_byte == 0xe5) {
+            // Directory entry is free, skip this one
+            ord = 0;
+            continue;
+        }
+        if ((dent->attr & ATTR_LONG_NAME) == ATTR_LONG_NAME) {
+            fat32_lfn *l = (fat32_lfn *)dent;
+            if (l->ord & LFN_LAST) {
+                ord = LFN_ORD(l);
+                sum = l->chksum;
+                run = inum;
+                match = ord != 0 && lfn_len(l) == n;
+            } else if (ord > 1 && LFN_ORD(l) == ord - 1 && l->chksum == sum) {
+                ord--;
+            } else {
+                ord = 0;
+                continue;
+            }
+            match = match && lfn_match(l, u, n);
+            continue;
+        }
+        if (dent->attr & ATTR_VOLUME_ID) {
+            ord = 0;
+            continue;
+        }
+
+        int lfn = ord == 1 && fat_sfn_checksum(dent->name) == sum;
+        ord = 0;
+        if ((has_key && memcmp(dent->name, key, 11) == 0) || (lfn && match)) {
+            *start = lfn ? run : inum;
+            *slot = inum;
+            stat_dirlookup(scanned);
+            return 0;
+        }
+    });
+
+    stat_dirlookup(scanned);
+    return -1;
+}
+
+inode *fat_dirlookup(inode *dir, char *name) {
+    u32 start, slot;
+    if (dir_find(dir, name, &start, &slot) != 0) {
+        return NULL;
+    }
+    return iget(0, slot);
+}
+
+// Finds `n` consecutive free slots in `ip` and stores their inums in
+// `inums`, growing the directory if it has to. A directory always ends in
+// a 0x00 entry, so taking the last slot adds a cluster. Returns 0, or -1
+// if the disk is full.
+static int dirent_alloc(inode *ip, u32 n, u32 *inums) {
+    assert(ip->type == T_DIR);
+
+    for (;;) {
+        u32 total = ip->size / sizeof(fat32_dirent), got = 0, i = 0;
+        int end = 0;
+
+        FOR_EACH_DIRENT(ip->inum, clus, __fat_ent, off, dent, {
+            u8 first_byte = dent->name[0];
+            // Everything from the end marker on is free.
+            end |= first_byte == 0x00;
+
+            if (end || first_byte == 0xe5) {
+                inums[got++] = (clus << 12) | off;
+                if (got == n) {
+                    debugf("Allocated %d\n", inums[0]);
+                    // Freed clusters get reused, so the one added is
+                    // zeroed to not leave anything looking like dirents.
+                    if (end && i + 1 == total && itruncate(ip, ip->size + 1) != 0) {
+                        return -1;
+                    }
+                    return 0;
+                }
+            } else {
+                got = 0;
+            }
+            i++;
+        });
+
+        // The run would go past the end, grow to fit it and look again.
+        if (itruncate(ip, ip->size + (n - got) * sizeof(fat32_dirent)) != 0) {
+            return -1;
+        }
+    }
+}
+
+// Paths
+
+// Copy the next path element from path into name.
+// Return a pointer to the element following the copied one.
+// The returned path has no leading slashes,
+// so the caller can check *path=='\0' to see if the name is the last one.
+// If no name to remove, return 0.
+//
+// Examples:
+//   skipelem("a/bb/c", name) = "bb/c", setting name = "a"
+//   skipelem("///a//bb", name) = "bb", setting name = "a"
+//   skipelem("a", name) = "", setting name = "a"
+//   skipelem("", name) = skipelem("////", name) = 0
+//
+static char *skipelem(char *path, char *name) {
+    char *s;
+    int len;
+
+    while (*path == '/')
+        path++;
+    if (*path == 0)
+        return 0;
+    s = path;
+    while (*path != '/' && *path != 0)
+        path++;
+    len = path - s;
+    if (len >= DIRSIZ) {
+        memcpy(name, s, DIRSIZ - 1);
+        name[DIRSIZ - 1] = 0;
+    } else {
+        memcpy(name, s, len);
+        name[len] = 0;
+    }
+    while (*path == '/')
+        path++;
+    return path;
+}
+
+// Look up and return the inode for a path name.
+// If parent != 0, return the inode for the parent and copy the final
+// path element into name, which must have room for DIRSIZ bytes.
+// Must be called inside a transaction since it calls iput().
+static struct inode *namex(char *path, int nameiparent, char *name) {
+    struct inode *ip, *next;
+
+    if (*path == '/')
+        ip = get_root_inode();
+    else
+        assert(0 && "namex: relative path not supported");
+    // ip = idup(myproc()->cwd);
+
+    while ((path = skipelem(path, name)) != 0) {
+        if (ip->type != T_DIR) {
+            iput(ip);
+            return 0;
+        }
+
+        if (nameiparent && *path == '\0') {
+            // Stop one level early.
+            return ip;
+        }
+
+        if ((next = fat_dirlookup(ip, name)) == 0) {
+            iput(ip);
+            return 0;
+        }
+        // The child keeps our reference to its parent. Lookups may run
+        // side by side, so only one of them gets to set it.
+        pthread_mutex_lock(&icache_lock);
+        int keep = next->parent == NULL;
+        if (keep) {
+            next->parent = ip;
+        }
+        pthread_mutex_unlock(&icache_lock);
+        if (!keep) {
+            iput(ip);
+        }
+        ip = next;
+    }
+    if (nameiparent) {
+        iput(ip);
+        return 0;
+    }
+    return ip;
+}
+
+struct inode *namei(char *path) {
+    STAT_TIME(H_NAMEI);
+    TRACE_OP(TR_NAMEI, 0, 0, 0, 0, path);
+    char name[DIRSIZ];
+    return namex(path, 0, name);
+}
 
 struct inode *nameiparent(char *path, char *name) {
     return namex(path, 1, name);
 }
 
+// Batched lookups.
+//
+// The paths are sorted with '/' before every other character, so the
+// paths below a directory sit next to each other, and go into a trie in
+// one pass. Its nodes come out parents first, so resolving them in order
+// looks each directory up once. A directory is searched once for all the
+// children wanted from it: with its name index if it is big enough to
+// have one, else in one dir_walk() matching entries against hash tables
+// of the wanted names.
+
+typedef struct bnode {
+    const char *name; // Not terminated
+    u32 len;
+    u32 child;        // First and last child, 0 if none
+    u32 last;
+    u32 sibling;      // Next child of the same parent, 0 if none
+    u32 inum;
+} bnode;
+
+typedef struct bpath {
+    char *path; // With single slashes and none at the end
+    u32 idx;
+} bpath;
+
+typedef struct bwant {
+    bnode *node;
+    u16 u[LFN_MAX];
+    u32 n;
+    char key[11];
+    int has_key;
+} bwant;
+
+typedef struct bmatch {
+    bwant *wants;
+    u32 mask;     // Both tables hold mask + 1 slots
+    u32 *by_name; // 1 + index into wants, by lfn_hash() of the name
+    u32 *by_key;  // Same, by the hash of the 8.3 form
+    u32 scanned;
+} bmatch;
+
+// '/' sorts first, so "a/b" comes before "a!" and right after "a".
+static int cmp_bpath(const void *a, const void *b) {
+    const u8 *x = (u8 *)((bpath *)a)->path, *y = (u8 *)((bpath *)b)->path;
+    for (; *x && *x == *y; x++, y++) {
+    }
+    u32 cx = *x == '/' ? 1 : *x, cy = *y == '/' ? 1 : *y;
+    return (cx > cy) - (cx < cy);
+}
+
+// Returns a malloc'ed copy of `path` without repeated or trailing
+// slashes, or NULL if it is not absolute.
+static char *path_norm(const char *path) {
+    if (path[0] != '/') {
+        return NULL;
+    }
+    char *out = malloc(strlen(path) + 1), *o = out;
+    assert(out);
+    for (const char *s = path; *s; s++) {
+        if (*s != '/' || (s[1] != '/' && s[1] != 0)) {
+            *o++ = *s;
+        }
+    }
+    if (o == out) {
+        *o++ = '/';
+    }
+    *o = 0;
+    return out;
+}
+
+static u32 key_hash(const char *key) {
+    u32 h = 2166136261u;
+    for (u32 i = 0; i < 11; i++) {
+        h = (h ^ (u8)key[i]) * 16777619u;
+    }
+    return h;
+}
+
+static void bmatch_insert(u32 *tab, u32 mask, u32 h, u32 i) {
+    while (tab[h & mask] != 0) {
+        h++;
+    }
+    tab[h & mask] = i + 1;
+}
+
+static void batch_found(bwant *w, u32 slot) {
+    if (w->node->inum == NAMEI_NONE) {
+        w->node->inum = slot;
+    }
+}
+
+static void batch_one(u32 start, u32 slot, fat32_dirent *d, u16 *lname,
+                      u32 llen, void *arg) {
+    bmatch *m = arg;
+    m->scanned++;
+
+    if (lname) {
+        u32 h = lfn_hash(lname, llen);
+        for (u32 i = h; m->by_name[i & m->mask] != 0; i++) {
+            bwant *w = &m->wants[m->by_name[i & m->mask] - 1];
+            if (w->n != llen) {
+                continue;
+            }
+            u32 k = 0;
+            while (k < llen && lfn_fold(lname[k]) == lfn_fold(w->u[k])) {
+                k++;
+            }
+            if (k == llen) {
+                batch_found(w, slot);
+            }
+        }
+    }
+    for (u32 i = key_hash((char *)d->name); m->by_key[i & m->mask] != 0; i++) {
+        bwant *w = &m->wants[m->by_key[i & m->mask] - 1];
+        if (memcmp(d->name, w->key, 11) == 0) {
+            batch_found(w, slot);
+        }
+    }
+}
+
+// Resolves the children of `nodes[parent]`, a directory held as `dp`.
+static void batch_dir(inode *dp, bnode *nodes, u32 parent) {
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+    char name[DIRSIZ];
+    u32 nwant = 0;
+    for (u32 c = nodes[parent].child; c != 0; c = nodes[c].sibling) {
+        nwant++;
+    }
+
+    // One name, or the index does the work: look them up one by one.
+    if (nwant == 1 || dp->size >= DINDEX_MIN * cbytes) {
+        for (u32 c = nodes[parent].child; c != 0; c = nodes[c].sibling) {
+            u32 start, slot;
+            if (nodes[c].len >= DIRSIZ) {
+                continue;
+            }
+            memcpy(name, nodes[c].name, nodes[c].len);
+            name[nodes[c].len] = 0;
+            if (dir_find(dp, name, &start, &slot) == 0) {
+                nodes[c].inum = slot;
+            }
+        }
+        return;
+    }
+
+    bmatch m = {0};
+    u32 cap = 1;
+    while (cap < 2 * nwant) {
+        cap <<= 1;
+    }
+    m.mask = cap - 1;
+    m.wants = malloc(nwant * sizeof(bwant));
+    m.by_name = calloc(cap, sizeof(u32));
+    m.by_key = calloc(cap, sizeof(u32));
+    assert(m.wants && m.by_name && m.by_key);
+
+    u32 i = 0;
+    for (u32 c = nodes[parent].child; c != 0; c = nodes[c].sibling, i++) {
+        bwant *w = &m.wants[i];
+        w->node = &nodes[c];
+        int n = -1;
+        if (nodes[c].len < DIRSIZ) {
+            memcpy(name, nodes[c].name, nodes[c].len);
+            name[nodes[c].len] = 0;
+            n = utf8_to_ucs2(name, w->u);
+        }
+        if (n <= 0) {
+            continue;
+        }
+        w->n = n;
+        bmatch_insert(m.by_name, m.mask, lfn_hash(w->u, n), i);
+        w->has_key = sfn_key(name, w->key);
+        if (w->has_key) {
+            bmatch_insert(m.by_key, m.mask, key_hash(w->key), i);
+        }
+    }
+
+    dir_walk(dp, batch_one, &m);
+    stat_dirlookup(m.scanned);
+    free(m.wants);
+    free(m.by_name);
+    free(m.by_key);
+}
+
+void namei_batch(char **paths, u32 n, u32 *inums) {
+    bpath *sorted = malloc(n * sizeof(bpath));
+    u32 *node_of = malloc(n * sizeof(u32));
+    u32 ns = 0, nnodes = 1, cap = 64;
+    bnode *nodes = calloc(cap, sizeof(bnode));
+    assert(sorted && node_of && nodes);
+
+    for (u32 i = 0; i < n; i++) {
+        inums[i] = NAMEI_NONE;
+        char *p = path_norm(paths[i]);
+        if (p) {
+            sorted[ns].path = p;
+            sorted[ns++].idx = i;
+        }
+    }
+    qsort(sorted, ns, sizeof(bpath), cmp_bpath);
+
+    // Each path shares the nodes on the stack with the one before it, up
+    // to the first component that differs.
+    u32 stack[DIRSIZ], depth = 0;
+    nodes[0].inum = 0;
+    for (u32 i = 0; i < ns; i++) {
+        const char *s = sorted[i].path + 1;
+        u32 cur = 0, k = 0;
+        while (*s) {
+            const char *e = strchr(s, '/');
+            u32 len = e ? e - s : strlen(s);
+            if (k < depth && nodes[stack[k]].len == len &&
+                memcmp(nodes[stack[k]].name, s, len) == 0) {
+                cur = stack[k];
+            } else {
+                if (nnodes == cap) {
+                    cap *= 2;
+                    nodes = realloc(nodes, cap * sizeof(bnode));
+                    assert(nodes);
+                }
+                bnode *b = &nodes[nnodes];
+                memset(b, 0, sizeof(bnode));
+                b->name = s;
+                b->len = len;
+                b->inum = NAMEI_NONE;
+                if (nodes[cur].last) {
+                    nodes[nodes[cur].last].sibling = nnodes;
+                } else {
+                    nodes[cur].child = nnodes;
+                }
+                nodes[cur].last = nnodes;
+                cur = nnodes++;
+                if (k < depth) {
+                    depth = k;
+                }
+            }
+            if (k < DIRSIZ) {
+                stack[k] = cur;
+                depth = max(depth, k + 1);
+            }
+            k++;
+            s = e ? e + 1 : s + len;
+        }
+        node_of[i] = cur;
+    }
+
+    for (u32 i = 0; i < nnodes; i++) {
+        if (nodes[i].child == 0 || nodes[i].inum == NAMEI_NONE) {
+            continue;
+        }
+        inode *dp = iget(0, nodes[i].inum);
+        if (dp->type == T_DIR) {
+            batch_dir(dp, nodes, i);
+        }
+        iput(dp);
+    }
+
+    for (u32 i = 0; i < ns; i++) {
+        inums[sorted[i].idx] = nodes[node_of[i]].inum;
+        free(sorted[i].path);
+    }
+    free(sorted);
+    free(node_of);
+    free(nodes);
+}
+
 void test_open() {
     // inode *ip = fat_dirlookup(get_root_inode(), "README.TXT");
     // inode *ip = namei("/README.TXT");
@@ -709,167 +2819,842 @@ void test_open() {
     assert(ip);
     printf("size：%d\n", ip->size);
 
-    // test dir size
-    ip = namei("/TEST_DIR");
-    assert(ip);
-    printf("size：%d\n", ip->size);
+    // test dir size
+    ip = namei("/TEST_DIR");
+    assert(ip);
+    printf("size：%d\n", ip->size);
+
+    // test dir size
+    ip = namei("/");
+    assert(ip);
+    printf("size：%d\n", ip->size);
+}
+
+void test_bmap() {
+    inode *ip = get_root_inode();
+    sector_t first_clus = bmap_alloc(ip, 0);
+    printf("first_clus = 0x%llx\n", first_clus);
+
+    sector_t second_clus = bmap_alloc(ip, 1);
+    printf("second_clus = 0x%llx\n", second_clus);
+
+    sector_t third_clus = bmap_alloc(ip, 2);
+    printf("third_clus = 0x%llx\n", third_clus);
+}
+
+void test_balloc() {
+    u32 clus_no = balloc(alloc_end(T_FILE));
+    printf("balloc = 0x%x\n", clus_no);
+}
+
+void test_readi() {
+    inode *ip = get_root_inode();
+
+    char buf[sizeof(fat32_dirent)];
+    u32 off = 0;
+
+    for (int i = 0; i < BSIZE / sizeof(fat32_dirent); i++) {
+        off = i * sizeof(fat32_dirent);
+        readi(ip, 0, buf, off, sizeof(fat32_dirent), NULL);
+        fat32_dirent *dent = (fat32_dirent *)buf;
+
+        if ((u8)dent->name[0] == 0xe5) {
+            // Directory entry is free, skip this one
+            continue;
+        } else if ((u8)dent->name[0] == 0x00) {
+            // Directory entry is free, and there's no dirents
+            // following this entry anymore, stop getting dirents.
+            break;
+        } else {
+            char name[DIRSIZ];
+            fat_decode_sfn(name, dent);
+            printf("%s\n", name);
+        }
+    }
+}
+
+// Picks the first alias of long name `name` that isn't used in `dp` yet.
+static int sfn_pick(inode *dp, const char *name, fat32_dirent *d) {
+    char alias[SFNSIZ];
+    u32 start, slot;
+
+    for (u32 k = 0;; k++) {
+        if (fat_sfn_alias(name, k, d->name) != 0) {
+            if (k == 0) {
+                continue;
+            }
+            return -1;
+        }
+        fat_decode_sfn(alias, d);
+        if (dir_find(dp, alias, &start, &slot) != 0) {
+            return 0;
+        }
+    }
+}
+
+// Returns the inode of the newly created dir entry.
+// dirlink(), with the entry of a file pointing at `first` and `size`
+// from the start.
+static inode *dirlink_data(inode *dir, char *name, u32 inode_type, u32 first,
+                           u32 size) {
+    assert(dir->type == T_DIR);
+    assert(inode_type == T_FILE || first == 0);
+
+    int nlfn = fat_lfn_count(name);
+    if (nlfn < 0) {
+        return NULL;
+    }
+
+    // The long name run, then the short entry.
+    fat32_dirent ents[LFN_RUN_MAX + 1] = {0};
+    u32 inums[LFN_RUN_MAX + 1];
+    fat32_dirent *dirent = &ents[nlfn];
+    dirent->attr = (inode_type == T_DIR) ? ATTR_DIRECTORY : 0;
+    u16 date, time;
+    fat_now(&date, &time);
+    dirent->crt_date = dirent->wrt_date = dirent->last_acc_date = date;
+    dirent->crt_time = dirent->wrt_time = time;
+    dirent->file_size = size;
+    if (nlfn == 0) {
+        fat_encode_sfn(dirent->name, name);
+    } else if (sfn_pick(dir, name, dirent) != 0) {
+        return NULL;
+    }
+    // A directory gets its first cluster, zeroed, before it has an entry,
+    // so running out of space leaves nothing behind.
+    if (inode_type == T_DIR &&
+        (first = chain_alloc(0, 1, alloc_end(T_DIR), 1, NULL)) == 0) {
+        return NULL;
+    }
+    dirent->fat_clus_hi = (first >> 16) & 0xffff;
+    dirent->fat_clus_lo = first & 0xffff;
+    if (dirent_alloc(dir, nlfn + 1, inums) != 0) {
+        if (inode_type == T_DIR) {
+            fat_batch b = {0};
+            pthread_mutex_lock(&fat_lock);
+            fat_free_chain(&b, first);
+            fat_batch_flush(&b);
+            pthread_mutex_unlock(&fat_lock);
+        }
+        return NULL;
+    }
+    fat_lfn_fill(ents, name, dirent->name);
+
+    write_dirents(inums, ents, nlfn + 1);
+    dindex_update(dir, ents, nlfn + 1, inums[0], inums[nlfn], 0);
+
+    inode *ip = iget(0, inums[nlfn]);
+
+    if (inode_type == T_DIR) {
+        // Add . and .. to the new directory
+        // Create . directory entry
+        u32 dot_clus = ip->first;
+        char name[11] = ".          ";
+        fat32_dirent dot = {.attr = ATTR_DIRECTORY,
+                            .file_size = 0,
+                            .fat_clus_hi = (dot_clus >> 16) & 0xffff,
+                            .fat_clus_lo = dot_clus & 0xffff};
+        memcpy(dot.name, name, 11);
+        writei(ip, 0, &dot, 0, sizeof(fat32_dirent));
+
+        // Create .. directory entry
+        u32 dotdot_clus = dir->first;
+        fat32_dirent dotdot = {.attr = ATTR_DIRECTORY,
+                               .file_size = 0,
+                               .fat_clus_hi = (dotdot_clus >> 16) & 0xffff,
+                               .fat_clus_lo = dotdot_clus & 0xffff};
+        memcpy(dotdot.name, name, 11);
+        dotdot.name[1] = '.';
+        writei(ip, 0, &dotdot, sizeof(fat32_dirent), sizeof(fat32_dirent));
+    }
+
+    return ip;
+}
+
+inode *dirlink(inode *dir, char *name, u32 inode_type) {
+    STAT_TIME(H_DIRLINK);
+    TRACE_OP(TR_DIRLINK, inode_type, dir->inum, 0, 0, name);
+    return dirlink_data(dir, name, inode_type, 0, 0);
+}
+
+// Marks the dir entry of `ip`, which starts at slot `start` of `dp`,
+// deleted and queues its clusters for the reclaimer, which may still be
+// freeing them when this returns.
+static void dirent_release(inode *dp, inode *ip, u32 start) {
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+    fat32_dirent ents[LFN_RUN_MAX + 1];
+    u32 inums[LFN_RUN_MAX + 1];
+    u32 cnt = read_run(start, ip->inum, ents, inums);
+    assert(cnt > 0);
+    // The inode has the first cluster, the entry may not yet.
+    u32 clus = ip->first;
+
+    // Forget it first, so the flusher leaves the slot alone.
+    icache_forget(ip->inum);
+    dindex_update(dp, ents, cnt, start, ip->inum, 1);
+    for (u32 i = 0; i < cnt; i++) {
+        ents[i].name[0] = DDEM;
+    }
+    write_dirents(inums, ents, cnt);
+
+    // The last span_end() frees what a span is still reading.
+    pthread_mutex_lock(&icache_lock);
+    int pinned = ip->orphan = ip->pins > 0;
+    pthread_mutex_unlock(&icache_lock);
+
+    if (clus != 0 && !pinned) {
+        if (ip->type == T_DIR) {
+            dindex_drop(clus);
+        }
+        reclaim_queue(clus, ((u64)ip->size + cbytes - 1) / cbytes);
+    }
+}
+
+static int is_dot_name(char *name) {
+    return strcmp(name, ".") == 0 || strcmp(name, "..") == 0;
+}
+
+typedef struct list_ctx {
+    dir_fn fn;
+    void *arg;
+} list_ctx;
+
+static void list_one(u32 start, u32 slot, fat32_dirent *d, u16 *lname,
+                     u32 llen, void *arg) {
+    list_ctx *c = arg;
+    char name[DIRSIZ];
+    if (d->attr & ATTR_VOLUME_ID) {
+        return;
+    }
+    if (lname == NULL || ucs2_to_utf8(lname, llen, name, sizeof(name)) < 0) {
+        fat_decode_sfn(name, d);
+    }
+    if (is_dot_name(name)) {
+        return;
+    }
+
+    u32 first;
+    dir_entry e = {.name = name, .inum = slot, .size = d->file_size};
+    e.type = is_dirent_dir(d) ? T_DIR : T_FILE;
+    icache_held(slot, &first, &e.size);
+    c->fn(&e, c->arg);
+}
+
+void dir_list(inode *dp, dir_fn fn, void *arg) {
+    list_ctx c = {.fn = fn, .arg = arg};
+    dir_walk(dp, list_one, &c);
+}
+
+// Returns non-zero if `dp` holds nothing but "." and "..".
+static int dir_is_empty(inode *dp) {
+    FOR_EACH_DIRENT(dp->inum, clus, __fat_ent, off, dent, {
+        u8 first_byte = dent->name[0];
+        if (first_byte == 0x00) {
+            return 1;
+        }
+        if (first_byte == 0xe5 || memcmp(dent->name, ".          ", 11) == 0 ||
+            memcmp(dent->name, "..         ", 11) == 0) {
+            continue;
+        }
+        return 0;
+    });
+    return 1;
+}
+
+int fat_unlink(char *path) {
+    TRACE_OP(TR_UNLINK, 0, 0, 0, 0, path);
+    char name[DIRSIZ];
+
+    inode *dp = nameiparent(path, name);
+    if (dp == NULL) {
+        return -1;
+    }
+    u32 start, slot;
+    if (is_dot_name(name) || dir_find(dp, name, &start, &slot) != 0) {
+        iput(dp);
+        return -1;
+    }
+    inode *ip = iget(0, slot);
+    if (ip->type != T_FILE) {
+        iput(ip);
+        iput(dp);
+        return -1;
+    }
+
+    dirent_release(dp, ip, start);
+    iput(ip);
+    iput(dp);
+    return 0;
+}
+
+int fat_rmdir(char *path) {
+    TRACE_OP(TR_RMDIR, 0, 0, 0, 0, path);
+    char name[DIRSIZ];
+
+    inode *dp = nameiparent(path, name);
+    if (dp == NULL) {
+        return -1;
+    }
+    u32 start, slot;
+    if (is_dot_name(name) || dir_find(dp, name, &start, &slot) != 0) {
+        iput(dp);
+        return -1;
+    }
+    inode *ip = iget(0, slot);
+    if (ip->type != T_DIR || !dir_is_empty(ip)) {
+        iput(ip);
+        iput(dp);
+        return -1;
+    }
+
+    dirent_release(dp, ip, start);
+    iput(ip);
+    iput(dp);
+    return 0;
+}
+
+int dir_compact(inode *dp) {
+    TRACE_OP(TR_COMPACT, 0, dp->inum, 0, 0, NULL);
+    assert(dp->type == T_DIR);
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+    u32 per = cbytes / sizeof(fat32_dirent);
+
+    u32 nclus = 0, cap = 0, *chain = NULL;
+    FOR_EACH_CLUS(dp->inum, clus, fat_ent, {
+        if (nclus == cap) {
+            cap = cap ? cap * 2 : 16;
+            chain = realloc(chain, cap * sizeof(u32));
+            assert(chain);
+        }
+        chain[nclus++] = clus;
+    });
+
+    u8 *old = malloc((u64)nclus * cbytes);
+    u8 *new = calloc(nclus, cbytes);
+    assert(old && new);
+    // Nobody patches an entry between our read and write.
+    pthread_mutex_lock(&dirent_lock);
+    for (u32 k = 0; k < nclus; k++) {
+        bread(old + k * cbytes, clus_data_sector(chain[k]), ff->bpb.sec_per_clus);
+    }
+
+    // Pack live entries to the front in their order, so a long name stays
+    // right in front of its short entry.
+    fat32_dirent *o = (fat32_dirent *)old, *n = (fat32_dirent *)new;
+    u32 live = 0;
+    for (u32 i = 0; i < nclus * per; i++) {
+        u8 first_byte = o[i].name[0];
+        if (first_byte == 0x00) {
+            break;
+        }
+        if (first_byte == 0xe5) {
+            continue;
+        }
+        n[live] = o[i];
+        if (i != live) {
+            icache_remap((chain[i / per] << 12) | (i % per) * sizeof(fat32_dirent),
+                         (chain[live / per] << 12) |
+                             (live % per) * sizeof(fat32_dirent));
+        }
+        live++;
+    }
+
+    // Keep room for the 0x00 end marker.
+    u32 keep = max((live + 1 + per - 1) / per, 1);
+    for (u32 k = 0; k < keep; k++) {
+        if (memcmp(old + k * cbytes, new + k * cbytes, cbytes) != 0) {
+            bwrite(new + k * cbytes, clus_data_sector(chain[k]),
+                   ff->bpb.sec_per_clus);
+        }
+    }
+    pthread_mutex_unlock(&dirent_lock);
+    if (keep < nclus) {
+        chain_resize(dp, keep * cbytes);
+    }
+    dindex_drop(chain[0]);
+
+    free(old);
+    free(new);
+    free(chain);
+    return nclus - keep;
+}
+
+static void zero_clus(u32 clus, u32 from, u32 to) {
+    u8 buf[BSIZE];
+
+    for (u32 off = from; off < to; off = (off / BSIZE + 1) * BSIZE) {
+        sector_t sec = clus_data_sector(clus) + off / BSIZE;
+        u32 end = min(to, (off / BSIZE + 1) * BSIZE);
+        if (off % BSIZE != 0 || end % BSIZE != 0) {
+            bread(buf, sec, 1);
+        } else {
+            memset(buf, 0, BSIZE);
+        }
+        memset(buf + off % BSIZE, 0, end - off);
+        bwrite(buf, sec, 1);
+    }
+}
+
+// Zeroes bytes [from, to) of the chain of `inum`, which must cover them.
+static void zero_file_range(u32 inum, u32 from, u32 to) {
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+    u64 base = 0;
 
-    // test dir size
-    ip = namei("/");
-    assert(ip);
-    printf("size：%d\n", ip->size);
+    if (from >= to) {
+        return;
+    }
+    FOR_EACH_CLUS(inum, clus, fat_ent, {
+        if (base + cbytes > from) {
+            u32 lo = (from > base) ? from - base : 0;
+            u32 hi = min((u64)to - base, cbytes);
+            zero_clus(clus, lo, hi);
+        }
+        base += cbytes;
+        if (base >= to) {
+            break;
+        }
+    });
 }
 
-void test_bmap() {
-    inode *ip = get_root_inode();
-    u32 first_clus = bmap_alloc(ip, 0);
-    printf("first_clus = 0x%x\n", first_clus);
-
-    u32 second_clus = bmap_alloc(ip, 1);
-    printf("second_clus = 0x%x\n", second_clus);
+// Chain tail cache. Appending to a file needs the end of its chain and
+// its length; the inode keeps both from the last time they were known.
+// They hold while `first` is what it was then and the cluster still ends
+// a chain.
+
+// Sets `*last` and `*nclus` for `ip` and returns 1, or 0 if the cache
+// doesn't hold.
+static int chain_tail(inode *ip, u32 *last, u32 *nclus) {
+    if (ip->first == 0) {
+        *last = *nclus = 0;
+        return 1;
+    }
+    if (ip->tail_first != ip->first ||
+        !is_fat_entry_eoc(get_fat_entry(ip->tail))) {
+        return 0;
+    }
+    *last = ip->tail;
+    *nclus = ip->nclus;
+    return 1;
+}
 
-    u32 third_clus = bmap_alloc(ip, 2);
-    printf("third_clus = 0x%x\n", third_clus);
+static void chain_tail_set(inode *ip, u32 last, u32 nclus) {
+    ip->tail_first = ip->first;
+    ip->tail = last;
+    ip->nclus = nclus;
 }
 
-void test_balloc() {
-    u32 clus_no = balloc();
-    printf("balloc = 0x%x\n", clus_no);
+// Allocates `n` clusters below `end` in as few contiguous runs as the
+// free space allows, chained on after `last` unless it is 0. New clusters
+// are zeroed if `zero` is set. Returns the first of them, or 0 with the
+// chain as it was if the disk is full. The last one goes to `*lastp` if it
+// isn't NULL.
+static u32 chain_alloc(u32 last, u32 n, u32 end, int zero, u32 *lastp) {
+    u32 old_last = last, new_first = 0;
+
+    while (n > 0) {
+        u32 got;
+        u32 run = balloc_run(n, &got, end);
+        if (run == 0) {
+            // Disk full, give back what this call allocated.
+            if (new_first != 0) {
+                if (old_last != 0) {
+                    set_fat_entry(old_last, 0x0fffffff);
+                }
+                fat_batch b = {0};
+                pthread_mutex_lock(&fat_lock);
+                fat_free_chain(&b, new_first);
+                fat_batch_flush(&b);
+                pthread_mutex_unlock(&fat_lock);
+            }
+            return 0;
+        }
+        if (zero) {
+            for (u32 i = 0; i < got; i++) {
+                zero_clus(run + i, 0, ff->bpb.sec_per_clus * BSIZE);
+            }
+        }
+        if (last != 0) {
+            set_fat_entry(last, run);
+        }
+        if (new_first == 0) {
+            new_first = run;
+        }
+        last = run + got - 1;
+        n -= got;
+    }
+
+    if (lastp) {
+        *lastp = last;
+    }
+    return new_first;
 }
 
-void test_readi() {
-    inode *ip = get_root_inode();
+// Appends `n` clusters to the chain of `ip`, whose last cluster is
+// `last` (0 if it has none) and which is `have` long, see chain_alloc().
+// Returns 0, or -1 with the chain as it was if the disk is full.
+static int chain_extend(inode *ip, u32 last, u32 have, u32 n, int zero) {
+    u32 first = chain_alloc(last, n, alloc_end(ip->type), zero, &last);
+    if (first == 0) {
+        return -1;
+    }
+    if (have == 0) {
+        ip->first = first;
+        iupdate(ip);
+    }
+    chain_tail_set(ip, last, have + n);
+    return 0;
+}
 
-    char buf[sizeof(fat32_dirent)];
-    u32 off = 0;
+// Shrinks or extends the chain of `ip` to `len` bytes, see itruncate().
+// Shrinking drops every cluster past the new end. The cut-off tail is
+// freed through one FAT batch, so a sector full of entries costs one
+// read and one write, and the free count is updated as it goes.
+// Extended bytes read back as zeros.
+static int chain_resize(inode *ip, u32 len) {
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
 
-    for (int i = 0; i < BSIZE / sizeof(fat32_dirent); i++) {
-        off = i * sizeof(fat32_dirent);
-        readi(ip, 0, buf, off, sizeof(fat32_dirent), NULL);
-        fat32_dirent *dent = (fat32_dirent *)buf;
+    if (ip->type == T_DIR) {
+        len = max(((u64)len + cbytes - 1) / cbytes * cbytes, cbytes);
+    }
+    u32 need = ((u64)len + cbytes - 1) / cbytes;
+    u32 old_size = (ip->type == T_DIR) ? len : ip->size;
+    // Growing a file keeps whatever was reserved past its old end.
+    int shrink = (ip->type == T_DIR) || len <= old_size;
+
+    pthread_mutex_lock(&icache_lock);
+    int pinned = ip->pins > 0;
+    pthread_mutex_unlock(&icache_lock);
+    if (pinned && len < old_size) {
+        return -1;
+    }
 
-        if ((u8)dent->name[0] == 0xe5) {
-            // Directory entry is free, skip this one
-            continue;
-        } else if ((u8)dent->name[0] == 0x00) {
-            // Directory entry is free, and there's no dirents
-            // following this entry anymore, stop getting dirents.
+    // Walk up to the last cluster we keep. Cut to nothing,
+    // fat_free_chain() does the only walk; growing, the tail may be known.
+    fat_batch b = {0};
+    u32 have = 0, last = 0;
+    int known = !shrink && chain_tail(ip, &last, &have);
+    pthread_mutex_lock(&fat_lock);
+    u32 first = ip->first;
+    fat_entry next = 0;
+
+    for (u32 clus = (known || (shrink && need == 0)) ? 0 : first; clus != 0;) {
+        next = fat_batch_get(&b, clus);
+        assert(next != FE_FREE);
+        assert(next != FE_BAD);
+        have++;
+        last = clus;
+        if ((shrink && have == need) || is_fat_entry_eoc(next)) {
             break;
-        } else {
-            char name[12];
-            fat_decode_sfn(name, dent);
-            printf("%s\n", name);
         }
+        clus = next;
+    }
+
+    if (!shrink) {
+        fat_batch_flush(&b);
+    } else if (need == 0 && first != 0) {
+        fat_free_chain(&b, first);
+        fat_batch_flush(&b);
+        ip->first = 0;
+    } else if (have == need && first != 0 && !is_fat_entry_eoc(next)) {
+        fat_batch_set(&b, last, 0x0fffffff);
+        fat_free_chain(&b, next);
+        fat_batch_flush(&b);
+    } else {
+        fat_batch_flush(&b);
+    }
+    pthread_mutex_unlock(&fat_lock);
+
+    // Zero what was past the old end in the clusters we already had,
+    // preallocated ones included.
+    if (len > old_size && have > 0) {
+        zero_file_range(ip->inum, old_size, min(len, (u64)have * cbytes));
+    }
+
+    if (ip->first != 0 && have >= need) {
+        chain_tail_set(ip, last, have);
+    }
+    if (have < need && chain_extend(ip, last, have, need - have, 1) != 0) {
+        return -1;
+    }
+
+    ip->size = (ip->type == T_DIR) ? need * cbytes : len;
+    iupdate(ip);
+    if (len != old_size) {
+        itouch(ip, 1);
     }
+    return 0;
 }
 
-// Returns the inode of the newly created dir entry.
-static inode *dirlink(inode *dir, char *name, u32 inode_type) {
-    assert(dir->type == T_DIR);
+int itruncate(inode *ip, u32 len) {
+    TRACE_OP(TR_ITRUNCATE, 0, ip->inum, 0, len, NULL);
+    // The clusters it would cut may hold live entries; dir_compact()
+    // knows which are empty.
+    if (ip->type == T_DIR && len < ip->size) {
+        return -1;
+    }
+    return chain_resize(ip, len);
+}
 
-    u32 inum = dirent_alloc(dir);
+int ifallocate(inode *ip, u32 len, int flags) {
+    TRACE_OP(TR_FALLOCATE, flags, ip->inum, 0, len, NULL);
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+    u32 need = ((u64)len + cbytes - 1) / cbytes;
+    u32 have = 0, last = 0;
 
-    fat32_dirent dirent = {.attr = ((inode_type == T_DIR) ? ATTR_DIRECTORY : 0),
-                           .file_size = 0};
+    assert(ip->type == T_FILE);
 
-    fat_encode_sfn(dirent.name, name);
+    if (!chain_tail(ip, &last, &have)) {
+        FOR_EACH_CLUS(ip->inum, clus, fat_ent, {
+            have++;
+            last = clus;
+        });
+        chain_tail_set(ip, last, have);
+    }
 
-    write_fat32_dirent(inum, &dirent);
+    // Clusters past EOF are zeroed later, when the size grows over them.
+    if (have < need && chain_extend(ip, last, have, need - have, 0) != 0) {
+        return -1;
+    }
 
-    inode *ip = iget(0, inum);
+    if (!(flags & FALLOC_KEEP_SIZE) && len > ip->size) {
+        return itruncate(ip, len);
+    }
+    return 0;
+}
 
-    if (inode_type == T_DIR) {
-        // Add . and .. to the new directory
-        // Create . directory entry
-        u32 dot_clus = get_first_data_cluster(ip->inum);
-        char name[11] = ".          ";
-        fat32_dirent dot = {.attr = ATTR_DIRECTORY,
-                            .file_size = 0,
-                            .fat_clus_hi = (dot_clus >> 16) & 0xffff,
-                            .fat_clus_lo = dot_clus & 0xffff};
-        memcpy(dot.name, name, 11);
-        writei(ip, 0, &dot, 0, sizeof(fat32_dirent));
+u32 fat_chain_extents(u32 clus, u32 *nclus) {
+    u32 n = 0, extents = 0;
 
-        // Create .. directory entry
-        u32 dotdot_clus = get_first_data_cluster(dir->inum);
-        fat32_dirent dotdot = {.attr = ATTR_DIRECTORY,
-                               .file_size = 0,
-                               .fat_clus_hi = (dotdot_clus >> 16) & 0xffff,
-                               .fat_clus_lo = dotdot_clus & 0xffff};
-        memcpy(dotdot.name, name, 11);
-        dotdot.name[1] = '.';
-        writei(ip, 0, &dotdot, sizeof(fat32_dirent), sizeof(fat32_dirent));
+    while (clus >= 2 && clus < ff->nclus + 2) {
+        fat_entry next = get_fat_entry(clus);
+        n++;
+        if (is_fat_entry_eoc(next) || next != clus + 1) {
+            extents++;
+        }
+        if (is_fat_entry_eoc(next)) {
+            break;
+        }
+        clus = next;
     }
 
-    return ip;
+    *nclus = n;
+    return extents;
 }
 
-// Copy a modified in-memory inode to disk.
-// Must be called after every change to an ip->xxx field
-// that lives on disk.
-// Caller must hold ip->lock.
-void iupdate(struct inode *ip) {
-    if (ip->inum == 0) {
-        return;
+// Copies `nclus` clusters of the chain at `from` into the chain at `to`,
+// one bmove() per stretch where both are contiguous. Returns the number
+// of bytes copied.
+static u64 copy_chain(u32 from, u32 to, u32 nclus) {
+    u32 spc = ff->bpb.sec_per_clus;
+    u64 bytes = 0;
+
+    while (nclus > 0 && from != 0 && to != 0) {
+        u32 len = 1;
+        fat_entry fnext = get_fat_entry(from), tnext = get_fat_entry(to);
+        while (len < nclus && fnext == from + len && tnext == to + len) {
+            len++;
+            fnext = get_fat_entry(from + len - 1);
+            tnext = get_fat_entry(to + len - 1);
+        }
+
+        bmove(clus_data_sector(to), clus_data_sector(from), len * spc);
+        bytes += (u64)len * spc * BSIZE;
+        nclus -= len;
+        from = is_fat_entry_eoc(fnext) ? 0 : fnext;
+        to = is_fat_entry_eoc(tnext) ? 0 : tnext;
     }
+    return bytes;
+}
+
+// Points the "." of a relocated directory, and the ".." of its
+// subdirectories, at its new first cluster.
+static void relink_dots(u32 old_first, u32 new_first) {
+    u32 spc = ff->bpb.sec_per_clus;
+    u8 buf[BSIZE];
+
+    // The run is contiguous now, so plain sector arithmetic works.
+    u32 nclus;
+    fat_chain_extents(new_first, &nclus);
+    for (u32 s = 0; s < nclus * spc; s++) {
+        sector_t sec = clus_data_sector(new_first) + s;
+        int dirty = 0;
+        bread(buf, sec, 1);
+        fat32_dirent *dents = (fat32_dirent *)buf;
+
+        for (u32 i = 0; i < BSIZE / sizeof(fat32_dirent); i++) {
+            fat32_dirent *d = &dents[i];
+            if ((u8)d->name[0] == 0x00) {
+                break;
+            }
+            if ((u8)d->name[0] == 0xe5 || !(d->attr & ATTR_DIRECTORY) ||
+                (d->attr & ATTR_LONG_NAME) == ATTR_LONG_NAME) {
+                continue;
+            }
+            if (memcmp(d->name, ".          ", 11) == 0) {
+                d->fat_clus_lo = new_first & 0xffff;
+                d->fat_clus_hi = (new_first >> 16) & 0xffff;
+                dirty = 1;
+                continue;
+            }
+            if (memcmp(d->name, "..         ", 11) == 0) {
+                continue;
+            }
 
-    fat32_dirent dirent = read_fat32_dirent(ip->inum);
-    dirent.attr = (ip->type == T_DIR) ? ATTR_DIRECTORY : 0;
-    if (ip->type != T_DIR) {
-        dirent.file_size = ip->size;
+            u32 child = (d->fat_clus_hi << 16) | d->fat_clus_lo;
+            if (child < 2 || child >= ff->nclus + 2) {
+                continue;
+            }
+            // ".." is the second entry of the child.
+            u8 cbuf[BSIZE];
+            sector_t csec = clus_data_sector(child);
+            bread(cbuf, csec, 1);
+            fat32_dirent *dotdot = (fat32_dirent *)cbuf + 1;
+            u32 up = (dotdot->fat_clus_hi << 16) | dotdot->fat_clus_lo;
+            if (memcmp(dotdot->name, "..         ", 11) == 0 && up == old_first) {
+                dotdot->fat_clus_lo = new_first & 0xffff;
+                dotdot->fat_clus_hi = (new_first >> 16) & 0xffff;
+                bwrite(cbuf, csec, 1);
+            }
+        }
+        if (dirty) {
+            bwrite(buf, sec, 1);
+        }
     }
-    write_fat32_dirent(ip->inum, &dirent);
 }
 
-// Truncate inode(discard contents)
-void itrunc(inode *ip) {
-    // TODO: Implement itrunc for T_DIR
-    assert(ip->type == T_FILE);
+int irelocate(u32 inum, u32 first, u64 *bytes) {
+    assert(inum != 0);
 
-    fat32_dirent dirent = read_fat32_dirent(ip->inum);
+    // A holder could write to the old chain while we copy it, or read
+    // pinned clusters in place, so only move what nobody holds, and keep
+    // iget() off it until we are done.
+    *bytes = 0;
+    if (icache_claim(inum) != 0) {
+        return -1;
+    }
 
-    u32 clus = get_first_data_cluster(ip->inum);
-    if (clus == 0) {
-        // we have nothing to truncate
-        return;
+    // The entries read below, of this file and of the children of this
+    // directory, must be current.
+    iflush();
+
+    // The slot may have been freed or taken by another entry since the
+    // caller listed it.
+    fat32_dirent dent = read_fat32_dirent(inum);
+    u8 c = dent.name[0];
+    if (c == 0x00 || c == 0xe5 || c == '.' ||
+        (dent.attr & ATTR_LONG_NAME) == ATTR_LONG_NAME ||
+        (dent.attr & ATTR_VOLUME_ID) ||
+        ((dent.fat_clus_hi << 16) | dent.fat_clus_lo) != first) {
+        icache_release();
+        return -1;
     }
+    u32 nclus;
 
-    fat_entry freed_entry = 0x0fffffff;
+    if (first == 0 || fat_chain_extents(first, &nclus) <= 1) {
+        icache_release();
+        return 0;
+    }
 
-    while (clus != 0) {
-        u32 entry = get_fat_entry(clus);
-        set_fat_entry(clus, freed_entry);
-        assert(entry != FE_FREE);
-        assert(entry != FE_BAD);
-        if (is_fat_entry_eoc(entry)) {
-            break;
+    u32 got;
+    u32 run = balloc_run(nclus, &got,
+                         alloc_end((dent.attr & ATTR_DIRECTORY) ? T_DIR : T_FILE));
+    if (run != 0 && got < nclus) {
+        fat_batch b = {0};
+        pthread_mutex_lock(&fat_lock);
+        fat_free_chain(&b, run);
+        fat_batch_flush(&b);
+        pthread_mutex_unlock(&fat_lock);
+        run = 0;
+    }
+    if (run == 0) {
+        icache_release();
+        return -1;
+    }
+
+    // Copy first, then switch the dir entry over in one sector write, and
+    // only then free the old chain. A crash in between leaves either the
+    // old file or the new one, plus a lost chain for fsck. Held children
+    // of a directory write their entries under dirent_lock, so they land
+    // in the copy only once their inums follow it.
+    pthread_mutex_lock(&dirent_lock);
+    *bytes = copy_chain(first, run, nclus);
+    set_first_data_cluster(inum, run);
+    if (dent.attr & ATTR_DIRECTORY) {
+        relink_dots(first, run);
+        icache_remap_chain(first, run);
+    }
+    pthread_mutex_unlock(&dirent_lock);
+    if (dent.attr & ATTR_DIRECTORY) {
+        dindex_drop(first);
+    }
+    icache_release();
+
+    fat_batch b = {0};
+    pthread_mutex_lock(&fat_lock);
+    fat_free_chain(&b, first);
+    fat_batch_flush(&b);
+    pthread_mutex_unlock(&fat_lock);
+
+    return nclus;
+}
+
+inode *icopy(inode *src, inode *dir, char *name) {
+    STAT_TIME(H_ICOPY);
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+    u32 need = ((u64)src->size + cbytes - 1) / cbytes;
+    assert(src->type == T_FILE);
+
+    if (fat_lfn_count(name) < 0) {
+        return NULL;
+    }
+
+    // Data first, then the entry that points at it in one write. A crash
+    // in between leaves a lost chain for fsck.
+    u32 first = 0;
+    if (need > 0) {
+        first = chain_alloc(0, need, alloc_end(T_FILE), 0, NULL);
+        if (first == 0) {
+            return NULL;
         }
-        clus = entry;
+        copy_chain(src->first, first, need);
+    }
+
+    inode *ip = dirlink_data(dir, name, T_FILE, first, src->size);
+    if (ip == NULL && first != 0) {
+        fat_batch b = {0};
+        pthread_mutex_lock(&fat_lock);
+        fat_free_chain(&b, first);
+        fat_batch_flush(&b);
+        pthread_mutex_unlock(&fat_lock);
     }
+    return ip;
+}
 
-    dirent.fat_clus_hi = dirent.fat_clus_lo = 0;
-    write_fat32_dirent(ip->inum, &dirent);
+// Truncate inode(discard contents)
+void itrunc(inode *ip) {
+    TRACE_OP(TR_ITRUNC, 0, ip->inum, 0, 0, NULL);
+    // TODO: Implement itrunc for T_DIR
+    assert(ip->type == T_FILE);
 
-    ip->size = 0;
-    iupdate(ip);
+    itruncate(ip, 0);
 }
 
 void test_dirent_alloc() {
     inode *ip = get_root_inode();
-    u32 inum = dirent_alloc(ip);
-    assert(inum);
+    u32 inum;
+    assert(dirent_alloc(ip, 1, &inum) == 0);
     printf("inum = 0x%x\n", inum);
 
     u32 clus = inum >> 12;
     u32 off = inum & 0xfff;
 
-    printf("sector = %d\n", clus_data_sector(clus));
+    printf("sector = %llu\n", clus_data_sector(clus));
     printf("off = %d\n", off);
 }
 
 
 void test_encode_sfn() {
-    char name[12];
+    char name[DIRSIZ] = {0};
     u32 ret = fat_encode_sfn(name, "hello.txt");
     assert(ret == 0);
     printf("name = %s\n", name);
@@ -925,6 +3710,199 @@ void test_truncate() {
     printf(" after: file size = %d\n", file->size);
 }
 
+void test_itruncate() {
+    printf("itruncate test\n");
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+    inode *file = namei("/FILE10.TXT");
+    assert(file != NULL);
+
+    // Grow across several clusters, the new bytes must read back as zeros.
+    u32 free0 = fs_free_clusters();
+    u32 old = file->size;
+    assert(itruncate(file, old + 3 * cbytes + 100) == 0);
+    assert(file->size == old + 3 * cbytes + 100);
+    printf("free: %u -> %u\n", free0, fs_free_clusters());
+
+    char buf[BSIZE];
+    for (u32 off = old; off < file->size; off += sizeof(buf)) {
+        u32 n = readi(file, 0, buf, off, sizeof(buf), NULL);
+        for (u32 i = 0; i < n; i++) {
+            assert(buf[i] == 0);
+        }
+    }
+
+    // Shrink into the middle of the first cluster, then to nothing.
+    assert(itruncate(file, 10) == 0);
+    assert(file->size == 10);
+    assert(readi(file, 0, buf, 0, sizeof(buf), NULL) == 10);
+    assert(itruncate(file, 0) == 0);
+    assert(get_first_data_cluster(file->inum) == 0);
+    printf("free after shrink: %u\n", fs_free_clusters());
+    assert(fs_free_clusters() >= free0);
+
+    // Extending from empty must allocate the first cluster.
+    assert(itruncate(file, cbytes + 1) == 0);
+    assert(get_first_data_cluster(file->inum) != 0);
+    u32 old_clus = (old + cbytes - 1) / cbytes;
+    assert(fs_free_clusters() == free0 + old_clus - 2);
+
+    // Directories grow, but don't lose clusters that may hold entries.
+    inode *dir = namei("/TEST_DIR");
+    u32 dsize = dir->size;
+    assert(itruncate(dir, dsize + 1) == 0 && dir->size == dsize + cbytes);
+    assert(itruncate(dir, dsize) == -1 && dir->size == dsize + cbytes);
+    iput(dir);
+}
+
+void test_unlink() {
+    printf("unlink test\n");
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+
+    inode *dir = namei("/TEST_DIR");
+    inode *ip = dirlink(dir, "DOOMED.TXT", T_FILE);
+    assert(itruncate(ip, 64 * cbytes) == 0);
+    u32 before = fs_free_clusters();
+
+    // The clusters count as free right away, whenever they really are.
+    assert(fat_unlink("/TEST_DIR/DOOMED.TXT") == 0);
+    assert(namei("/TEST_DIR/DOOMED.TXT") == NULL);
+    assert(fs_free_clusters() == before + 64);
+    assert(fat_unlink("/TEST_DIR/DOOMED.TXT") == -1);
+    fs_sync();
+    printf("free: %u -> %u\n", before, fs_free_clusters());
+    assert(fs_free_clusters() == before + 64);
+
+    // Directories go through rmdir, and only once they are empty.
+    inode *sub = dirlink(dir, "GONE", T_DIR);
+    dirlink(sub, "X.TXT", T_FILE);
+    assert(fat_unlink("/TEST_DIR/GONE") == -1);
+    assert(fat_rmdir("/TEST_DIR/GONE") == -1);
+    assert(fat_unlink("/TEST_DIR/GONE/X.TXT") == 0);
+    assert(fat_rmdir("/TEST_DIR/GONE/.") == -1);
+    assert(fat_rmdir("/TEST_DIR/GONE") == 0);
+    assert(namei("/TEST_DIR/GONE") == NULL);
+    assert(fat_rmdir("/") == -1);
+    fs_sync();
+}
+
+void test_fallocate() {
+    printf("fallocate test\n");
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+
+    inode *ip = dirlink(namei("/TEST_DIR"), "PREALLOC.TXT", T_FILE);
+    assert(ifallocate(ip, 16 * cbytes, FALLOC_KEEP_SIZE) == 0);
+    assert(ip->size == 0);
+
+    // One allocation, one run.
+    u32 n = 0;
+    FOR_EACH_CLUS(ip->inum, clus, fat_ent, {
+        assert(is_fat_entry_eoc(fat_ent) || fat_ent == clus + 1);
+        n++;
+    });
+    assert(n == 16);
+
+    // Dirty a reserved cluster, writing past it must zero what shows.
+    u8 junk[BSIZE];
+    memset(junk, 0xaa, sizeof(junk));
+    bwrite(junk, clus_data_sector(get_first_data_cluster(ip->inum) + 1), 1);
+
+    char msg[] = "hello";
+    u32 off = 3 * cbytes + 7;
+    assert(writei(ip, 0, msg, off, sizeof(msg)) == sizeof(msg));
+    assert(ip->size == off + sizeof(msg));
+
+    char buf[BSIZE];
+    for (u32 o = 0; o < off; o += sizeof(buf)) {
+        u32 m = readi(ip, 0, buf, o, min(sizeof(buf), off - o), NULL);
+        for (u32 i = 0; i < m; i++) {
+            assert(buf[i] == 0);
+        }
+    }
+    assert(readi(ip, 0, buf, off, sizeof(msg), NULL) == sizeof(msg));
+    assert(strcmp(buf, msg) == 0);
+
+    // Without KEEP_SIZE the file grows, and nothing new is allocated.
+    u32 free0 = fs_free_clusters();
+    assert(ifallocate(ip, 10 * cbytes, 0) == 0);
+    assert(ip->size == 10 * cbytes);
+    assert(fs_free_clusters() == free0);
+
+    // Growing a cluster at a time starts from the known tail, no walks.
+    u64 steps = my_stats()->count[ST_CHAIN_STEP];
+    for (u32 k = 11; k <= 40; k++) {
+        assert(ifallocate(ip, k * cbytes, FALLOC_KEEP_SIZE) == 0);
+    }
+    assert(my_stats()->count[ST_CHAIN_STEP] == steps);
+    u32 nclus;
+    fat_chain_extents(ip->first, &nclus);
+    assert(nclus == 40 && ip->nclus == 40);
+
+    // With the disk full a new directory fails cleanly.
+    inode *dir = namei("/TEST_DIR");
+    inode *hog = dirlink(dir, "HOG.BIN", T_FILE);
+    assert(ifallocate(hog, fs_free_clusters() * cbytes, FALLOC_KEEP_SIZE) == 0);
+    assert(fs_free_clusters() == 0);
+    assert(dirlink(dir, "NOROOM", T_DIR) == NULL);
+    assert(namei("/TEST_DIR/NOROOM") == NULL);
+    iput(hog);
+    assert(fat_unlink("/TEST_DIR/HOG.BIN") == 0);
+    iput(dir);
+}
+
+void test_compact() {
+    printf("compact test\n");
+    char name[DIRSIZ], path[32];
+    inode *dir = dirlink(namei("/"), "SPOOL", T_DIR);
+
+    for (u32 i = 0; i < 200; i++) {
+        snprintf(name, sizeof(name), "J%u", i);
+        iput(dirlink(dir, name, T_FILE));
+    }
+    u32 before = dir->size;
+
+    // Hold on to a survivor near the end, its entry is going to move.
+    inode *held = namei("/SPOOL/J190");
+    assert(writei(held, 0, "spool", 0, 5) == 5);
+    u32 old_inum = held->inum;
+    assert(namei("/SPOOL/J190") == held);
+    iput(held);
+
+    for (u32 i = 0; i < 200; i++) {
+        if (i % 10 != 0) {
+            snprintf(path, sizeof(path), "/SPOOL/J%u", i);
+            assert(fat_unlink(path) == 0);
+        }
+    }
+
+    int released = dir_compact(dir);
+    printf("released %d clusters, size %u -> %u, inum 0x%x -> 0x%x\n",
+           released, before, dir->size, old_inum, held->inum);
+    assert(released > 0);
+    assert(dir->size < before);
+    assert(held->inum != old_inum);
+
+    // The held inode is still the one lookups hand out, and still works.
+    inode *again = namei("/SPOOL/J190");
+    assert(again == held);
+    char buf[8];
+    assert(readi(held, 0, buf, 0, 5, NULL) == 5);
+    assert(memcmp(buf, "spool", 5) == 0);
+    iput(again);
+    iput(held);
+
+    for (u32 i = 0; i < 200; i += 10) {
+        snprintf(path, sizeof(path), "/SPOOL/J%u", i);
+        inode *ip = namei(path);
+        assert(ip != NULL);
+        iput(ip);
+    }
+    iput(dirlink(dir, "NEW", T_FILE));
+    inode *ip = namei("/SPOOL/NEW");
+    assert(ip != NULL);
+    iput(ip);
+    iput(dir);
+}
+
 void test_for_each_clus() {
     printf("for each clus test\n");
     inode *file = namei("/FILE9.TXT");
@@ -937,24 +3915,482 @@ void test_for_each_clus() {
     FOR_EACH_CLUS(file->inum, clus, ent, {
         printf("clus = 0x%x\n", clus); // Why
         printf("ent = 0x%x\n", ent);
-        u32 sec = clus_data_sector(clus);
-        printf("sec = 0x%x\n", sec * BSIZE);
+        sector_t sec = clus_data_sector(clus);
+        printf("sec = 0x%llx\n", sec * BSIZE);
     });
 }
 
+static void ls_one(u32 start, u32 slot, fat32_dirent *d, u16 *lname,
+                   u32 llen, void *arg) {
+    char name[DIRSIZ];
+    if (lname == NULL || ucs2_to_utf8(lname, llen, name, sizeof(name)) < 0) {
+        fat_decode_sfn(name, d);
+    }
+    printf("%s\n", name);
+}
+
 void test_ls() {
     inode *root = get_root_inode();
     assert(root != NULL);
+    dir_walk(root, ls_one, NULL);
+    iput(root);
+}
 
-    FOR_EACH_DIRENT(root->inum, clus, ent, off, dirent, {
-        u8 first_byte = dirent->name[0];
-        if (first_byte == 0xe5) {
-            continue;
-        } else if (first_byte == 0x00) {
-            break;
+void test_lfn() {
+    printf("long name test\n");
+    char name[DIRSIZ + 16], path[DIRSIZ + 16];
+    inode *dir = dirlink(namei("/"), "Long Names", T_DIR);
+    assert(dir != NULL);
+
+    // Lower case 8.3 keeps its case in a long name over the plain alias.
+    inode *ip = dirlink(dir, "hello.txt", T_FILE);
+    fat32_dirent d = read_fat32_dirent(ip->inum);
+    assert(memcmp(d.name, "HELLO   TXT", 11) == 0);
+    assert(namei("/long names/HELLO.TXT") == ip);
+    iput(ip);
+    iput(ip);
+
+    // Aliases count up, then switch to a hash of the name.
+    for (u32 i = 0; i < 6; i++) {
+        snprintf(name, sizeof(name), "Quarterly report %u.pdf", i);
+        iput(dirlink(dir, name, T_FILE));
+    }
+    ip = namei("/Long Names/quarterly REPORT 1.PDF");
+    assert(ip != NULL);
+    d = read_fat32_dirent(ip->inum);
+    assert(memcmp(d.name, "QUARTE~2PDF", 11) == 0);
+    assert(namei("/Long Names/QUARTE~2.PDF") == ip);
+    iput(ip);
+    iput(ip);
+    ip = namei("/Long Names/Quarterly report 5.pdf");
+    d = read_fat32_dirent(ip->inum);
+    assert(memcmp(d.name, "QU", 2) == 0 && memcmp(d.name + 6, "~1PDF", 5) == 0);
+    iput(ip);
+
+    // The longest name there is, and one that isn't ASCII.
+    memset(name, 'x', LFN_MAX);
+    name[LFN_MAX] = 0;
+    iput(dirlink(dir, name, T_FILE));
+    snprintf(path, sizeof(path), "/Long Names/%s", name);
+    ip = namei(path);
+    assert(ip != NULL);
+    iput(ip);
+    iput(dirlink(dir, "r\xc3\xa9sum\xc3\xa9.txt", T_FILE));
+    ip = namei("/Long Names/r\xc3\xa9sum\xc3\xa9.txt");
+    assert(ip != NULL);
+    d = read_fat32_dirent(ip->inum);
+    assert(memcmp(d.name, "R_SUM_~1TXT", 11) == 0);
+    iput(ip);
+
+    name[LFN_MAX] = 'x';
+    name[LFN_MAX + 1] = 0;
+    assert(dirlink(dir, name, T_FILE) == NULL);
+    assert(dirlink(dir, "a:b", T_FILE) == NULL);
+
+    // Enough entries for the directory to get a name index.
+    for (u32 i = 0; i < 300; i++) {
+        snprintf(name, sizeof(name), "entry number %u with a long name", i);
+        iput(dirlink(dir, name, T_FILE));
+    }
+    for (u32 i = 0; i < 300; i += 7) {
+        snprintf(path, sizeof(path), "/Long Names/Entry Number %u with a long name", i);
+        ip = namei(path);
+        assert(ip != NULL);
+        iput(ip);
+    }
+
+    // Unlinking frees the whole run, and the name can come back.
+    assert(fat_unlink("/Long Names/entry number 42 with a long name") == 0);
+    assert(namei("/Long Names/entry number 42 with a long name") == NULL);
+    ip = dirlink(dir, "entry number 42 with a long name", T_FILE);
+    assert(ip != NULL);
+    iput(ip);
+    for (u32 i = 0; i < 300; i += 2) {
+        snprintf(path, sizeof(path), "/Long Names/entry number %u with a long name", i);
+        assert(fat_unlink(path) == 0);
+    }
+    assert(dir_compact(dir) > 0);
+    for (u32 i = 1; i < 300; i += 2) {
+        snprintf(path, sizeof(path), "/Long Names/entry number %u with a long name", i);
+        ip = namei(path);
+        assert(ip != NULL);
+        iput(ip);
+    }
+    ip = namei("/Long Names/entry number 42 with a long name");
+    assert(ip == NULL);
+    iput(dir);
+}
+
+void test_iflush() {
+    printf("iflush test\n");
+    char name[DIRSIZ], buf[64];
+    inode *dir = dirlink(namei("/"), "DIRTY", T_DIR);
+    inode *ips[8];
+    memset(buf, 'd', sizeof(buf));
+
+    // Small appends to files whose entries share a sector.
+    for (u32 i = 0; i < 8; i++) {
+        snprintf(name, sizeof(name), "D%u", i);
+        ips[i] = dirlink(dir, name, T_FILE);
+        assert(slot_sector(ips[i]->inum) == slot_sector(ips[0]->inum));
+    }
+    iflush();
+    u64 w0 = my_stats()->count[ST_BWRITE];
+    for (u32 k = 0; k < 16; k++) {
+        for (u32 i = 0; i < 8; i++) {
+            assert(writei(ips[i], 0, buf, k * sizeof(buf), sizeof(buf)) ==
+                   sizeof(buf));
         }
-        char name[12];
-        fat_decode_sfn(name, dirent);
-        printf("%s\n", name);
-    });
-}
\ No newline at end of file
+    }
+    u64 w1 = my_stats()->count[ST_BWRITE];
+    iflush();
+    u64 w2 = my_stats()->count[ST_BWRITE];
+    printf("appends: %llu bwrites, flush: %llu\n", w1 - w0, w2 - w1);
+    assert(w2 - w1 <= 1);
+    for (u32 i = 0; i < 8; i++) {
+        fat32_dirent d = read_fat32_dirent(ips[i]->inum);
+        assert(d.file_size == 16 * sizeof(buf));
+        assert(((d.fat_clus_hi << 16) | d.fat_clus_lo) == ips[i]->first);
+    }
+
+    // isync() writes back just the one, and so does the last iput().
+    assert(writei(ips[0], 0, buf, 16 * sizeof(buf), sizeof(buf)) == sizeof(buf));
+    isync(ips[0]);
+    assert(!ips[0]->dirty);
+    assert(read_fat32_dirent(ips[0]->inum).file_size == 17 * sizeof(buf));
+    assert(writei(ips[1], 0, buf, 16 * sizeof(buf), sizeof(buf)) == sizeof(buf));
+    u32 inum = ips[1]->inum;
+    for (u32 i = 0; i < 8; i++) {
+        iput(ips[i]);
+    }
+    assert(read_fat32_dirent(inum).file_size == 17 * sizeof(buf));
+
+    // An unlinked dirty inode is dropped, not written over the free slot.
+    inode *ip = dirlink(dir, "GONE", T_FILE);
+    assert(writei(ip, 0, buf, 0, sizeof(buf)) == sizeof(buf));
+    assert(fat_unlink("/DIRTY/GONE") == 0);
+    iput(ip);
+    iflush();
+    assert(namei("/DIRTY/GONE") == NULL);
+    iput(dir);
+}
+
+void test_times() {
+    printf("times test\n");
+    u16 today, now, yesterday, old = (20 << 9) | (1 << 5) | 1; // 2000-01-01
+    char buf[64];
+    fat_now(&today, &now);
+    fat_stamp(time(NULL) - 86400, &yesterday, &now);
+
+    // Creating sets all three.
+    inode *ip = dirlink(namei("/"), "STAMPED.TXT", T_FILE);
+    fat32_dirent d = read_fat32_dirent(ip->inum);
+    assert(d.crt_date == today && d.wrt_date == today && d.last_acc_date == today);
+    memset(buf, 't', sizeof(buf));
+    assert(writei(ip, 0, buf, 0, sizeof(buf)) == sizeof(buf));
+
+    // Lazy: reads and overwrites only write their data.
+    skinny_times = TIME_LAZY;
+    ip->mdate = ip->adate = old;
+    iupdate(ip);
+    isync(ip);
+    u64 w0 = my_stats()->count[ST_BWRITE];
+    for (u32 i = 0; i < 10; i++) {
+        assert(readi(ip, 0, buf, 0, sizeof(buf), NULL) == sizeof(buf));
+        assert(writei(ip, 0, buf, 0, sizeof(buf)) == sizeof(buf));
+    }
+    assert(my_stats()->count[ST_BWRITE] - w0 == 10);
+    assert(ip->adate == today && ip->mdate == today);
+    assert(ip->dirty & I_DIRTY_TIME);
+    isync(ip);
+    d = read_fat32_dirent(ip->inum);
+    assert(d.wrt_date == today && d.last_acc_date == today);
+
+    // Relatime: a recent access date stays until the file is modified.
+    skinny_times = TIME_RELATIME;
+    ip->mdate = old;
+    ip->adate = yesterday;
+    assert(readi(ip, 0, buf, 0, sizeof(buf), NULL) == sizeof(buf));
+    assert(ip->adate == yesterday);
+    ip->mdate = yesterday;
+    assert(readi(ip, 0, buf, 0, sizeof(buf), NULL) == sizeof(buf));
+    assert(ip->adate == today && (ip->dirty & I_DIRTY));
+
+    // Strict: the entry is written before the read returns.
+    skinny_times = TIME_STRICT;
+    ip->adate = old;
+    assert(readi(ip, 0, buf, 0, sizeof(buf), NULL) == sizeof(buf));
+    assert(!ip->dirty);
+    assert(read_fat32_dirent(ip->inum).last_acc_date == today);
+
+    skinny_times = TIME_RELATIME;
+    iput(ip);
+}
+
+void test_span() {
+    printf("span test\n");
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+    u32 size = 12 * cbytes + 100;
+    char *buf = malloc(size), *got = malloc(size);
+    assert(buf && got);
+    for (u32 i = 0; i < size; i++) {
+        buf[i] = i * 7 + i / cbytes;
+    }
+
+    // Two clusters at a time, with another file taking the ones between.
+    inode *dir = namei("/TEST_DIR");
+    inode *ip = dirlink(dir, "SPANNED.BIN", T_FILE);
+    inode *gap = dirlink(dir, "GAP.BIN", T_FILE);
+    for (u32 off = 0; off < size; off += 2 * cbytes) {
+        u32 n = min(2 * cbytes, size - off);
+        assert(writei(ip, 0, buf + off, off, n) == n);
+        assert(writei(gap, 0, buf, off, cbytes) == cbytes);
+    }
+    u32 nclus, extents = fat_chain_extents(ip->first, &nclus);
+
+    // The views cover the range in order, one per extent.
+    span_iter it;
+    span sp;
+    u32 off = 100, nspan = 0;
+    span_begin(&it, ip, off, size);
+    while (span_next(&it, &sp)) {
+        assert(sp.off == off);
+        memcpy(got + off, sp.data, sp.len);
+        off += sp.len;
+        nspan++;
+    }
+    printf("%u spans over %u extents\n", nspan, extents);
+    assert(off == size && nspan == extents);
+    assert(memcmp(got + 100, buf + 100, size - 100) == 0);
+
+    // Pinned, the clusters stay where they are.
+    assert(itruncate(ip, cbytes) == -1);
+    u64 bytes;
+    assert(irelocate(ip->inum, ip->first, &bytes) == -1);
+    assert(fat_chain_extents(ip->first, &nclus) == extents);
+
+    // And unlinking leaves them to the last span_end().
+    span_iter it2;
+    span_begin(&it2, ip, 0, cbytes);
+    assert(span_next(&it2, &sp) && sp.len == cbytes);
+    u32 before = fs_free_clusters();
+    assert(fat_unlink("/TEST_DIR/SPANNED.BIN") == 0);
+    assert(fs_free_clusters() == before);
+    span_end(&it);
+    fs_sync();
+    assert(fs_free_clusters() == before);
+    assert(memcmp(sp.data, buf, cbytes) == 0);
+    span_end(&it2);
+    fs_sync();
+    assert(fs_free_clusters() == before + nclus);
+
+    iput(ip);
+    iput(gap);
+    free(buf);
+    free(got);
+}
+
+void test_export() {
+    printf("export test\n");
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+    u32 size = 9 * cbytes + 33;
+    char *buf = malloc(size), *got = malloc(size);
+    assert(buf && got);
+    for (u32 i = 0; i < size; i++) {
+        buf[i] = i * 13 + i / cbytes;
+    }
+
+    inode *dir = namei("/TEST_DIR");
+    inode *ip = dirlink(dir, "EXPORT.BIN", T_FILE);
+    inode *gap = dirlink(dir, "EXGAP.BIN", T_FILE);
+    for (u32 off = 0; off < size; off += 3 * cbytes) {
+        u32 n = min(3 * cbytes, size - off);
+        assert(writei(ip, 0, buf + off, off, n) == n);
+        assert(writei(gap, 0, buf, off, cbytes) == cbytes);
+    }
+
+    // To a host file, and the range stops at EOF.
+    FILE *f = tmpfile();
+    assert(f);
+    assert(iexport(ip, 0, size, fileno(f)) == size);
+    assert(iexport(ip, 100, size, fileno(f)) == size - 100);
+    assert(pread(fileno(f), got, size, 0) == size);
+    assert(memcmp(got, buf, size) == 0);
+    assert(pread(fileno(f), got, size - 100, size) == size - 100);
+    assert(memcmp(got, buf + 100, size - 100) == 0);
+    fclose(f);
+
+    // To a pipe, which copy_file_range() doesn't take.
+    int p[2];
+    assert(pipe(p) == 0);
+    assert(iexport(ip, cbytes - 10, 2 * cbytes, p[1]) == 2 * cbytes);
+    assert(read(p[0], got, 2 * cbytes) == 2 * cbytes);
+    assert(memcmp(got, buf + cbytes - 10, 2 * cbytes) == 0);
+    close(p[0]);
+    close(p[1]);
+
+    iput(ip);
+    iput(gap);
+    free(buf);
+    free(got);
+}
+
+void test_icopy() {
+    printf("icopy test\n");
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+    u32 size = 10 * cbytes + 77;
+    char *buf = malloc(size), *got = malloc(size);
+    assert(buf && got);
+    for (u32 i = 0; i < size; i++) {
+        buf[i] = i * 5 + i / cbytes;
+    }
+
+    // A fragmented source, with clusters reserved past its end.
+    inode *dir = namei("/TEST_DIR");
+    inode *src = dirlink(dir, "TEMPLATE.BIN", T_FILE);
+    inode *gap = dirlink(dir, "CPGAP.BIN", T_FILE);
+    for (u32 off = 0; off < size; off += cbytes) {
+        u32 n = min(cbytes, size - off);
+        assert(writei(src, 0, buf + off, off, n) == n);
+        assert(writei(gap, 0, buf, off, cbytes) == cbytes);
+    }
+    assert(ifallocate(src, size + 4 * cbytes, FALLOC_KEEP_SIZE) == 0);
+    u32 nclus, free0 = fs_free_clusters();
+
+    inode *ip = icopy(src, dir, "Copy of template.bin");
+    assert(ip != NULL && ip->size == size);
+    assert(fat_chain_extents(ip->first, &nclus) == 1 && nclus == 11);
+    assert(fs_free_clusters() == free0 - 11);
+    assert(readi(ip, 0, got, 0, size, NULL) == size);
+    assert(memcmp(got, buf, size) == 0);
+    iput(ip);
+    ip = namei("/TEST_DIR/copy of template.bin");
+    assert(ip != NULL && ip->size == size);
+    iput(ip);
+
+    // Empty files copy too, bad names take nothing.
+    inode *empty = dirlink(dir, "EMPTY.BIN", T_FILE);
+    ip = icopy(empty, dir, "EMPTY2.BIN");
+    assert(ip != NULL && ip->size == 0 && ip->first == 0);
+    iput(ip);
+    free0 = fs_free_clusters();
+    assert(icopy(src, dir, "a:b") == NULL);
+    assert(fs_free_clusters() == free0);
+
+    iput(empty);
+    iput(src);
+    iput(gap);
+    free(buf);
+    free(got);
+}
+
+void test_namei_batch() {
+    printf("namei batch test\n");
+    char name[DIRSIZ];
+    inode *top = dirlink(namei("/"), "Batch", T_DIR);
+    inode *a = dirlink(top, "A", T_DIR);
+    inode *b = dirlink(top, "Bee hive", T_DIR);
+    for (u32 i = 0; i < 20; i++) {
+        snprintf(name, sizeof(name), "F%u.TXT", i);
+        iput(dirlink(a, name, T_FILE));
+        snprintf(name, sizeof(name), "bee number %u", i);
+        iput(dirlink(b, name, T_FILE));
+    }
+
+    char *paths[] = {
+        "/BATCH/A/F3.TXT",  "/batch/a/f3.txt",   "/Batch//A/F19.TXT/",
+        "/Batch/A/F20.TXT", "/Batch/Bee hive/bee number 7",
+        "/Batch/BEE HIVE/BEE NUMBER 12", "/Batch/Bee hive/BEENUM~1",
+        "/Batch/A/F3.TXT/X", "/Batch/A",         "/",
+        "relative/path",    "/Batch/A/.",        "/Batch/Nope/F1.TXT",
+        "/Batch/A-B",       "/Batch/A/F1.TXT",   "/TEST_DIR",
+    };
+    u32 n = sizeof(paths) / sizeof(paths[0]), got[16];
+
+    u64 l0 = my_stats()->count[ST_DIRLOOKUP];
+    namei_batch(paths, n, got);
+    u64 lookups = my_stats()->count[ST_DIRLOOKUP] - l0;
+
+    // Same answers as namei(), which doesn't take relative paths.
+    l0 = my_stats()->count[ST_DIRLOOKUP];
+    for (u32 i = 0; i < n; i++) {
+        inode *ip = paths[i][0] == '/' ? namei(paths[i]) : NULL;
+        printf("%-32s 0x%x\n", paths[i], got[i]);
+        assert(got[i] == (ip ? ip->inum : NAMEI_NONE));
+        if (ip) {
+            iput(ip);
+        }
+    }
+    u64 one_by_one = my_stats()->count[ST_DIRLOOKUP] - l0;
+    printf("%llu directory searches, %llu with namei()\n", lookups, one_by_one);
+    assert(lookups * 2 < one_by_one);
+
+    iput(a);
+    iput(b);
+    iput(top);
+}
+
+// Checks every count of the index against the FAT, returns the free
+// clusters there are.
+static u32 check_fat_index() {
+    u8 buf[BSIZE];
+    u32 nfree = 0;
+    pthread_mutex_lock(&fat_lock);
+    assert(fidx_done == ff->bpb.fat_sz_32);
+    for (u32 sec = 0; sec < ff->bpb.fat_sz_32; sec++) {
+        bread(buf, ff->bpb.rsvd_sec_cnt + sec, 1);
+        assert(fidx[sec] == fidx_count((fat_entry *)buf, sec));
+        assert(fidx[sec] == 0 || sec >= fidx_low);
+        nfree += fidx[sec];
+    }
+    pthread_mutex_unlock(&fat_lock);
+    return nfree;
+}
+
+void test_fat_index() {
+    printf("fat index test\n");
+    u32 cbytes = ff->bpb.sec_per_clus * BSIZE;
+    char *buf = malloc(300 * cbytes);
+    assert(buf);
+    memset(buf, 'i', 300 * cbytes);
+
+    fs_index_wait();
+    check_fat_index();
+
+    // Mount with no free count in FSInfo, and allocate while the index
+    // is being built.
+    u8 sec[BSIZE];
+    fs_sync();
+    bread(sec, ff->bpb.fs_info, 1);
+    *(u32 *)(sec + FSI_FREE_COUNT) = 0xffffffff;
+    bwrite(sec, ff->bpb.fs_info, 1);
+    init_fs(ff);
+
+    inode *dir = namei("/TEST_DIR");
+    inode *ip = dirlink(dir, "INDEXED.BIN", T_FILE);
+    for (u32 off = 0; off < 300 * cbytes; off += 7 * cbytes) {
+        u32 n = min(7 * cbytes, 300 * cbytes - off);
+        assert(writei(ip, 0, buf + off, off, n) == n);
+    }
+    reclaim_drain();
+    u32 nfree = fs_free_clusters();
+    fs_index_wait();
+    assert(check_fat_index() == nfree);
+
+    // With the index done, finding a free cluster reads one FAT sector.
+    u64 scan0 = my_stats()->count[ST_BALLOC_SCAN];
+    inode *more = dirlink(dir, "INDEXED2.BIN", T_FILE);
+    assert(writei(more, 0, buf, 0, cbytes) == cbytes);
+    u64 scanned = my_stats()->count[ST_BALLOC_SCAN] - scan0;
+    printf("free: %u, FAT entries scanned: %llu\n", nfree, scanned);
+    assert(scanned <= 2 * FAT_EPS);
+
+    assert(fat_unlink("/TEST_DIR/INDEXED.BIN") == 0);
+    assert(fat_unlink("/TEST_DIR/INDEXED2.BIN") == 0);
+    iput(ip);
+    iput(more);
+    iput(dir);
+    fs_sync();
+    assert(check_fat_index() == fs_free_clusters());
+    free(buf);
+}
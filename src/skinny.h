@@ -15,7 +15,8 @@ typedef unsigned long long  u64;
 typedef unsigned long long  usize;
 typedef long long           isize;
 
-#define DIRSIZ 12
+#define DIRSIZ 256 // Longest name in UTF-8 plus the terminator
+#define SFNSIZ 13  // 8.3 plus the dot and the terminator
 
 /* Boringly bad interface implementation to the FAT32 filesystem. */
 /* You can't find a worse version than mine. */
@@ -52,6 +53,10 @@ typedef struct __attribute__((__packed__)) fat32_bpb {
 typedef struct fat32 {
     fat32_bpb bpb;
     u32       rootdir_base_sec;
+    u32       nclus;         // Data clusters, valid numbers are 2..nclus+1
+    u32       free_clus;     // Free clusters, kept in step with the FAT
+    u32       next_free;     // FSInfo hint, one past the last allocation
+    int       fsinfo_dirty;  // FSInfo on disk lags the two above
 } fat32;
 
 #define ATTR_READ_ONLY 0x01
@@ -77,37 +82,278 @@ typedef struct __attribute__((__packed__)) fat32_dirent {
     u32  file_size;
 } fat32_dirent;
 
+// A long name is kept in a run of these right in front of its short
+// entry, the last part first. Each holds 13 UCS-2 characters; the name
+// ends in a 0x0000 if it doesn't fill the last part, the rest is 0xffff.
+typedef struct __attribute__((__packed__)) fat32_lfn {
+    u8  ord;         // Position in the name from 1, LFN_LAST on the first
+    u16 name1[5];
+    u8  attr;        // ATTR_LONG_NAME
+    u8  type;
+    u8  chksum;      // fat_sfn_checksum() of the short entry
+    u16 name2[6];
+    u16 fat_clus_lo; // Always 0
+    u16 name3[2];
+} fat32_lfn;
+
+#define LFN_LAST    0x40
+#define LFN_CHARS   13  // Characters per entry
+#define LFN_MAX     255 // Characters in a long name
+#define LFN_RUN_MAX ((LFN_MAX + LFN_CHARS - 1) / LFN_CHARS)
+
 // TODO: Support more types of files
 #define DT_DIR 0x01 // Directory
 #define DT_REG 0x02 // Regular file
 
-// Funny "variable length" sturcture?
-// @NOTE: No variable length struct for now, we only support FAT32
-// and short name, so we reserve 8.3.1 (plus the terminator) chars.
+// Variable length, d_reclen covers the name and its terminator.
 typedef struct linux_dirent64 {
     u64  d_ino;           /* 64-bit inode number */
     u64  d_off;           /* 64-bit offset to next structure */
     u16  d_reclen;        /* Size of this dirent */
     u8   d_type;          /* File type: DT_DIR or DT_REG */
-    char d_name[12];      /* Filename (null-terminated) */
+    char d_name[];        /* Filename (null-terminated) */
 } linux_dirent64;
 
+// Mounts the image: reads the BPB and FSInfo and returns. The free space
+// index is built by a thread of its own; until it is done, allocation
+// reads the FAT sectors it hasn't reached.
 void init_fs(fat32 *fs);
+
+// Writes back dirty inodes, waits for pending reclamation and the free
+// space index, and writes the free-space accounting back to the FSInfo
+// sector.
+void fs_sync();
+
+// Returns the number of free clusters, including those still being
+// reclaimed. If FSInfo had no count, waits for the index to provide it.
+u32 fs_free_clusters();
+
+// Waits until the free space index covers the whole FAT.
+void fs_index_wait();
 isize getdents(int fd, void *dirp, usize count);
 
+// Decodes the 8.3 name of `dent` into `name`, which must hold SFNSIZ bytes.
+void fat_decode_sfn(char *name, fat32_dirent *dent);
+
+// Encodes `name` into the 11-byte 8.3 form at `res`.
+// Returns -1 if the name does not fit 8.3.
+u32 fat_encode_sfn(void *res, const char *name);
+
+// Long names are UTF-8 here, limited to the Basic Multilingual Plane, and
+// compared ignoring the case of ASCII letters.
+
+u8 fat_sfn_checksum(const char *sfn);
+
+// Returns the number of long name entries UTF-8 `name` needs in front of
+// its short entry, 0 for an upper case 8.3 name, or -1 if it can't be a
+// file name.
+int fat_lfn_count(const char *name);
+
+// Writes the `k`th candidate 8.3 alias for long name `name` to `sfn`: for
+// k == 0 just the upper cased name if it fits, otherwise a "~k" one.
+// Returns -1 if there is no such candidate. The caller picks the first
+// one not already used in the directory.
+int fat_sfn_alias(const char *name, u32 k, char *sfn);
+
+// Fills the fat_lfn_count(name) entries that go in front of short name
+// `sfn`, in on-disk order.
+void fat_lfn_fill(fat32_dirent *ents, const char *name, const char *sfn);
+
 #define T_DIR  0x01
 #define T_FILE 0x02
 #define T_DEV  0x03
 
 
+// An inum says where a dir entry is: its cluster shifted up by
+// INUM_OFF_BITS, plus its byte offset in the cluster. So a cluster is at
+// most 4K, and directories only get clusters below INUM_CLUS_END.
+#define INUM_OFF_BITS 12
+#define INUM_CLUS_END (1u << (32 - INUM_OFF_BITS))
+
 // Simplified inode
 typedef struct inode {
     u32 inum;
     u32 size;
     u32 type;
-    struct inode *parent;
+    u32 first;            // First data cluster, 0 if none
+    struct inode *parent; // Holds a reference, set by path lookups
+    u32 ref;              // Holders, see iget() and iput()
+    int dead;             // Entry was deleted, no longer in the cache
+    u32 pins;             // Open span iterators, see span_begin()
+    int orphan;           // Deleted while pinned, clusters not freed yet
+    struct inode *next;   // Inode cache hash chain
+    u16 mdate, mtime;     // Modify time, FAT encoded
+    u16 adate;            // Access date, FAT encoded
+    int dirty;            // I_DIRTY and I_DIRTY_TIME bits
+    struct inode *dnext;  // Dirty list, see iupdate()
+    struct inode **dprev;
+    u32 tail_first;       // `first` when the chain tail below was taken
+    u32 tail;             // Last cluster of the chain
+    u32 nclus;            // Clusters in the chain
 } inode;
 
+#define I_DIRTY      0x01 // Size or first cluster not written back yet
+#define I_DIRTY_TIME 0x02 // Only times changed, see TIME_LAZY
+
+// Set to zero to silence the engine's debug output.
+extern int skinny_debug;
+
+// How reads and writes of files keep their times. Directories don't get
+// them.
+#define TIME_STRICT   0 // The dir entry is written at once on every change
+#define TIME_RELATIME 1 // Access date only once the file was modified since
+                        // or a day went by, written back like the size
+#define TIME_LAZY     2 // Times stay in the inode until it is written back
+                        // for something else, or within LAZYTIME_MS
+
+// One of the above, TIME_RELATIME unless set.
+extern int skinny_times;
+
+// Serializes the front ends (sq, the server, defrag) that call into the
+// engine from several threads. Reads and lookups take it shared, whatever
+// writes a file or changes the tree takes it alone. The inode flusher and
+// the reclaimer don't need it: they only write back dir entries and free
+// unlinked chains, under the engine's own locks.
+void engine_rdlock(void);
+void engine_wrlock(void);
+void engine_unlock(void);
+
+// Returns the in-memory inode for `inum`, 0 being the root directory.
+// There is one per inum, shared by everyone who holds it; each iget()
+// or idup() is paired with an iput().
+inode *iget(u32 dev, u32 inum);
+inode *idup(inode *ip);
+void iput(inode *ip);
+
+int readi(struct inode *ip, int user_dst, void *dst, u32 off, u32 n,
+          u32 *inum);
+int writei(struct inode *ip, int user_src, void *src, u32 off, u32 n);
+void itrunc(inode *ip);
+
+#define IFLUSH_MS   1000  // How long the flusher lets an inode stay dirty
+#define LAZYTIME_MS 60000 // Same for inodes with nothing but new times
+
+// Marks `ip` dirty. Its size and first cluster go back to its dir entry
+// on isync(), iflush() or its last iput(), or else from the background
+// flusher within IFLUSH_MS.
+void iupdate(struct inode *ip);
+
+// Writes `ip` back now if it is dirty.
+void isync(inode *ip);
+
+// Writes back every dirty inode, one write per sector of dir entries.
+void iflush();
+
+// Shrinks or extends `ip` to `len` bytes. Returns 0, or -1 if the disk
+// is full, a pinned file would shrink or `ip` is a directory and would
+// shrink; dir_compact() gives back their empty clusters. Directories
+// grow in whole clusters. Shrinking also drops clusters reserved past
+// EOF, growing keeps them.
+int itruncate(inode *ip, u32 len);
+
+#define FALLOC_KEEP_SIZE 0x01 // Reserve clusters without changing the size
+
+// Makes sure clusters back the first `len` bytes of file `ip`, taking
+// them as one contiguous run where the free space allows. The size grows
+// to `len` and the new bytes read as zeros, unless FALLOC_KEEP_SIZE is
+// given; then the clusters stay reserved past EOF and are only zeroed
+// once the file grows into them. Returns 0, or -1 if the disk is full.
+int ifallocate(inode *ip, u32 len, int flags);
+
+// A read-only view of file data in place in the mapped image.
+typedef struct span {
+    const void *data;
+    u32 off; // Where `data` is in the file
+    u32 len;
+} span;
+
+typedef struct span_iter {
+    inode *ip;
+    u32 off;  // Next byte to hand out
+    u32 end;
+    u32 clus; // Cluster holding `off`, 0 when done
+} span_iter;
+
+// Pins file `ip` and starts at byte `off`, going on for `n` bytes or up
+// to EOF. span_next() then hands out one view per run of contiguous
+// clusters, so the data can be hashed or sent without copying it.
+// While pinned the clusters stay put: shrinking fails, irelocate()
+// leaves the file alone, and if it is unlinked they are freed only
+// once the last span_end() unpins it. Writes do show through.
+void span_begin(span_iter *it, inode *ip, u32 off, u32 n);
+
+// Stores the next view in `*sp`. Returns 0 once the range is done.
+int span_next(span_iter *it, span *sp);
+
+// Unpins. The views from span_next() are not to be used after this.
+void span_end(span_iter *it);
+
+// Writes `n` bytes of file `ip` from `off` on, or up to EOF, to the host
+// file or socket `fd` at its current position. Each extent goes from the
+// image to `fd` in one bexport(), without passing through a buffer here.
+// Returns the bytes written, or -1.
+long iexport(inode *ip, u32 off, u32 n, int fd);
+
+// Counts the contiguous runs in the chain starting at `clus`, and stores
+// its length in `*nclus`.
+u32 fat_chain_extents(u32 clus, u32 *nclus);
+
+// Moves the clusters of the file or directory whose dir entry is `inum`
+// and starts at `first` into one contiguous run, storing the bytes copied
+// in `*bytes`. Returns the number of clusters moved, 0 if it already was
+// contiguous, or -1 if no free run is long enough, somebody holds the
+// inode, pinned or not, or the slot no longer holds that entry.
+// iget() of it waits until the move is done. Moving a directory changes
+// the inums of everything in it; held inodes follow, saved inums don't.
+int irelocate(u32 inum, u32 first, u64 *bytes);
+
+struct inode *namei(char *path);
+struct inode *nameiparent(char *path, char *name);
+
+#define NAMEI_NONE 0xffffffff // No such path, see namei_batch()
+
+// Looks up the `n` absolute `paths` and stores the inum of each in
+// `inums`, or NAMEI_NONE. Directories shared by several paths are looked
+// up once, and searched once for all the names wanted in them.
+void namei_batch(char **paths, u32 n, u32 *inums);
+// Finds `name` in `dir`, by its long name or its 8.3 alias.
+inode *fat_dirlookup(inode *dir, char *name);
+
+// Returns the inode of the newly created dir entry, or NULL if `name`
+// is not a valid name or the disk is full. Names that aren't upper case
+// 8.3 get a long name and a unique "~N" short alias.
+inode *dirlink(inode *dir, char *name, u32 inode_type);
+
+// Copies file `src` to a new file `name` in `dir`, like dirlink(). The
+// copy gets clusters in as few runs as the free space allows, and the
+// data moves extent to extent within the image.
+inode *icopy(inode *src, inode *dir, char *name);
+
+// An entry of a directory as dir_list() hands it out.
+typedef struct dir_entry {
+    const char *name; // Long name if it has one, else the 8.3 one
+    u32 inum;
+    u32 type;         // T_FILE or T_DIR
+    u32 size;         // Also if only the held inode knows it yet
+} dir_entry;
+
+typedef void (*dir_fn)(dir_entry *e, void *arg);
+
+// Calls `fn` for every file and directory in `dp`, in on-disk order,
+// "." and ".." left out.
+void dir_list(inode *dp, dir_fn fn, void *arg);
+
+// Remove the file or empty directory at `path`, returning 0 or -1.
+// Only the dir entry is touched before returning, the clusters are
+// freed in the background but counted by fs_free_clusters() at once.
+int fat_unlink(char *path);
+int fat_rmdir(char *path);
+
+// Packs the live entries of `dp` to the front, moves the end marker after
+// them and gives back the clusters no longer needed. Held inodes of moved
+// entries get their new inums. Returns the number of clusters released.
+int dir_compact(inode *dp);
+
 #define SCAN_BREAK 0
 #define SCAN_CONT  1
 
@@ -0,0 +1,469 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sq.h>
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+
+// The ops of one sq_submit(), freed once all its groups ran.
+typedef struct sq_batch {
+    sq_op *ops;
+    u32 left; // Groups not run yet
+} sq_batch;
+
+// A run of sorted ops of one kind on one inode, or all the lookups.
+typedef struct sq_group {
+    struct sq_group *next;
+    sq_batch *batch;
+    sq_op *ops;
+    u32 n;
+} sq_group;
+
+struct sq {
+    pthread_mutex_t lock;
+    pthread_cond_t work; // A group was queued, or the queue is closing
+    pthread_cond_t done; // Completions were posted
+    sq_group *head, *tail;
+    sq_cqe *cqes;
+    u32 ncqe, cap;
+    u32 pending; // Ops submitted and not completed
+    int closing;
+    pthread_t *threads;
+    u32 nthreads;
+};
+
+static u32 op_len(sq_op *o) {
+    u64 len = 0;
+    for (u32 i = 0; i < o->niov; i++) {
+        len += o->iov[i].iov_len;
+    }
+    return min(len, 0xffffffffull);
+}
+
+// Lookups first, then by where the data of the inode starts on disk, then
+// by offset in it.
+static int cmp_op(const void *a, const void *b) {
+    const sq_op *x = a, *y = b;
+    if (x->op != y->op) {
+        return (x->op == SQ_LOOKUP) ? -1 : (y->op == SQ_LOOKUP) ? 1 : x->op - y->op;
+    }
+    if (x->op == SQ_LOOKUP) {
+        return 0;
+    }
+    if (x->ip->first != y->ip->first) {
+        return (x->ip->first > y->ip->first) - (x->ip->first < y->ip->first);
+    }
+    if (x->ip != y->ip) {
+        return ((uintptr_t)x->ip > (uintptr_t)y->ip) -
+               ((uintptr_t)x->ip < (uintptr_t)y->ip);
+    }
+    return (x->off > y->off) - (x->off < y->off);
+}
+
+// Copies `len` bytes from `src` to byte `at` of the buffers of `o`.
+static void iov_put(sq_op *o, u32 at, const u8 *src, u32 len) {
+    for (u32 i = 0; i < o->niov && len > 0; i++) {
+        if (at >= o->iov[i].iov_len) {
+            at -= o->iov[i].iov_len;
+            continue;
+        }
+        u32 m = min(len, o->iov[i].iov_len - at);
+        memcpy((u8 *)o->iov[i].iov_base + at, src, m);
+        src += m;
+        len -= m;
+        at = 0;
+    }
+}
+
+// Reads of one file, sorted by offset: one pass over the extents of the
+// range they cover, each handing its bytes to whichever reads want them.
+static void run_reads(sq_op *ops, u32 n, sq_cqe *out) {
+    inode *ip = ops[0].ip;
+
+    if (ip->type != T_FILE) {
+        for (u32 i = 0; i < n; i++) {
+            u32 off = ops[i].off;
+            out[i].res = 0;
+            for (u32 k = 0; k < ops[i].niov; k++) {
+                int got = readi(ip, 0, ops[i].iov[k].iov_base, off,
+                                ops[i].iov[k].iov_len, NULL);
+                out[i].res += got;
+                off += got;
+                if (got < ops[i].iov[k].iov_len) {
+                    break;
+                }
+            }
+        }
+        return;
+    }
+
+    u64 lo = ops[0].off, hi = lo;
+    for (u32 i = 0; i < n; i++) {
+        hi = max(hi, (u64)ops[i].off + op_len(&ops[i]));
+    }
+
+    span_iter it;
+    span sp;
+    span_begin(&it, ip, lo, min(hi - lo, 0xffffffffull));
+    u32 end = it.end, first = 0;
+    while (span_next(&it, &sp)) {
+        u64 s0 = sp.off, s1 = (u64)sp.off + sp.len;
+        while (first < n && ops[first].off + (u64)op_len(&ops[first]) <= s0) {
+            first++;
+        }
+        for (u32 i = first; i < n && ops[i].off < s1; i++) {
+            u64 a = max(s0, ops[i].off);
+            u64 b = min(s1, (u64)ops[i].off + op_len(&ops[i]));
+            if (a < b) {
+                iov_put(&ops[i], a - ops[i].off, (u8 *)sp.data + (a - s0), b - a);
+            }
+        }
+    }
+    span_end(&it);
+
+    for (u32 i = 0; i < n; i++) {
+        out[i].res = ops[i].off < end ? min(op_len(&ops[i]), end - ops[i].off) : 0;
+    }
+}
+
+// Writes to one file, sorted by offset. Whatever they add to the file is
+// reserved in one go, so it comes in as few runs as possible.
+static void run_writes(sq_op *ops, u32 n, sq_cqe *out) {
+    inode *ip = ops[0].ip;
+    u64 hi = 0;
+    for (u32 i = 0; i < n; i++) {
+        hi = max(hi, (u64)ops[i].off + op_len(&ops[i]));
+    }
+    if (ip->type == T_FILE && hi > ip->size && hi <= 0xffffffffull) {
+        // If this fails, so do the writes that needed it.
+        ifallocate(ip, hi, FALLOC_KEEP_SIZE);
+    }
+
+    for (u32 i = 0; i < n; i++) {
+        u32 off = ops[i].off;
+        out[i].res = 0;
+        for (u32 k = 0; k < ops[i].niov; k++) {
+            u32 len = ops[i].iov[k].iov_len;
+            if (writei(ip, 0, ops[i].iov[k].iov_base, off, len) != len) {
+                out[i].res = -1;
+                break;
+            }
+            out[i].res += len;
+            off += len;
+        }
+    }
+}
+
+// dirlink() doesn't look for the name, so a name that is taken fails
+// here, also when an earlier op of the batch took it.
+static void run_creates(sq_op *ops, u32 n, sq_cqe *out) {
+    for (u32 i = 0; i < n; i++) {
+        inode *old = fat_dirlookup(ops[i].ip, ops[i].name);
+        if (old) {
+            iput(old);
+            out[i].ip = NULL;
+        } else {
+            out[i].ip = dirlink(ops[i].ip, ops[i].name, ops[i].type);
+        }
+        out[i].res = out[i].ip ? 0 : -1;
+    }
+}
+
+static void run_lookups(sq_op *ops, u32 n, sq_cqe *out) {
+    char **paths = malloc(n * sizeof(char *));
+    u32 *inums = malloc(n * sizeof(u32));
+    assert(paths && inums);
+
+    for (u32 i = 0; i < n; i++) {
+        paths[i] = ops[i].name;
+    }
+    namei_batch(paths, n, inums);
+    for (u32 i = 0; i < n; i++) {
+        out[i].ip = inums[i] == NAMEI_NONE ? NULL : iget(0, inums[i]);
+        out[i].res = out[i].ip ? 0 : -1;
+    }
+    free(paths);
+    free(inums);
+}
+
+static void run_group(sq *q, sq_group *g) {
+    sq_cqe *out = calloc(g->n, sizeof(sq_cqe));
+    assert(out);
+    int op = g->ops[0].op;
+
+    if (op == SQ_READ || op == SQ_LOOKUP) {
+        engine_rdlock();
+    } else {
+        engine_wrlock();
+    }
+    switch (op) {
+    case SQ_READ:
+        run_reads(g->ops, g->n, out);
+        break;
+    case SQ_WRITE:
+        run_writes(g->ops, g->n, out);
+        break;
+    case SQ_CREATE:
+        run_creates(g->ops, g->n, out);
+        break;
+    case SQ_LOOKUP:
+        run_lookups(g->ops, g->n, out);
+        break;
+    default:
+        assert(0 && "sq: unknown op");
+    }
+    engine_unlock();
+
+    for (u32 i = 0; i < g->n; i++) {
+        out[i].user = g->ops[i].user;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    if (q->ncqe + g->n > q->cap) {
+        q->cap = max(q->ncqe + g->n, q->cap * 2);
+        q->cqes = realloc(q->cqes, q->cap * sizeof(sq_cqe));
+        assert(q->cqes);
+    }
+    memcpy(q->cqes + q->ncqe, out, g->n * sizeof(sq_cqe));
+    q->ncqe += g->n;
+    q->pending -= g->n;
+    if (--g->batch->left == 0) {
+        free(g->batch->ops);
+        free(g->batch);
+    }
+    pthread_cond_broadcast(&q->done);
+    pthread_mutex_unlock(&q->lock);
+
+    free(out);
+    free(g);
+}
+
+static void *sq_worker(void *arg) {
+    sq *q = arg;
+
+    pthread_mutex_lock(&q->lock);
+    for (;;) {
+        while (q->head == NULL && !q->closing) {
+            pthread_cond_wait(&q->work, &q->lock);
+        }
+        sq_group *g = q->head;
+        if (g == NULL) {
+            break;
+        }
+        q->head = g->next;
+        if (q->head == NULL) {
+            q->tail = NULL;
+        }
+        pthread_mutex_unlock(&q->lock);
+        run_group(q, g);
+        pthread_mutex_lock(&q->lock);
+    }
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+sq *sq_open(u32 workers) {
+    sq *q = calloc(1, sizeof(sq));
+    assert(q && workers > 0);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->work, NULL);
+    pthread_cond_init(&q->done, NULL);
+
+    q->threads = malloc(workers * sizeof(pthread_t));
+    assert(q->threads);
+    q->nthreads = workers;
+    for (u32 i = 0; i < workers; i++) {
+        assert(pthread_create(&q->threads[i], NULL, sq_worker, q) == 0);
+    }
+    return q;
+}
+
+void sq_submit(sq *q, sq_op *ops, u32 n) {
+    if (n == 0) {
+        return;
+    }
+    sq_batch *b = malloc(sizeof(sq_batch));
+    assert(b);
+    b->ops = malloc(n * sizeof(sq_op));
+    assert(b->ops);
+    memcpy(b->ops, ops, n * sizeof(sq_op));
+    qsort(b->ops, n, sizeof(sq_op), cmp_op);
+
+    // Cut into groups before anything runs, so `left` is right.
+    sq_group *first = NULL, **tail = &first;
+    b->left = 0;
+    for (u32 i = 0; i < n;) {
+        u32 j = i + 1;
+        while (j < n && b->ops[j].op == b->ops[i].op &&
+               (b->ops[i].op == SQ_LOOKUP || b->ops[j].ip == b->ops[i].ip)) {
+            j++;
+        }
+        sq_group *g = malloc(sizeof(sq_group));
+        assert(g);
+        g->next = NULL;
+        g->batch = b;
+        g->ops = &b->ops[i];
+        g->n = j - i;
+        *tail = g;
+        tail = &g->next;
+        b->left++;
+        i = j;
+    }
+
+    pthread_mutex_lock(&q->lock);
+    q->pending += n;
+    if (q->tail) {
+        q->tail->next = first;
+    } else {
+        q->head = first;
+    }
+    for (q->tail = first; q->tail->next; q->tail = q->tail->next) {
+    }
+    pthread_cond_broadcast(&q->work);
+    pthread_mutex_unlock(&q->lock);
+}
+
+u32 sq_reap(sq *q, sq_cqe *cqes, u32 min_n, u32 max_n) {
+    pthread_mutex_lock(&q->lock);
+    while (q->ncqe < min_n && q->pending > 0) {
+        pthread_cond_wait(&q->done, &q->lock);
+    }
+    u32 n = min(q->ncqe, max_n);
+    memcpy(cqes, q->cqes, n * sizeof(sq_cqe));
+    memmove(q->cqes, q->cqes + n, (q->ncqe - n) * sizeof(sq_cqe));
+    q->ncqe -= n;
+    pthread_mutex_unlock(&q->lock);
+    return n;
+}
+
+void sq_close(sq *q) {
+    pthread_mutex_lock(&q->lock);
+    while (q->pending > 0) {
+        pthread_cond_wait(&q->done, &q->lock);
+    }
+    q->closing = 1;
+    pthread_cond_broadcast(&q->work);
+    pthread_mutex_unlock(&q->lock);
+
+    for (u32 i = 0; i < q->nthreads; i++) {
+        pthread_join(q->threads[i], NULL);
+    }
+    for (u32 i = 0; i < q->ncqe; i++) {
+        if (q->cqes[i].ip) {
+            iput(q->cqes[i].ip);
+        }
+    }
+    pthread_mutex_destroy(&q->lock);
+    pthread_cond_destroy(&q->work);
+    pthread_cond_destroy(&q->done);
+    free(q->threads);
+    free(q->cqes);
+    free(q);
+}
+
+void test_sq() {
+    printf("submission queue test\n");
+    enum { NFILES = 40, FSIZE = 700 };
+    char name[DIRSIZ], path[NFILES][32];
+    static u8 data[NFILES][FSIZE], got[NFILES][FSIZE];
+    inode *files[NFILES];
+    sq_op ops[3 * NFILES];
+    struct iovec iov[NFILES][3];
+    sq_cqe cqes[3 * NFILES];
+    sq *q = sq_open(4);
+
+    // Create them all in one batch.
+    inode *dir = dirlink(namei("/"), "SQ", T_DIR);
+    for (u32 i = 0; i < NFILES; i++) {
+        snprintf(name, sizeof(name), "F%u", i);
+        ops[i] = (sq_op){.op = SQ_CREATE, .ip = dir, .name = strdup(name),
+                         .type = T_FILE, .user = i};
+    }
+    sq_submit(q, ops, NFILES);
+    assert(sq_reap(q, cqes, NFILES, NFILES) == NFILES);
+    for (u32 i = 0; i < NFILES; i++) {
+        assert(cqes[i].res == 0 && cqes[i].ip);
+        files[cqes[i].user] = cqes[i].ip;
+    }
+    for (u32 i = 0; i < NFILES; i++) {
+        free(ops[i].name);
+    }
+
+    // A name that is taken can't be created again.
+    ops[0] = (sq_op){.op = SQ_CREATE, .ip = dir, .name = "F0", .type = T_FILE};
+    sq_submit(q, ops, 1);
+    assert(sq_reap(q, cqes, 1, 1) == 1);
+    assert(cqes[0].res == -1 && cqes[0].ip == NULL);
+
+    // Write each from three buffers, two files to an op.
+    for (u32 i = 0; i < NFILES; i++) {
+        for (u32 k = 0; k < FSIZE; k++) {
+            data[i][k] = i * 31 + k;
+        }
+        iov[i][0] = (struct iovec){data[i], 100};
+        iov[i][1] = (struct iovec){data[i] + 100, 1};
+        iov[i][2] = (struct iovec){data[i] + 101, FSIZE - 101};
+        ops[i] = (sq_op){.op = SQ_WRITE, .ip = files[i], .off = 0,
+                         .iov = iov[i], .niov = 3, .user = i};
+    }
+    sq_submit(q, ops, NFILES);
+    assert(sq_reap(q, cqes, NFILES, 3 * NFILES) == NFILES);
+    for (u32 i = 0; i < NFILES; i++) {
+        assert(cqes[i].res == FSIZE);
+        assert(files[i]->size == FSIZE);
+    }
+
+    // Read them back in pieces that overlap and run past EOF, and look
+    // them up along the way.
+    struct iovec riov[NFILES][3];
+    u32 nops = 0;
+    for (u32 i = 0; i < NFILES; i++) {
+        riov[i][0] = (struct iovec){got[i], 300};
+        riov[i][1] = (struct iovec){got[i] + 250, 200};
+        riov[i][2] = (struct iovec){got[i] + 450, FSIZE};
+        ops[nops++] = (sq_op){.op = SQ_READ, .ip = files[i], .off = 0,
+                              .iov = riov[i], .niov = 1, .user = 3 * i};
+        ops[nops++] = (sq_op){.op = SQ_READ, .ip = files[i], .off = 250,
+                              .iov = riov[i] + 1, .niov = 2, .user = 3 * i + 1};
+        snprintf(path[i], sizeof(path[i]), "/SQ/F%u", i);
+        ops[nops++] = (sq_op){.op = SQ_LOOKUP, .name = path[i], .user = 3 * i + 2};
+    }
+    sq_submit(q, ops, nops);
+    u32 n = 0;
+    while (n < nops) {
+        n += sq_reap(q, cqes + n, 1, nops - n);
+    }
+    for (u32 i = 0; i < nops; i++) {
+        u32 f = cqes[i].user / 3;
+        switch (cqes[i].user % 3) {
+        case 0:
+            assert(cqes[i].res == 300);
+            break;
+        case 1:
+            assert(cqes[i].res == FSIZE - 250);
+            break;
+        case 2:
+            assert(cqes[i].ip == files[f]);
+            iput(cqes[i].ip);
+            break;
+        }
+    }
+    for (u32 i = 0; i < NFILES; i++) {
+        assert(memcmp(got[i], data[i], FSIZE) == 0);
+        iput(files[i]);
+    }
+
+    // A missing path completes with an error, not at all is no option.
+    ops[0] = (sq_op){.op = SQ_LOOKUP, .name = "/SQ/NOPE", .user = 7};
+    sq_submit(q, ops, 1);
+    assert(sq_reap(q, cqes, 1, 1) == 1);
+    assert(cqes[0].res == -1 && cqes[0].ip == NULL && cqes[0].user == 7);
+
+    sq_close(q);
+    iput(dir);
+}
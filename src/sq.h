@@ -0,0 +1,61 @@
+#pragma once
+
+#include <sys/uio.h>
+
+#include <skinny.h>
+
+// Submission queue.
+//
+// Callers hand over batches of operations and collect completions later,
+// while a pool of workers runs them. Each batch is sorted so that work on
+// the same file or directory sits together, in disk order, and then run a
+// group at a time:
+//  - reads of a file become one pass over its extents with span_next(),
+//    copied out into every read's iovecs,
+//  - writes to a file reserve what they all need with one ifallocate(),
+//  - lookups all go to a single namei_batch().
+// Reads and lookups run side by side, writes and creates one at a time.
+// Operations of a batch, or of batches not yet reaped, may run in any
+// order; reap one before submitting another that depends on it.
+
+enum {
+    SQ_READ,   // readi() into `iov`
+    SQ_WRITE,  // writei() from `iov`
+    SQ_CREATE, // dirlink() of `name` in `ip`
+    SQ_LOOKUP, // namei() of `name`
+};
+
+typedef struct sq_op {
+    int op;
+    inode *ip;         // File read or written, or directory created in
+    u32 off;           // Where in the file reads and writes start
+    struct iovec *iov; // Buffers reads fill and writes take, in order
+    u32 niov;
+    char *name;        // Name to create, or path to look up
+    u32 type;          // T_FILE or T_DIR for creates
+    u64 user;          // Handed back in the completion
+} sq_op;
+
+typedef struct sq_cqe {
+    u64 user;
+    long res;  // Bytes read or written, or 0; -1 if the operation failed
+    inode *ip; // Created or found, which the caller iput()s
+} sq_cqe;
+
+typedef struct sq sq;
+
+// Starts a queue with `workers` threads.
+sq *sq_open(u32 workers);
+
+// Queues `n` operations and returns. The `iov` arrays, their buffers and
+// the names must stay around until the completions are reaped, the ops
+// array itself needn't.
+void sq_submit(sq *q, sq_op *ops, u32 n);
+
+// Waits until at least `min` completions are there, and stores up to
+// `max` of them in `cqes`. Returns how many it stored.
+u32 sq_reap(sq *q, sq_cqe *cqes, u32 min, u32 max);
+
+// Waits for everything submitted, then stops the workers. Completions not
+// reaped are dropped, inodes in them released.
+void sq_close(sq *q);
@@ -0,0 +1,141 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <stats.h>
+
+__thread stats *stats_tls;
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static stats *stats_list;
+
+static const char *stat_names[NSTAT] = {
+    [ST_BREAD] = "bread",
+    [ST_BREAD_BYTES] = "bread_bytes",
+    [ST_BWRITE] = "bwrite",
+    [ST_BWRITE_BYTES] = "bwrite_bytes",
+    [ST_BMOVE] = "bmove",
+    [ST_BMOVE_BYTES] = "bmove_bytes",
+    [ST_BVIEW] = "bview",
+    [ST_BVIEW_BYTES] = "bview_bytes",
+    [ST_BEXPORT] = "bexport",
+    [ST_BEXPORT_BYTES] = "bexport_bytes",
+    [ST_FAT_READ] = "fat_read",
+    [ST_FAT_WRITE] = "fat_write",
+    [ST_CHAIN_WALK] = "chain_walk",
+    [ST_CHAIN_STEP] = "chain_step",
+    [ST_BALLOC] = "balloc",
+    [ST_BALLOC_SCAN] = "balloc_scan",
+    [ST_BALLOC_SKIP] = "balloc_skip",
+    [ST_FAT_INDEX] = "fat_index",
+    [ST_DIRLOOKUP] = "dirlookup",
+    [ST_DIRLOOKUP_SCAN] = "dirlookup_scan",
+    [ST_RECLAIM] = "reclaim",
+    [ST_IFLUSH] = "iflush",
+};
+
+static const char *hist_names[NHIST] = {
+    [H_READI] = "readi_ns",
+    [H_WRITEI] = "writei_ns",
+    [H_NAMEI] = "namei_ns",
+    [H_DIRLINK] = "dirlink_ns",
+    [H_ICOPY] = "icopy_ns",
+    [H_CHAIN_LEN] = "chain_len",
+    [H_BALLOC_SCAN] = "balloc_scan",
+    [H_DIRLOOKUP_SCAN] = "dirlookup_scan",
+};
+
+// Blocks live as long as the process, so the counts of threads
+// that already exited still show up in snapshots.
+stats *stats_thread() {
+    stats *s = calloc(1, sizeof(stats));
+    assert(s);
+
+    pthread_mutex_lock(&stats_lock);
+    s->next = stats_list;
+    stats_list = s;
+    pthread_mutex_unlock(&stats_lock);
+
+    stats_tls = s;
+    return s;
+}
+
+void stats_snapshot(stats *out) {
+    memset(out, 0, sizeof(stats));
+
+    pthread_mutex_lock(&stats_lock);
+    for (stats *s = stats_list; s; s = s->next) {
+        for (int i = 0; i < NSTAT; i++)
+            out->count[i] += s->count[i];
+        for (int h = 0; h < NHIST; h++) {
+            for (int b = 0; b < HIST_BUCKETS; b++)
+                out->hist[h].buckets[b] += s->hist[h].buckets[b];
+            out->hist[h].count += s->hist[h].count;
+            out->hist[h].sum += s->hist[h].sum;
+        }
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+void stats_reset() {
+    pthread_mutex_lock(&stats_lock);
+    for (stats *s = stats_list; s; s = s->next) {
+        memset(s->count, 0, sizeof(s->count));
+        memset(s->hist, 0, sizeof(s->hist));
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+u64 stats_percentile(stat_hist *hs, double p) {
+    if (hs->count == 0)
+        return 0;
+
+    u64 want = (u64)(p * hs->count + 0.5), seen = 0;
+    if (want == 0)
+        want = 1;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += hs->buckets[b];
+        if (seen >= want)
+            return (2ull << b) - 1;
+    }
+    return ~0ull;
+}
+
+void stats_dump(FILE *f, stats *s) {
+    for (int i = 0; i < NSTAT; i++)
+        fprintf(f, "%-16s %llu\n", stat_names[i], s->count[i]);
+
+    for (int h = 0; h < NHIST; h++) {
+        stat_hist *hs = &s->hist[h];
+        fprintf(f, "%-16s n=%llu mean=%llu p50<=%llu p99<=%llu\n",
+                hist_names[h], hs->count, hs->count ? hs->sum / hs->count : 0,
+                stats_percentile(hs, 0.50), stats_percentile(hs, 0.99));
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            if (hs->buckets[b])
+                fprintf(f, "  [%llu, %llu) %llu\n", b ? 1ull << b : 0,
+                        2ull << b, hs->buckets[b]);
+        }
+    }
+}
+
+void test_stats() {
+    stats before, after;
+
+    stats_reset();
+    stats_snapshot(&before);
+    assert(before.count[ST_BREAD] == 0);
+
+    inode *ip = namei("/TEST_DIR/POEM.TXT");
+    assert(ip);
+    char buf[64];
+    readi(ip, 0, buf, 0, sizeof(buf), NULL);
+
+    stats_snapshot(&after);
+    assert(after.count[ST_BREAD] > 0);
+    assert(after.count[ST_DIRLOOKUP] == 2);
+    assert(after.hist[H_NAMEI].count == 1);
+    assert(after.hist[H_READI].count == 1);
+    stats_dump(stdout, &after);
+}
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <stdio.h>
+#include <time.h>
+
+#include <skinny.h>
+
+// Always-on engine instrumentation.
+//
+// Every thread bumps its own block of counters without atomics, the blocks
+// are chained together so a snapshot can add them up. Snapshots taken while
+// other threads are busy are approximate, which is fine for telling where
+// the time goes.
+
+// Counters
+enum {
+    ST_BREAD,         // bread() calls
+    ST_BREAD_BYTES,
+    ST_BWRITE,        // bwrite() calls
+    ST_BWRITE_BYTES,
+    ST_BMOVE,         // bmove() calls, copies within the image
+    ST_BMOVE_BYTES,
+    ST_BVIEW,         // bview() calls, reads without a copy
+    ST_BVIEW_BYTES,
+    ST_BEXPORT,       // bexport() calls, image to host fd in the kernel
+    ST_BEXPORT_BYTES,
+    ST_FAT_READ,      // FAT entries read
+    ST_FAT_WRITE,     // FAT entries written
+    ST_CHAIN_WALK,    // FOR_EACH_CLUS loops started
+    ST_CHAIN_STEP,    // Clusters visited by them
+    ST_BALLOC,        // Clusters allocated
+    ST_BALLOC_SCAN,   // FAT entries looked at to find them
+    ST_BALLOC_SKIP,   // FAT sectors skipped as full by the free space index
+    ST_FAT_INDEX,     // FAT sectors counted by the indexer
+    ST_DIRLOOKUP,     // fat_dirlookup() calls
+    ST_DIRLOOKUP_SCAN,// Dirents looked at by them
+    ST_RECLAIM,       // Clusters freed by the background reclaimer
+    ST_IFLUSH,        // Dirty inodes written back
+    NSTAT
+};
+
+// Histograms, bucket i counts values in [2^i, 2^(i+1)), bucket 0 also
+// holds zero. Latencies are in nanoseconds.
+enum {
+    H_READI,
+    H_WRITEI,
+    H_NAMEI,
+    H_DIRLINK,
+    H_ICOPY,
+    H_CHAIN_LEN,      // Clusters per FOR_EACH_CLUS loop
+    H_BALLOC_SCAN,    // FAT entries per balloc()
+    H_DIRLOOKUP_SCAN, // Dirents per fat_dirlookup()
+    NHIST
+};
+
+#define HIST_BUCKETS 48
+
+typedef struct stat_hist {
+    u64 buckets[HIST_BUCKETS];
+    u64 count;
+    u64 sum;
+} stat_hist;
+
+typedef struct stats {
+    u64          count[NSTAT];
+    stat_hist    hist[NHIST];
+    struct stats *next; // All thread blocks, for snapshots
+} stats;
+
+extern __thread stats *stats_tls;
+
+// Registers the calling thread's counter block.
+stats *stats_thread();
+
+static inline stats *my_stats() {
+    stats *s = stats_tls;
+    return s ? s : stats_thread();
+}
+
+static inline void stat_add(int c, u64 n) { my_stats()->count[c] += n; }
+
+static inline void stat_record(int h, u64 v) {
+    stat_hist *hs = &my_stats()->hist[h];
+    int b = v ? 63 - __builtin_clzll(v) : 0;
+    hs->buckets[b < HIST_BUCKETS ? b : HIST_BUCKETS - 1]++;
+    hs->count++;
+    hs->sum += v;
+}
+
+static inline u64 stat_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+typedef struct stat_timer {
+    u64 t0;
+    int hist;
+} stat_timer;
+
+static inline void stat_timer_end(stat_timer *t) {
+    stat_record(t->hist, stat_now() - t->t0);
+}
+
+// Times the rest of the enclosing block into histogram `h`, whichever way
+// the block is left.
+#define STAT_TIME(h)                                                           \
+    stat_timer __stat_timer __attribute__((cleanup(stat_timer_end))) = {       \
+        stat_now(), (h)}
+
+// Adds up the counters of every thread into `out`.
+void stats_snapshot(stats *out);
+
+// Zeroes the counters of every thread.
+void stats_reset();
+
+// Returns an upper bound of the `p` quantile (0..1) of `hs`.
+u64 stats_percentile(stat_hist *hs, double p);
+
+void stats_dump(FILE *f, stats *s);
@@ -0,0 +1,121 @@
+#include <assert.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <stats.h>
+#include <trace.h>
+
+int trace_on;
+__thread int trace_depth;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static u64 trace_last;
+
+int trace_start(const char *path) {
+    static int registered;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file)
+        fclose(trace_file);
+    trace_file = fopen(path, "wb");
+    if (trace_file) {
+        setvbuf(trace_file, NULL, _IOFBF, 1 << 20);
+        fwrite(TRACE_MAGIC, 1, 8, trace_file);
+        trace_last = stat_now();
+        if (!registered)
+            atexit(trace_stop);
+        registered = 1;
+    }
+    trace_on = trace_file != NULL;
+    pthread_mutex_unlock(&trace_lock);
+
+    return trace_on ? 0 : -1;
+}
+
+void trace_stop() {
+    pthread_mutex_lock(&trace_lock);
+    trace_on = 0;
+    if (trace_file)
+        fclose(trace_file);
+    trace_file = NULL;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_record(u8 op, u8 type, u32 inum, u32 off, u32 n, const char *name) {
+    u64 now = stat_now();
+    usize len = name ? strlen(name) : 0;
+
+    pthread_mutex_lock(&trace_lock);
+    if (trace_file) {
+        u64 delta = (now > trace_last ? now - trace_last : 0) / 1000;
+        trace_rec rec = {
+            .op = op,
+            .type = type,
+            .name_len = len,
+            .delta_us = delta > 0xffffffff ? 0xffffffff : delta,
+            .inum = inum,
+            .off = off,
+            .n = n,
+        };
+        trace_last = now;
+        fwrite(&rec, sizeof(rec), 1, trace_file);
+        fwrite(name, 1, len, trace_file);
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+FILE *trace_open(const char *path) {
+    char magic[8];
+    FILE *f = fopen(path, "rb");
+
+    if (!f)
+        return NULL;
+    if (fread(magic, 1, 8, f) != 8 || memcmp(magic, TRACE_MAGIC, 8) != 0) {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+int trace_next(FILE *f, trace_rec *rec, char *name, usize name_cap) {
+    if (fread(rec, sizeof(trace_rec), 1, f) != 1)
+        return 0;
+    if (rec->name_len >= name_cap)
+        return 0;
+    if (fread(name, 1, rec->name_len, f) != rec->name_len)
+        return 0;
+    name[rec->name_len] = 0;
+    return 1;
+}
+
+void test_trace() {
+    const char *path = "test.trace";
+    char buf[64], name[256];
+    trace_rec rec;
+
+    assert(trace_start(path) == 0);
+    inode *ip = namei("/TEST_DIR/POEM.TXT");
+    assert(ip);
+    readi(ip, 0, buf, 0, sizeof(buf), NULL);
+    inode *dir = namei("/TEST_DIR");
+    dirlink(dir, "TRACED", T_DIR);
+    trace_stop();
+
+    // dirlink() writes "." and ".." through writei(), those must not show.
+    u8 want[] = {TR_NAMEI, TR_READI, TR_NAMEI, TR_DIRLINK};
+    FILE *f = trace_open(path);
+    assert(f);
+    for (int i = 0; i < sizeof(want); i++) {
+        assert(trace_next(f, &rec, name, sizeof(name)));
+        printf("op %d inum 0x%x off %u n %u name '%s'\n", rec.op, rec.inum,
+               rec.off, rec.n, name);
+        assert(rec.op == want[i]);
+    }
+    assert(!trace_next(f, &rec, name, sizeof(name)));
+    fclose(f);
+    unlink(path);
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <stdio.h>
+
+#include <skinny.h>
+
+// Operation trace recorder.
+//
+// While recording, every public operation appends one fixed-size record,
+// followed by the path or name it was given, to a binary log. Calls the
+// engine makes to itself (dirlink() writing "." and "..", say) are not
+// recorded, so replaying the log repeats exactly what the caller asked for.
+// Setting SKINNY_TRACE=<file> starts recording at init_fs().
+
+#define TRACE_MAGIC "SK32TRC1"
+
+enum {
+    TR_NAMEI = 1,
+    TR_READI,
+    TR_WRITEI,
+    TR_DIRLINK,
+    TR_ITRUNC,
+    TR_ITRUNCATE,
+    TR_UNLINK,
+    TR_RMDIR,
+    TR_FALLOCATE,
+    TR_COMPACT,
+};
+
+typedef struct __attribute__((__packed__)) trace_rec {
+    u8  op;
+    u8  type;     // Inode type for TR_DIRLINK, flags for TR_FALLOCATE
+    u16 name_len; // Bytes of path or name following the record
+    u32 delta_us; // Time since the previous record
+    u32 inum;     // Inode operated on, the parent for TR_DIRLINK
+    u32 off;
+    u32 n;        // Byte count, the length for TR_ITRUNCATE and TR_FALLOCATE
+} trace_rec;
+
+// Starts recording to `path`. Returns -1 if the file cannot be created.
+int trace_start(const char *path);
+
+// Flushes and closes the log.
+void trace_stop();
+
+// Reads the next record from a log opened with trace_open() and its name
+// into `name`, which holds `name_cap` bytes. Returns 0 at the end.
+int trace_next(FILE *f, trace_rec *rec, char *name, usize name_cap);
+
+// Opens a log for reading and checks its header.
+FILE *trace_open(const char *path);
+
+typedef struct trace_guard {
+    int outer;
+} trace_guard;
+
+extern int trace_on;
+extern __thread int trace_depth;
+
+void trace_record(u8 op, u8 type, u32 inum, u32 off, u32 n, const char *name);
+
+static inline trace_guard trace_enter(u8 op, u8 type, u32 inum, u32 off,
+                                      u32 n, const char *name) {
+    trace_guard g = {.outer = trace_depth++ == 0};
+    if (g.outer && trace_on)
+        trace_record(op, type, inum, off, n, name);
+    return g;
+}
+
+static inline void trace_leave(trace_guard *g) { trace_depth--; }
+
+// Records the enclosing operation unless the engine is calling itself.
+#define TRACE_OP(op, type, inum, off, n, name)                                 \
+    trace_guard __trace_guard __attribute__((cleanup(trace_leave))) =          \
+        trace_enter((op), (type), (inum), (off), (n), (name))